@@ -21,62 +21,603 @@
 #include <cstdint>
 #include <vector>
 #include <fstream>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <memory_resource>
+#include <functional>
 
 namespace NeuralNetwork {
+    enum class activation_type : uint32_t {
+        relu = 0,
+        leaky_relu = 1,
+        sigmoid = 2,
+        tanh = 3,
+        gelu = 4,
+        softmax = 5
+    };
+    enum class optimizer_type : uint32_t {
+        sgd = 0,
+        momentum = 1,
+        adam = 2,
+        adamw = 3
+    };
+    enum class layer_type : uint32_t {
+        dense = 0,
+        conv1d = 1,
+        conv2d = 2,
+        embedding = 3
+    };
+    // Tags of the records stored after the input size in version 2+ config data, refer to BINARY.txt
+    enum config_tag : uint32_t {
+        config_activations = 1,
+        config_packed = 2,
+        config_sparse = 3,
+        config_seed = 4,
+        config_optimizer = 5,
+        config_convolution = 6,
+        config_embedding = 7,
+        config_tuning = 8
+    };
     struct file_metadata {
         uint32_t version;
         uint32_t blocks;
         std::vector<uint32_t> block_sizes;
         uint32_t config_size;
         std::vector<uint32_t> config_data;
+
+        // Append-only (v3) files only: where each block lives and its hash, blocks are stored back to back otherwise
+        std::vector<uint64_t> block_offsets;
+        std::vector<uint64_t> block_hashes;
+        uint64_t end = 0; // Byte offset the file's live data ends at
+    };
+    // Shape of a convolution layer. Inputs and outputs are stored channel by channel, each channel row by row
+    // Conv1D layers have a height and kernel height of 1, and are only padded along their width
+    struct convolution {
+        uint32_t channels = 1;
+        uint32_t height = 1;
+        uint32_t width = 0;
+        uint32_t filters = 0;
+        uint32_t kernel_height = 1;
+        uint32_t kernel_width = 0;
+        uint32_t stride = 1;
+        uint32_t padding = 0; // Zeros added on every padded side
+    };
+    // Shape of an embedding layer. Its inputs are fields category ids followed by features plain values, its outputs are each id's row of
+    // the table followed by the plain values. Columns sharing a table should use their own ranges of ids. Ids are whole numbers stored as
+    // floats, so a table holds at most 2^24 categories, and any other id only gets the biases
+    struct embedding {
+        uint32_t categories = 0;
+        uint32_t dimensions = 0;
+        uint32_t fields = 0;
+        uint32_t features = 0;
     };
     struct layer {
         std::vector<float> weights;
         std::vector<float> biases;
         uint32_t input_size;
         uint32_t output_size;
+        activation_type activation = activation_type::relu;
+
+        // Convolution layers hold one bias per filter and weights as [filter][channel][kernel row][kernel column]
+        layer_type type = layer_type::dense;
+        NeuralNetwork::convolution shape;
+
+        // Embedding layers hold the table as [category][dimension] weights and one bias per dimension, and have no activation
+        NeuralNetwork::embedding lookup;
+
+        // Optional panel-major copy of weights used by forward passes, empty when the layer isn't packed
+        std::vector<float> packed;
+        uint32_t panel_width = 0;
+        uint32_t k_block = 0;
+
+        // Threads a forward pass splits this layer's outputs over, 1 unless tune_network found more to be faster
+        uint32_t threads = 1;
+
+        // Compressed sparse rows, used instead of weights when the layer is sparse (weights is then empty)
+        std::vector<float> sparse_values;
+        std::vector<uint32_t> sparse_columns;
+        std::vector<uint32_t> sparse_rows;
+    };
+    struct optimizer {
+        optimizer_type type = optimizer_type::sgd;
+        float learning_rate = 0.01f;
+        float momentum = 0.9f; // Also Adam's beta1
+        float beta2 = 0.999f;
+        float epsilon = 1e-8f;
+        float weight_decay = 0.0f;
+        uint64_t step = 0;
+
+        // Per layer moment buffers, shaped like each layer's weights and biases. Empty until the first step
+        std::vector<std::vector<float>> weight_moments;
+        std::vector<std::vector<float>> bias_moments;
+        std::vector<std::vector<float>> weight_variances;
+        std::vector<std::vector<float>> bias_variances;
     };
     struct network {
         std::vector<layer> layers;
         std::vector<uint32_t> config_data;
+        NeuralNetwork::optimizer optimizer;
     };
-    struct output {
-        std::vector<float> outputs;
-        std::vector<float> activations;
-        std::vector<float> pre_activations;
+    // Buffers come from Allocator, output uses the default heap and pmr::output a caller supplied memory resource
+    template <typename Allocator = std::allocator<float>>
+    struct basic_output {
+        std::vector<float, Allocator> outputs;
+        std::vector<float, Allocator> activations;
+        std::vector<float, Allocator> pre_activations;
     };
-    struct backprop_averages {
-        std::vector<std::vector<std::vector<float>>> weights;
-        std::vector<std::vector<std::vector<float>>> biases;
+    using output = basic_output<>;
+    // Gradients per layer, shaped like each layer's weights (or its non-zero weights when sparse) and biases
+    template <typename Allocator = std::allocator<float>>
+    struct basic_backprop_averages {
+        template <typename T>
+        using buffer = std::vector<T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
+
+        buffer<buffer<float>> weights;
+        buffer<buffer<float>> biases;
+
+        // Embedding layers only: the table rows that were looked up, every other row's gradients are zero and left alone
+        buffer<buffer<uint32_t>> rows;
+    };
+    using backprop_averages = basic_backprop_averages<>;
+    // Per-request variants, every buffer (nested ones included) is allocated from the memory resource they were created with,
+    // such as a std::pmr::monotonic_buffer_resource released after each request or a std::pmr::unsynchronized_pool_resource per thread
+    namespace pmr {
+        using output = basic_output<std::pmr::polymorphic_allocator<float>>;
+        using backprop_averages = basic_backprop_averages<std::pmr::polymorphic_allocator<float>>;
+    }
+    struct allocation_stats {
+        uint64_t allocations = 0;
+        uint64_t deallocations = 0;
+        uint64_t bytes_allocated = 0; // Over every allocation so far
+        uint64_t bytes_in_use = 0;
+        uint64_t peak_bytes = 0;      // Highest bytes_in_use so far
+    };
+    // Scores of a network on a labeled dataset. Each row's class is its highest output, or whether its only output is at least 0.5
+    struct evaluation {
+        uint64_t rows = 0;
+        double loss = 0.0; // Average over the rows
+        double accuracy = 0.0;
+        uint32_t classes = 0;
+        std::vector<uint64_t> confusion; // classes x classes, [expected class][predicted class]
+        std::vector<double> precision;
+        std::vector<double> recall;
+        std::vector<double> f1;
+        double seconds = 0.0;
+        double rows_per_second = 0.0;
+    };
+    // One layer's choice from tune_network, a panel width of 0 keeps the row-major weights
+    struct layer_plan {
+        uint32_t panel_width = 0;
+        uint32_t k_block = 0;
+        uint32_t threads = 1;
+        double seconds = 0.0;  // One forward pass through the layer's GEMM with this plan
+        double baseline = 0.0; // Same, with the layer as it was before tuning
+    };
+    // Rows of inputs and expected outputs, stored back to back
+    struct dataset {
+        std::vector<float> inputs;
+        std::vector<float> outputs;
+        uint32_t input_size = 0;
+        uint32_t output_size = 0;
     };
     struct y {
         std::vector<std::vector<float>> layers;
     };
+    struct block_summary {
+        uint64_t count = 0;
+        float min = 0.0f;
+        float max = 0.0f;
+        double mean = 0.0;
+        double stddev = 0.0;
+        std::vector<uint64_t> histogram;
+    };
     
 
 
 
 
+    // Writes checkpoints of a network on a background thread. save() copies the network into one of two reused snapshot buffers and returns
+    // right away, one snapshot can be written while the next one waits. A waiting snapshot is replaced by a newer one instead of blocking.
+    class checkpointer {
+    public:
+        // Appending checkpointers write each checkpoint with append_network instead of save_network
+        explicit checkpointer(bool append = false);
+        ~checkpointer();
+        checkpointer(const checkpointer&) = delete;
+        checkpointer& operator=(const checkpointer&) = delete;
+
+        void save(const char* location, const NeuralNetwork::network& neural_network);
+
+        // Blocks until every snapshot handed to save() has been written.
+        void wait();
+
+        uint64_t written();
+        uint64_t replaced();
+
+    private:
+        void run();
+
+        NeuralNetwork::network snapshots[2];
+        std::string locations[2];
+        int pending = -1;
+        int writing = -1;
+        bool stopping = false;
+        bool append = false;
+        uint64_t written_count = 0;
+        uint64_t replaced_count = 0;
+        std::mutex saving;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::thread worker;
+    };
+
+
+
+
+    // Passes every allocation through to an upstream memory resource and counts them. The counters are atomic, so it can be shared between
+    // threads whenever the upstream resource can, e.g. wrapped around an arena to size it or around the default resource to find hot paths.
+    class counting_resource : public std::pmr::memory_resource {
+    public:
+        explicit counting_resource(std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+
+        NeuralNetwork::allocation_stats statistics() const;
+        void reset_statistics();
+        std::pmr::memory_resource* upstream_resource() const;
+
+    private:
+        void* do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void* pointer, size_t bytes, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+
+        std::pmr::memory_resource* upstream;
+        std::atomic<uint64_t> allocations{0};
+        std::atomic<uint64_t> deallocations{0};
+        std::atomic<uint64_t> bytes_allocated{0};
+        std::atomic<uint64_t> bytes_in_use{0};
+        std::atomic<uint64_t> peak_bytes{0};
+    };
+
+
+
+
+    // Holds the current version of a network for concurrent readers. acquire() takes a reference-counted snapshot without locking,
+    // publish() swaps in a new version without pausing readers, and an old version is freed when its last snapshot is dropped.
+    class model_handle {
+    public:
+        using snapshot = std::shared_ptr<const NeuralNetwork::network>;
+
+        model_handle() = default;
+        explicit model_handle(NeuralNetwork::network neural_network);
+        ~model_handle();
+        model_handle(const model_handle&) = delete;
+        model_handle& operator=(const model_handle&) = delete;
+
+        snapshot acquire() const;
+        void publish(NeuralNetwork::network neural_network);
+
+        // Loads a .bin file and publishes it, the current version stays when loading fails.
+        void reload(char* location);
+
+        // Number of versions published so far.
+        uint64_t version() const;
+
+    private:
+        std::atomic<snapshot*> current{nullptr};
+        std::atomic<uint64_t> epoch{0};
+        mutable std::atomic<uint64_t> readers[2] = {{0}, {0}};
+        std::atomic<uint64_t> published{0};
+        std::mutex writer;
+    };
+
+
+
+
+    struct registry_counters {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t bytes = 0;  // Memory held by the cached models
+        uint64_t models = 0; // Cached models
+    };
+    // Loads models lazily by path and caches them for every caller. Paths that lead to the same file share one copy, and the least
+    // recently used models are evicted once the cache goes over its memory budget. Evicted models live on until their last snapshot is dropped.
+    class model_registry {
+    public:
+        explicit model_registry(uint64_t budget_bytes);
+
+        // Returns an empty snapshot when the file can't be loaded.
+        model_handle::snapshot get(char* location);
+
+        void set_budget(uint64_t budget_bytes);
+        void clear();
+        NeuralNetwork::registry_counters counters();
+
+    private:
+        struct entry {
+            std::string key;
+            model_handle::snapshot neural_network;
+            uint64_t bytes;
+        };
+        void evict();
+
+        uint64_t budget;
+        std::list<entry> entries; // Most recently used first
+        std::unordered_map<std::string, std::list<entry>::iterator> index;
+        NeuralNetwork::registry_counters totals;
+        std::mutex mutex;
+    };
+
+
+
+
+    struct cache_counters {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t bytes = 0;   // Memory held by the cached inputs and outputs
+        uint64_t entries = 0;
+    };
+    // Caches forward pass outputs by their inputs and model version, so repeated inputs skip the network. Entries are split over shards by
+    // their hash, each shard has its own lock and evicts its least recently used entries once it goes over its share of the memory budget.
+    class inference_cache {
+    public:
+        explicit inference_cache(uint64_t budget_bytes, uint32_t shards = 16);
+
+        // Returns the cached outputs of inputs for the given version of neural_network, forward passing and caching them on a miss.
+        // version has to change whenever the network does, e.g. model_handle::version() read before the snapshot was acquired.
+        std::vector<float> forward(const NeuralNetwork::network& neural_network, uint64_t version, const std::vector<float>& inputs);
+
+        bool lookup(uint64_t version, const std::vector<float>& inputs, std::vector<float>& outputs);
+        void insert(uint64_t version, const std::vector<float>& inputs, const std::vector<float>& outputs);
+
+        void set_budget(uint64_t budget_bytes);
+        void clear();
+        NeuralNetwork::cache_counters counters();
+
+    private:
+        struct entry {
+            uint64_t key;
+            uint64_t version;
+            std::vector<float> inputs;
+            std::vector<float> outputs;
+            uint64_t bytes;
+        };
+        struct shard {
+            std::list<entry> entries; // Most recently used first
+            std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+            NeuralNetwork::cache_counters totals;
+            std::mutex mutex;
+        };
+        shard& shard_of(uint64_t key);
+        void evict(shard& part);
+
+        std::atomic<uint64_t> budget;
+        std::vector<std::unique_ptr<shard>> shards;
+    };
+
+
+
+
+    // Connects worker processes in a ring over TCP for data-parallel training. hosts holds every worker's host in rank order,
+    // worker r listens on base_port + r and connects to worker r + 1. All the hosts are "127.0.0.1" when every worker runs on one machine.
+    class ring {
+    public:
+        ring() = default;
+        ~ring();
+        ring(const ring&) = delete;
+        ring& operator=(const ring&) = delete;
+
+        bool connect(uint32_t rank, const std::vector<std::string>& hosts, uint16_t base_port, double timeout_seconds = 30.0);
+        void close();
+
+        // Sums data element by element across every worker, each worker ends up with the same bits.
+        bool all_reduce(float* data, size_t count);
+
+        uint32_t rank() const;
+        uint32_t size() const;
+
+    private:
+        bool exchange(const char* send, size_t send_size, char* receive, size_t receive_size);
+
+        int next = -1;
+        int previous = -1;
+        uint32_t position = 0;
+        uint32_t workers = 1;
+        std::vector<float> incoming;
+    };
+
+
+
+
+    // Read-only copies of a network, one per NUMA node, each allocated from its own node's memory so inference never reads weights across sockets.
+    class numa_replicas {
+    public:
+        explicit numa_replicas(const NeuralNetwork::network& neural_network);
+
+        // The copy on the node the calling thread is running on.
+        const NeuralNetwork::network& local() const;
+        const NeuralNetwork::network& replica(uint32_t node) const;
+        uint32_t nodes() const;
+
+        // Forward passes rows of inputs stored back to back across the worker threads, returns the rows of outputs back to back.
+        std::vector<float> forward(const std::vector<float>& inputs) const;
+
+    private:
+        std::vector<NeuralNetwork::network> replicas;
+    };
+
+    // Splits a network's layers into contiguous stages that each run on their own thread, pinned to their own core where the OS allows it.
+    // Micro-batches flow between the stages through bounded lock-free queues (GPipe style), stages are balanced by weight count.
+    // The stage threads and queues live as long as the pipeline, so calls don't pay for starting threads.
+    class pipeline {
+    public:
+        pipeline(NeuralNetwork::network& neural_network, uint32_t stages, uint32_t micro_batch_size);
+        ~pipeline();
+        pipeline(const pipeline&) = delete;
+        pipeline& operator=(const pipeline&) = delete;
+
+        // Forward passes rows of inputs stored back to back, returns the rows of outputs back to back.
+        std::vector<float> forward(const std::vector<float>& inputs);
+
+        // Trains like train_network, with the same results. Each batch's micro-batches all go forward through the stages, then all come back.
+        float train(const NeuralNetwork::dataset& data, uint32_t epochs, uint32_t batch_size);
+
+        uint32_t stage_count() const;
+
+        // Stage s holds layers [boundaries()[s], boundaries()[s + 1]).
+        const std::vector<size_t>& boundaries() const;
+
+    private:
+        struct stage_queues; // The queues between neighbouring stages, defined with the stages
+
+        // Runs task(s) on every stage s's thread, wait returns once they have all finished.
+        void start(std::function<void(size_t)> task);
+        void wait();
+
+        NeuralNetwork::network& neural_network;
+        std::vector<size_t> first_layers;
+        size_t micro_batch;
+        std::unique_ptr<stage_queues> queues;
+        std::vector<std::thread> threads;
+        std::function<void(size_t)> task;
+        uint64_t generation = 0;
+        size_t pending = 0; // Stages still running the current task
+        bool stopping = false;
+        std::mutex mutex;
+        std::condition_variable condition;
+    };
+
+
+
+
     void insert_bytes(char* location, std::fstream& file, std::streampos position, size_t old_data_size, const char* data, size_t data_size);
     NeuralNetwork::file_metadata read_metadata(std::fstream& file);
     std::vector<float> read_block(char* location, uint32_t block);
     void write_block(char* location, uint32_t block, std::vector<float> values);
     void new_bin(char* location);
     void write_config(char* location, std::fstream& file, std::vector<uint32_t> config_data);
+    std::vector<uint32_t> read_config_record(const std::vector<uint32_t>& config_data, uint32_t tag);
+    void write_config_record(std::vector<uint32_t>& config_data, uint32_t tag, const std::vector<uint32_t>& values);
+
 
 
 
 
+    // Sets how many threads parallel work is split across, defaults to the number of hardware threads. The worker threads are kept between
+    // loops and restarted with the new count by the next parallel loop.
+    void set_thread_count(uint32_t threads);
+    uint32_t thread_count();
+
+    // On machines with more than one NUMA node, parallel work pins its threads so each node gets a contiguous share of them. On by default.
+    void set_numa_pinning(bool enabled);
+    // Number of NUMA nodes this process can run on, 1 when the OS doesn't report any.
+    uint32_t numa_node_count();
 
     //Creates an initialized, untrained neural network with the amount of layers being the amount of items in an array, and each item's value being the amount of neurons in that layer and the first layer being excluded as the input size.
-    NeuralNetwork::network create_network(std::vector<uint32_t> layers);
+    // Each layer uses the matching activation from activations, or ReLU if none is given. Softmax is only allowed on the last layer.
+    // The same seed always gives the same weights, no matter the thread count. Without a seed a random one is used. Either way it is recorded in the config data.
+    NeuralNetwork::network create_network(std::vector<uint32_t> layers, std::vector<activation_type> activations = {});
+    NeuralNetwork::network create_network(std::vector<uint32_t> layers, std::vector<activation_type> activations, uint64_t seed);
+    // Creates a network that starts with the given convolution layers, in order, followed by dense layers with the given amounts of neurons.
+    // Each convolution's input shape must hold as many values as the previous layer's outputs. Activations and seeds work as in create_network.
+    NeuralNetwork::network create_network(std::vector<NeuralNetwork::convolution> convolutions, std::vector<uint32_t> layers, std::vector<activation_type> activations, uint64_t seed);
+    // Creates a network that starts with an embedding layer, followed by dense layers with the given amounts of neurons.
+    // Activations apply to the dense layers, seeds work as in create_network.
+    NeuralNetwork::network create_network(NeuralNetwork::embedding lookup, std::vector<uint32_t> layers, std::vector<activation_type> activations, uint64_t seed);
+    // Redraws every layer's weights and biases as create_network would with the given seed, keeping the network's layers, shapes, sparsity
+    // pattern and packing. Optimizer moments are cleared, the optimizer's settings are kept.
+    void reseed_network(NeuralNetwork::network& neural_network, uint64_t seed);
+
+    // Saves the network by appending only the blocks that changed since the last save to the end of the .bin file, followed by a new index.
+    // The newest index wins when the file is read. A file that doesn't exist yet is written in full with save_network.
+    void append_network(char* location, const NeuralNetwork::network& neural_network);
+
+    // Rewrites an append-only .bin file as a plain v2 file holding only its live blocks.
+    void compact_network(char* location);
+
+    // Writes a delta file holding only the blocks that differ between two .bin files, as XORed and byte-shuffled float bits.
+    void diff_network(char* old_location, char* new_location, char* delta_location);
+
+    // Applies a delta file to the .bin file it was made from and writes the result to out_location, which may be the same file.
+    void patch_network(char* location, char* delta_location, char* out_location);
+
+    // Saves the given neural network to a .bin file. The file is written to a uniquely named temporary file next to it first and renamed over the
+    // old file, so a crash never leaves a corrupt file and concurrent saves never share a temporary file.
+    void save_network(char* location, const NeuralNetwork::network& neural_network);
+
+    // Loads a neural network from the given .bin file, cached packed layouts are always loaded and prepack packs the remaining layers.
+    // A tuning plan saved by tune_network is applied instead of prepack.
+    NeuralNetwork::network load_network(char* location, bool prepack = false);
 
-    // Deletes the old neural network .bin file, and saves the given neural network to the .bin file.
-    void save_network(char* location, NeuralNetwork::network neural_network);
+    // Rearranges a layer's weights into panels of panel_width outputs (4, 8 or 16), split into blocks of k_block inputs.
+    void pack_layer(NeuralNetwork::layer& layer, uint32_t panel_width, uint32_t k_block);
 
-    // Prints out the contents of the provided neural network.
-    void output_network(char* location, NeuralNetwork::network neural_network);
+    // Converts a layer's weights to compressed sparse rows, or back to dense weights.
+    void sparsify_layer(NeuralNetwork::layer& layer);
+    void densify_layer(NeuralNetwork::layer& layer);
+
+    // Zeroes the smallest weights of every layer until it reaches the given sparsity (0 to 1), layers sparse enough to be faster as compressed sparse rows are converted.
+    void prune_network(NeuralNetwork::network& neural_network, float sparsity);
+
+    // Packs every unpacked layer with a K block sized to this CPU's L1 cache. Repack after changing a layer's weights.
+    void prepack_network(NeuralNetwork::network& neural_network);
+
+    // Micro-benchmarks every dense and convolution layer's GEMM on this machine with each panel width, K block and thread count, and keeps
+    // the fastest. The plan is applied to the layers and stored in the config data, so load_network applies it again once the network is saved.
+    std::vector<NeuralNetwork::layer_plan> tune_network(NeuralNetwork::network& neural_network, double seconds_per_candidate = 0.005);
+
+    // Writes a self-contained C++ header holding the network's weights and a forward function specialized to its layer sizes.
+    void compile_network(char* location, const NeuralNetwork::network& neural_network, const char* name);
+
+    // Computes statistics and a histogram with the given amount of equal width bins for one block of a .bin file, streaming it from disk.
+    NeuralNetwork::block_summary summarize_block(char* location, uint32_t block, uint32_t bins);
+
+    // Prints out the contents of a .bin file block by block, streaming from disk without loading the network. With summary, prints statistics and a histogram per block instead of every value.
+    void output_network(char* location, std::ostream& out, bool summary = false);
 
     // Passes inputs through a given neural network and returns the outputs.
-    output forward_pass(NeuralNetwork::network neural_network, std::vector<float> inputs);
+    output forward_pass(const NeuralNetwork::network& neural_network, const std::vector<float>& inputs);
+
+    // Same, with every output buffer allocated from resource.
+    NeuralNetwork::pmr::output forward_pass(const NeuralNetwork::network& neural_network, const std::vector<float>& inputs, std::pmr::memory_resource* resource);
+
+    // Returns the loss of a forward pass against the expected outputs, cross-entropy for softmax outputs and half mean squared error otherwise.
+    float loss(const NeuralNetwork::network& neural_network, const NeuralNetwork::output& forward_output, const std::vector<float>& expected);
+    float loss(const NeuralNetwork::network& neural_network, const NeuralNetwork::pmr::output& forward_output, const std::vector<float>& expected);
+
+    // Returns the gradients of the loss for one forward pass of the given inputs.
+    backprop_averages backpropagate(const NeuralNetwork::network& neural_network, const std::vector<float>& inputs, const NeuralNetwork::output& forward_output, const std::vector<float>& expected);
+    // Same, with every gradient buffer allocated from resource.
+    NeuralNetwork::pmr::backprop_averages backpropagate(const NeuralNetwork::network& neural_network, const std::vector<float>& inputs, const NeuralNetwork::pmr::output& forward_output, const std::vector<float>& expected, std::pmr::memory_resource* resource);
+
+    // Takes one step of the network's optimizer with the given averaged gradients.
+    void apply_gradients(NeuralNetwork::network& neural_network, const NeuralNetwork::backprop_averages& gradients);
+    void apply_gradients(NeuralNetwork::network& neural_network, const NeuralNetwork::pmr::backprop_averages& gradients);
+
+    // Trains the network on the dataset in mini-batches with its optimizer, returns the average loss of the last epoch.
+    // With a checkpoint location, a checkpoint is written in the background every checkpoint_seconds and once more at the end.
+    float train_network(NeuralNetwork::network& neural_network, const NeuralNetwork::dataset& data, uint32_t epochs, uint32_t batch_size);
+    float train_network(NeuralNetwork::network& neural_network, const NeuralNetwork::dataset& data, uint32_t epochs, uint32_t batch_size, const char* checkpoint_location, double checkpoint_seconds);
+
+    // Data-parallel training: every worker in the ring trains the same network on its own share of the dataset's rows, batch_size rows per worker
+    // per step, with gradients summed across workers so their networks stay identical. Every worker has to call this with the same arguments.
+    // Rows that don't split evenly go one each to the first workers, so every row is trained on.
+    float train_network(NeuralNetwork::network& neural_network, const NeuralNetwork::dataset& data, uint32_t epochs, uint32_t batch_size, NeuralNetwork::ring& workers);
+
+    // Trains independent networks on one shared dataset at the same time, one network per worker thread. Returns each network's average loss of the last epoch.
+    std::vector<float> train_networks(std::vector<NeuralNetwork::network>& networks, const NeuralNetwork::dataset& data, uint32_t epochs, uint32_t batch_size);
+
+    // Reads a .csv dataset, every row holds input_size inputs followed by the expected outputs. A first row that isn't numbers is skipped as a header.
+    NeuralNetwork::dataset load_dataset(char* location, uint32_t input_size);
+
+    // Scores the network on every row of the dataset, rows are forward passed in batches across the worker threads.
+    NeuralNetwork::evaluation evaluate_network(const NeuralNetwork::network& neural_network, const NeuralNetwork::dataset& data);
+    // Same, streaming a .csv dataset (as read by load_dataset) a chunk at a time, the next chunk is read while the current one is scored.
+    NeuralNetwork::evaluation evaluate_network(const NeuralNetwork::network& neural_network, char* location);
 }
\ No newline at end of file
@@ -20,6 +20,9 @@
 #include <vector>
 #include <string>
 #include <chrono>
+#include <sstream>
+#include <filesystem>
+#include <cmath>
 #include "../include/eznet.h"
 #include "../tests/main.h"
 
@@ -28,6 +31,7 @@
         bool bench = false;
         bool shush = false;
         bool force = false;
+        bool summary = false;
 
 // Helpers
         void print(const char* str) {
@@ -50,6 +54,26 @@
                         return false;
                 }
         }
+        bool convert_to_activation(const std::string& str, NeuralNetwork::activation_type& out) {
+                const char* names[] = {"relu", "leaky_relu", "sigmoid", "tanh", "gelu", "softmax"};
+                for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+                        if (str == names[i]) {
+                                out = static_cast<NeuralNetwork::activation_type>(i);
+                                return true;
+                        }
+                }
+                return false;
+        }
+        bool convert_to_optimizer(const std::string& str, NeuralNetwork::optimizer_type& out) {
+                const char* names[] = {"sgd", "momentum", "adam", "adamw"};
+                for (uint32_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+                        if (str == names[i]) {
+                                out = static_cast<NeuralNetwork::optimizer_type>(i);
+                                return true;
+                        }
+                }
+                return false;
+        }
         void remove_whitespace(char* str) {
                 char* dst = str;
                 while (*str) {
@@ -70,6 +94,8 @@
                 println("        Stops any extra prints the command may make");
                 println("    -force");
                 println("        Forces the command to continue even if there is an error/warning");
+                println("    -summary");
+                println("        Makes output print statistics and a histogram per block instead of every value");
                 println("");
                 println("Helper Commands");
                 println("    help");
@@ -78,16 +104,48 @@
                 println("        Displays program version");
                 println("    test");
                 println("        Runs all available tests");
+                println("    test stress <megabytes>");
+                println("        Round trips a .bin file of about the given size (64 by default) within time and memory budgets");
+                println("        ex: eznet test stress 4096");
                 println("");
                 println("Main Commands");
-                println("    create \"file-name\" <number of neurons per layer>");
+                println("    create \"file-name\" <number of neurons per layer> <activation per layer>");
                 println("        Creates/overwrites an empty neural network file with the given name in the current directory");
-                println("        ex: eznet create \"rock-paper-scissors-master.bin\" \"3 4 1\"");
+                println("        activations: relu (default), leaky_relu, sigmoid, tanh, gelu, softmax (last layer only)");
+                println("        ex: eznet create \"rock-paper-scissors-master.bin\" \"3 4 3\" \"relu softmax\"");
                 println("    forward \"file-name\" <inputs>");
                 println("        Computes and returns the forward propagation outputs of a given neural network file in the current directory using the given inputs");
                 println("        ex eznet forward \"rock-paper-scissors-master.bin\" \"3 1 3\"");
+                println("    compile \"file-name\" \"header-name\" <namespace>");
+                println("        Compiles a given neural network file into a self-contained C++ header with its weights and layer sizes baked in");
+                println("        ex: eznet compile \"rock-paper-scissors-master.bin\" \"rps.h\" \"rps\"");
+                println("    prune \"file-name\" <sparsity>");
+                println("        Zeroes the smallest weights of a given neural network file until each layer reaches the given sparsity (0 to 1), very sparse layers are stored compressed");
+                println("        ex: eznet prune \"rock-paper-scissors-master.bin\" 0.9");
+                println("    compact \"file-name\"");
+                println("        Rewrites an append-only neural network file without the stale blocks earlier checkpoints left behind");
+                println("        ex: eznet compact \"rock-paper-scissors-master.bin\"");
+                println("    diff \"old-file-name\" \"new-file-name\" \"delta-name\"");
+                println("        Writes a delta file holding only what changed between two neural network files");
+                println("        ex: eznet diff \"rps-v1.bin\" \"rps-v2.bin\" \"rps-v2.delta\"");
+                println("    patch \"file-name\" \"delta-name\" <output-file-name>");
+                println("        Applies a delta file to the neural network file it was made from, in place unless an output file is given");
+                println("        ex: eznet patch \"rps-v1.bin\" \"rps-v2.delta\"");
+                println("    sweep \"file-name\" \"data-name.csv\" <epochs> <batch size> <learning rates> <optimizers> <seeds> <output-file-name>");
+                println("        Trains one copy of a given neural network file per learning rate, optimizer and seed at the same time on a .csv dataset,");
+                println("        prints every run's final loss and saves the best network, in place unless an output file is given");
+                println("        optimizers: sgd (default), momentum, adam, adamw. seeds: 1 (default) keeps the file's weights, every extra seed redraws them, keeping the file's layers");
+                println("        ex: eznet sweep \"rock-paper-scissors-master.bin\" \"games.csv\" 50 32 \"0.1 0.01 0.001\" \"sgd adam\" 4");
+                println("    eval \"file-name\" \"data-name.csv\"");
+                println("        Scores a given neural network file on a labeled .csv dataset, streamed a chunk at a time, and prints its loss, accuracy,");
+                println("        per class precision, recall and F1, its confusion matrix (up to 16 classes) and its throughput");
+                println("        ex: eznet eval \"rock-paper-scissors-master.bin\" \"holdout.csv\"");
+                println("    tune \"file-name\"");
+                println("        Benchmarks tile sizes and thread counts for each layer of a given neural network file on this machine,");
+                println("        and saves the fastest plan into the file, it is applied whenever the file is loaded");
+                println("        ex: eznet tune \"rock-paper-scissors-master.bin\"");
                 println("    output \"file-name\"");
-                println("        Returns the weights and biases of a given neural network file in the current directory.");
+                println("        Returns the weights and biases of a given neural network file in the current directory, streamed straight from the file.");
                 println("");
         }
 
@@ -98,6 +156,7 @@ int main(int argc, char** argv) {
         bench = false;
         shush = false;
         force = false;
+        summary = false;
         for (int i = 1; i < argc; i++) {
                 if (argv[i][0] != '-') {
                         arguments.push_back(argv[i]);
@@ -108,6 +167,8 @@ int main(int argc, char** argv) {
                                 shush = true;
                         } else if (std::string(argv[i]) == "-force") {
                                 force = true;
+                        } else if (std::string(argv[i]) == "-summary") {
+                                summary = true;
                         } else {
                                 print("Flag \"");
                                 print((char*)argv[i]);
@@ -126,25 +187,254 @@ int main(int argc, char** argv) {
                 print("eznet version ");
                 println(version);
         } else if (cmd == "create") {
-                if (argc <= 3 && !force) {
+                if (arguments.size() < 3 && !force) {
                         println("error: too few arguments");
                 } else {
+                        // Layer sizes and activations may be given as quoted lists or as separate arguments
                         std::vector<uint32_t> layer_sizes;
-                        for (int i = 2; i < argc - 1; i++) {
-                                uint32_t test;
-                                if (convert_to_uint32_t(arguments[i], test)) {
-                                        layer_sizes.push_back(test);
+                        std::vector<NeuralNetwork::activation_type> activations;
+                        for (size_t i = 2; i < arguments.size(); i++) {
+                                std::istringstream sizes(arguments[i]);
+                                std::string size;
+                                while (sizes >> size) {
+                                        uint32_t test;
+                                        NeuralNetwork::activation_type activation;
+                                        if (convert_to_uint32_t(size.c_str(), test)) {
+                                                layer_sizes.push_back(test);
+                                        } else if (convert_to_activation(size, activation)) {
+                                                activations.push_back(activation);
+                                        }
                                 }
                         }
-                        NeuralNetwork::network new_network = NeuralNetwork::create_network(layer_sizes);
+                        NeuralNetwork::network new_network = NeuralNetwork::create_network(layer_sizes, activations);
                         NeuralNetwork::save_network(arguments[1], new_network);
                 }
+        } else if (cmd == "compile") {
+                if (arguments.size() < 3) {
+                        println("error: too few arguments");
+                } else {
+                        NeuralNetwork::network neural_network = NeuralNetwork::load_network(arguments[1]);
+                        if (neural_network.layers.empty()) {
+                                println("error: could not load the given neural network");
+                                return 1;
+                        }
+                        std::string name = (arguments.size() > 3) ? std::string(arguments[3]) : std::filesystem::path(arguments[2]).stem().string();
+                        NeuralNetwork::compile_network(arguments[2], neural_network, name.c_str());
+                }
+        } else if (cmd == "prune") {
+                if (arguments.size() < 3) {
+                        println("error: too few arguments");
+                } else {
+                        NeuralNetwork::network neural_network = NeuralNetwork::load_network(arguments[1]);
+                        if (neural_network.layers.empty()) {
+                                println("error: could not load the given neural network");
+                                return 1;
+                        }
+                        float sparsity;
+                        try {
+                                sparsity = std::stof(arguments[2]);
+                        } catch (...) {
+                                println("error: sparsity must be a number between 0 and 1");
+                                return 1;
+                        }
+                        NeuralNetwork::prune_network(neural_network, sparsity);
+                        NeuralNetwork::save_network(arguments[1], neural_network);
+                }
+        } else if (cmd == "compact") {
+                if (arguments.size() < 2) {
+                        println("error: too few arguments");
+                } else {
+                        NeuralNetwork::compact_network(arguments[1]);
+                }
+        } else if (cmd == "diff") {
+                if (arguments.size() < 4) {
+                        println("error: too few arguments");
+                } else {
+                        NeuralNetwork::diff_network(arguments[1], arguments[2], arguments[3]);
+                }
+        } else if (cmd == "patch") {
+                if (arguments.size() < 3) {
+                        println("error: too few arguments");
+                } else {
+                        NeuralNetwork::patch_network(arguments[1], arguments[2], (arguments.size() > 3) ? arguments[3] : arguments[1]);
+                }
+        } else if (cmd == "sweep") {
+                if (arguments.size() < 6) {
+                        println("error: too few arguments");
+                } else {
+                        NeuralNetwork::network base = NeuralNetwork::load_network(arguments[1]);
+                        if (base.layers.empty()) {
+                                println("error: could not load the given neural network");
+                                return 1;
+                        }
+                        NeuralNetwork::dataset data = NeuralNetwork::load_dataset(arguments[2], base.layers[0].input_size);
+                        if (data.inputs.empty()) {
+                                println("error: could not load the given dataset");
+                                return 1;
+                        }
+                        uint32_t epochs, batch_size, seeds = 1;
+                        if (!convert_to_uint32_t(arguments[3], epochs) || !convert_to_uint32_t(arguments[4], batch_size) || (arguments.size() > 7 && !convert_to_uint32_t(arguments[7], seeds))) {
+                                println("error: epochs, batch size and seeds must be whole numbers");
+                                return 1;
+                        }
+
+                        std::vector<float> learning_rates;
+                        std::istringstream rates(arguments[5]);
+                        std::string rate;
+                        while (rates >> rate) {
+                                try {
+                                        learning_rates.push_back(std::stof(rate));
+                                } catch (...) {
+                                        println("error: learning rates must be numbers");
+                                        return 1;
+                                }
+                        }
+                        std::vector<NeuralNetwork::optimizer_type> optimizers;
+                        if (arguments.size() > 6) {
+                                std::istringstream names(arguments[6]);
+                                std::string name;
+                                while (names >> name) {
+                                        NeuralNetwork::optimizer_type type;
+                                        if (!convert_to_optimizer(name, type)) {
+                                                println("error: unknown optimizer");
+                                                return 1;
+                                        }
+                                        optimizers.push_back(type);
+                                }
+                        }
+                        if (optimizers.empty()) optimizers.push_back(NeuralNetwork::optimizer_type::sgd);
+                        if (learning_rates.empty() || seeds == 0) {
+                                println("error: nothing to sweep");
+                                return 1;
+                        }
+
+                        // One run per seed, optimizer and learning rate, all trained at once on the shared dataset
+                        // Seeded runs keep the file's architecture (convolutions, embeddings, pruning) and only redraw its weights
+                        std::vector<NeuralNetwork::network> networks;
+                        std::vector<uint32_t> run_seeds;
+                        for (uint32_t seed = 0; seed < seeds; seed++) {
+                                NeuralNetwork::network initial = base;
+                                if (seed > 0) NeuralNetwork::reseed_network(initial, seed);
+                                for (NeuralNetwork::optimizer_type type : optimizers) {
+                                        for (float learning_rate : learning_rates) {
+                                                // The file's betas, epsilon and weight decay carry over, its moments only to runs of the same optimizer
+                                                NeuralNetwork::network run = initial;
+                                                if (type != run.optimizer.type) {
+                                                        NeuralNetwork::optimizer settings = run.optimizer;
+                                                        run.optimizer = NeuralNetwork::optimizer{};
+                                                        run.optimizer.momentum = settings.momentum;
+                                                        run.optimizer.beta2 = settings.beta2;
+                                                        run.optimizer.epsilon = settings.epsilon;
+                                                        run.optimizer.weight_decay = settings.weight_decay;
+                                                }
+                                                run.optimizer.type = type;
+                                                run.optimizer.learning_rate = learning_rate;
+                                                networks.push_back(std::move(run));
+                                                run_seeds.push_back(seed);
+                                        }
+                                }
+                        }
+                        std::vector<float> losses = NeuralNetwork::train_networks(networks, data, epochs, batch_size);
+
+                        const char* optimizer_names[] = {"sgd", "momentum", "adam", "adamw"};
+                        size_t best = 0;
+                        for (size_t i = 0; i < networks.size(); i++) {
+                                std::ostringstream line;
+                                line << "run " << i << ": optimizer " << optimizer_names[static_cast<uint32_t>(networks[i].optimizer.type)] << ", learning rate " << networks[i].optimizer.learning_rate << ", seed " << run_seeds[i] << ", loss " << losses[i];
+                                println(line.str().c_str());
+                                if (std::isnan(losses[best]) || losses[i] < losses[best]) best = i; // A diverged run never wins
+                        }
+                        std::ostringstream line;
+                        line << "best: run " << best << ", loss " << losses[best];
+                        println(line.str().c_str());
+                        NeuralNetwork::save_network((arguments.size() > 8) ? arguments[8] : arguments[1], networks[best]);
+                }
+        } else if (cmd == "eval") {
+                if (arguments.size() < 3) {
+                        println("error: too few arguments");
+                } else {
+                        NeuralNetwork::network neural_network = NeuralNetwork::load_network(arguments[1], true);
+                        if (neural_network.layers.empty()) {
+                                println("error: could not load the given neural network");
+                                return 1;
+                        }
+                        NeuralNetwork::evaluation result = NeuralNetwork::evaluate_network(neural_network, arguments[2]);
+                        if (result.rows == 0) {
+                                println("error: could not score the given dataset");
+                                return 1;
+                        }
+
+                        std::ostringstream report;
+                        report << "rows " << result.rows << ", loss " << result.loss << ", accuracy " << result.accuracy << "\n";
+                        for (uint32_t k = 0; k < result.classes; k++) {
+                                uint64_t support = 0;
+                                for (uint32_t j = 0; j < result.classes; j++) support += result.confusion[(size_t)k * result.classes + j];
+                                report << "class " << k << ": precision " << result.precision[k] << ", recall " << result.recall[k] << ", f1 " << result.f1[k] << ", support " << support << "\n";
+                        }
+                        if (result.classes <= 16) {
+                                report << "confusion matrix (rows are expected classes, columns are predicted classes)\n";
+                                for (uint32_t k = 0; k < result.classes; k++) {
+                                        report << "   ";
+                                        for (uint32_t j = 0; j < result.classes; j++) report << " " << result.confusion[(size_t)k * result.classes + j];
+                                        report << "\n";
+                                }
+                        }
+                        report << "throughput: " << static_cast<uint64_t>(result.rows_per_second) << " rows/s";
+                        println(report.str().c_str());
+                }
+        } else if (cmd == "tune") {
+                if (arguments.size() < 2) {
+                        println("error: too few arguments");
+                } else {
+                        NeuralNetwork::network neural_network = NeuralNetwork::load_network(arguments[1]);
+                        if (neural_network.layers.empty()) {
+                                println("error: could not load the given neural network");
+                                return 1;
+                        }
+                        std::vector<NeuralNetwork::layer_plan> plans = NeuralNetwork::tune_network(neural_network);
+
+                        std::ostringstream report;
+                        for (size_t l = 0; l < plans.size(); l++) {
+                                const NeuralNetwork::layer_plan& plan = plans[l];
+                                report << "layer " << l << ": ";
+                                if (plan.seconds == 0.0) {
+                                        report << "not tuned\n";
+                                        continue;
+                                }
+                                if (plan.panel_width == 0) report << "row-major";
+                                else report << "panel width " << plan.panel_width << ", k block " << plan.k_block;
+                                report << ", " << plan.threads << (plan.threads == 1 ? " thread: " : " threads: ") << plan.seconds * 1e6 << "us (was " << plan.baseline * 1e6 << "us)\n";
+                        }
+
+                        // The plan packs the layers again on load, so the packed copies aren't saved
+                        for (NeuralNetwork::layer& layer : neural_network.layers) {
+                                std::vector<float>().swap(layer.packed);
+                                layer.panel_width = 0;
+                                layer.k_block = 0;
+                        }
+                        NeuralNetwork::save_network(arguments[1], neural_network);
+                        report << "saved the plan to \"" << arguments[1] << "\"";
+                        println(report.str().c_str());
+                }
         } else if (cmd == "test") {
-                all_tests();
+                if (arguments.size() >= 2 && arguments[1] == std::string("stress")) {
+                        uint32_t megabytes = 64;
+                        if (arguments.size() >= 3 && (!convert_to_uint32_t(arguments[2], megabytes) || megabytes == 0)) {
+                                println("error: invalid size");
+                        } else {
+                                stress_tests(megabytes);
+                        }
+                } else {
+                        all_tests();
+                }
         } else if (cmd == "forward") {
 
         } else if (cmd == "output") {
-
+                if (arguments.size() < 2) {
+                        println("error: too few arguments");
+                } else {
+                        NeuralNetwork::output_network(arguments[1], std::cout, summary);
+                }
         }
 
 
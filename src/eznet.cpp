@@ -41,6 +41,9 @@
         
         keep weights on every odd block number, and biases on every even block number
 
+        since v2, config data is the input size followed by tagged records (tag, length, values)
+        v3 files are v2 files with appended segments of changed blocks, each ending in an index of every block's offset
+
         for more info, refer to BINARY.txt in "/docs"
 */
 
@@ -49,34 +52,2542 @@
 #include <fstream>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cerrno>
 #include <vector>
 #include <filesystem>
 #include <random>
 #include <cmath>
+#include <string>
+#include <charconv>
+#include <cctype>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <memory_resource>
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#endif
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 // Neural network helper functions
-    float initialize_weight(uint32_t fan_in, std::mt19937 &gen) {
-        return std::normal_distribution<float>(0.0f, std::sqrt(2.0f / fan_in))(gen);
+    // Worker threads used by parallel loops, set through NeuralNetwork::set_thread_count
+    uint32_t worker_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // Which cores each NUMA node has, limited to the cores this process may run on. Nodes without such cores are left out of node_cores,
+    // node_ids holds each entry's real node number and online_nodes every node with memory the kernel has online, which may have gaps
+    struct numa_layout {
+        std::vector<std::vector<uint32_t>> node_cores;
+        std::vector<uint32_t> node_ids;
+        std::vector<uint32_t> online_nodes;
+        std::vector<uint32_t> core_node;
+    };
+
+    // Parses a sysfs list such as "0-3,8-11"
+    std::vector<uint32_t> parse_list(const std::string& list) {
+        std::vector<uint32_t> values;
+        const char* position = list.c_str();
+        const char* end = position + list.size();
+        while (position < end) {
+            uint32_t first = 0, last = 0;
+            std::from_chars_result parsed = std::from_chars(position, end, first);
+            if (parsed.ec != std::errc()) break;
+            last = first;
+            position = parsed.ptr;
+            if (position < end && *position == '-') {
+                parsed = std::from_chars(position + 1, end, last);
+                if (parsed.ec != std::errc()) break;
+                position = parsed.ptr;
+            }
+            for (uint32_t value = first; value <= last; value++) values.push_back(value);
+            if (position < end && *position == ',') position++;
+        }
+        return values;
+    }
+
+    // Reads the NUMA layout from sysfs once, machines without one are a single node holding every core
+    const numa_layout& numa() {
+        static const numa_layout layout = []() {
+            numa_layout found;
+            uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+#if defined(__linux__)
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+            std::ifstream online("/sys/devices/system/node/online");
+            std::string list;
+            if (online.is_open() && std::getline(online, list)) found.online_nodes = parse_list(list);
+            for (uint32_t node : found.online_nodes) {
+                std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+                if (!file.is_open()) continue;
+                std::getline(file, list);
+                std::vector<uint32_t> node_cores;
+                for (uint32_t core : parse_list(list)) {
+                    if (!restricted || (core < CPU_SETSIZE && CPU_ISSET(core, &allowed))) node_cores.push_back(core);
+                }
+                if (node_cores.empty()) continue;
+                found.node_cores.push_back(node_cores);
+                found.node_ids.push_back(node);
+            }
+#endif
+            if (found.node_cores.empty()) {
+                found.node_cores.emplace_back();
+                for (uint32_t core = 0; core < cores; core++) found.node_cores[0].push_back(core);
+                found.node_ids.assign(1, 0);
+            }
+            if (found.online_nodes.empty()) found.online_nodes = found.node_ids;
+            for (uint32_t node = 0; node < found.node_cores.size(); node++) {
+                for (uint32_t core : found.node_cores[node]) {
+                    if (core >= found.core_node.size()) found.core_node.resize(core + 1, 0);
+                    found.core_node[core] = node;
+                }
+            }
+            return found;
+        }();
+        return layout;
+    }
+
+    // Whether parallel_for pins its threads, set through NeuralNetwork::set_numa_pinning
+    bool numa_pinning = true;
+
+    // Pins the calling thread to one core where the OS allows it, so its working set stays in that core's cache
+    void pin_thread(uint32_t core) {
+#if defined(__linux__)
+        cpu_set_t cores;
+        CPU_ZERO(&cores);
+        CPU_SET(core % CPU_SETSIZE, &cores);
+        pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores);
+#else
+        (void)core;
+#endif
+    }
+
+    // Core for thread t of threads, threads are handed to the nodes in contiguous groups so neighbouring ranges of work share a node
+    uint32_t worker_core(size_t t, size_t threads) {
+        const numa_layout& layout = numa();
+        size_t nodes = layout.node_cores.size();
+        size_t node = t * nodes / threads;
+        size_t first = (node * threads + nodes - 1) / nodes;
+        const std::vector<uint32_t>& cores = layout.node_cores[node];
+        return cores[(t - first) % cores.size()];
+    }
+
+    // NUMA node the calling thread is running on
+    uint32_t current_node() {
+#if defined(__linux__)
+        int core = sched_getcpu();
+        const numa_layout& layout = numa();
+        if (core >= 0 && static_cast<size_t>(core) < layout.core_node.size()) return layout.core_node[core];
+#endif
+        return 0;
+    }
+
+    // Spreads a buffer's pages round robin across the NUMA nodes, moving pages that were already touched. Small buffers and single node machines are left alone
+    void interleave_memory(void* data, size_t bytes) {
+#if defined(__linux__) && defined(SYS_mbind)
+        const std::vector<uint32_t>& nodes = numa().online_nodes;
+        if (nodes.size() <= 1 || bytes < (1 << 20)) return;
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        uintptr_t begin = (reinterpret_cast<uintptr_t>(data) + page - 1) / page * page;
+        uintptr_t end = (reinterpret_cast<uintptr_t>(data) + bytes) / page * page;
+        if (end <= begin) return;
+        // Node masks are indexed by node number and hold every online node, not just the ones this process has cores on
+        const size_t bits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> mask(*std::max_element(nodes.begin(), nodes.end()) / bits + 1, 0);
+        for (uint32_t node : nodes) mask[node / bits] |= 1ul << (node % bits);
+        const int interleave = 3, move = 2; // MPOL_INTERLEAVE, MPOL_MF_MOVE
+        if (syscall(SYS_mbind, begin, end - begin, interleave, mask.data(), mask.size() * bits + 1, move) != 0) {
+            // Reported once, the buffer still works wherever its pages ended up
+            static std::atomic<bool> reported{false};
+            if (!reported.exchange(true)) std::cerr << "interleave_memory: mbind failed: " << std::strerror(errno) << "\n";
+        }
+#else
+        (void)data;
+        (void)bytes;
+#endif
+    }
+
+    // Set on threads running a parallel_for body, nested loops then run on their caller instead of oversubscribing the cores
+    thread_local bool inside_parallel_for = false;
+
+    // Persistent workers behind parallel_for, started on first use and pinned once, so a loop costs a wake-up instead of creating threads.
+    // They're restarted only when set_thread_count or set_numa_pinning changed since they were started
+    class thread_pool {
+    public:
+        ~thread_pool() {
+            stop();
+        }
+
+        // Runs task(t) for every t in [0, threads), t = 0 on the caller and the rest on workers. False without running anything if
+        // another thread's loop is using the workers, the caller then runs its loop alone instead of waiting
+        bool run(size_t threads, const std::function<void(size_t)>& task) {
+            std::unique_lock<std::mutex> dispatch(dispatching, std::try_to_lock);
+            if (!dispatch.owns_lock()) return false;
+            bool pin = numa_pinning && numa().node_cores.size() > 1;
+            if (workers.size() + 1 != worker_threads || pin != pinned) {
+                stop();
+                start(worker_threads, pin);
+            }
+            if (threads > workers.size() + 1) return false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                current = &task;
+                participants = threads;
+                pending = threads - 1;
+                generation++;
+            }
+            condition.notify_all();
+            inside_parallel_for = true;
+            task(0);
+            inside_parallel_for = false;
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [this]() {return pending == 0;});
+            return true;
+        }
+
+    private:
+        void start(size_t threads, bool pin) {
+            pinned = pin;
+            for (size_t t = 1; t < threads; t++) workers.emplace_back(&thread_pool::work, this, t, threads, pin, generation);
+        }
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            condition.notify_all();
+            for (std::thread& worker : workers) worker.join();
+            workers.clear();
+            stopping = false;
+        }
+        // seen starts at the generation the worker was started in, so a loop dispatched before it first takes the lock isn't missed
+        void work(size_t t, size_t threads, bool pin, uint64_t seen) {
+            if (pin) pin_thread(worker_core(t, threads));
+            inside_parallel_for = true;
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                condition.wait(lock, [&]() {return stopping || generation != seen;});
+                if (stopping) return;
+                seen = generation;
+                // Loops with fewer ranges than workers leave the last workers asleep
+                if (t >= participants) continue;
+                const std::function<void(size_t)>& task = *current;
+                lock.unlock();
+                task(t);
+                lock.lock();
+                if (--pending == 0) finished.notify_all();
+            }
+        }
+
+        std::vector<std::thread> workers;
+        bool pinned = false;
+        const std::function<void(size_t)>* current = nullptr;
+        size_t participants = 0;
+        size_t pending = 0;
+        uint64_t generation = 0;
+        bool stopping = false;
+        std::mutex dispatching;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::condition_variable finished;
+    };
+    thread_pool& worker_pool() {
+        static thread_pool pool;
+        return pool;
+    }
+
+    // Splits [0, count) into one contiguous range per thread, ranges smaller than grain run on the caller. The ranges go to the persistent
+    // workers, a loop started while another thread's loop holds them runs on its caller
+    template <typename F>
+    void parallel_for(size_t count, size_t grain, F&& body) {
+        size_t threads = std::min<size_t>(worker_threads, std::max<size_t>(1, count / std::max<size_t>(1, grain)));
+        if (threads <= 1 || inside_parallel_for) {
+            if (count > 0) body(size_t(0), count);
+            return;
+        }
+        size_t chunk = (count + threads - 1) / threads;
+        const std::function<void(size_t)> task = [&](size_t t) {
+            size_t begin = std::min(count, t * chunk);
+            size_t end = std::min(count, begin + chunk);
+            if (begin < end) body(begin, end);
+        };
+        if (!worker_pool().run(threads, task)) body(size_t(0), count);
+    }
+
+    // Philox4x32-10 counter-based generator, every counter maps to 4 independent random words
+    inline void philox(const uint32_t counter[4], uint64_t seed, uint32_t out[4]) {
+        uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+        uint32_t k0 = static_cast<uint32_t>(seed), k1 = static_cast<uint32_t>(seed >> 32);
+        for (int round = 0; round < 10; round++) {
+            if (round > 0) {k0 += 0x9E3779B9u;k1 += 0xBB67AE85u;}
+            uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * c0;
+            uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * c2;
+            uint32_t n0 = static_cast<uint32_t>(p1 >> 32) ^ c1 ^ k0;
+            uint32_t n2 = static_cast<uint32_t>(p0 >> 32) ^ c3 ^ k1;
+            c1 = static_cast<uint32_t>(p1);
+            c3 = static_cast<uint32_t>(p0);
+            c0 = n0;
+            c2 = n2;
+        }
+        out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+    }
+
+    // Fills weights[begin, end) with He-initialized normals. Weight i always comes from counter (i / 4, layer), so the values don't depend on how the range is split
+    void initialize_weights(float* weights, size_t size, size_t begin, size_t end, uint32_t layer, uint32_t fan_in, uint64_t seed) {
+        const size_t batch = 64; // Counters per batch, 4 normals each
+        const float two_pi = 6.28318530718f;
+        float stddev = std::sqrt(2.0f / static_cast<float>(fan_in));
+        float u1[batch * 2], u2[batch * 2], z[batch * 4];
+
+        for (size_t first = begin / 4; first * 4 < end; first += batch) {
+            size_t counters = std::min(batch, (end + 3) / 4 - first);
+
+            // Uniforms in (0, 1), never 0 so the log is finite
+            for (size_t b = 0; b < counters; b++) {
+                uint32_t counter[4] = {static_cast<uint32_t>(first + b), static_cast<uint32_t>((first + b) >> 32), layer, 0};
+                uint32_t words[4];
+                philox(counter, seed, words);
+                u1[b * 2] = ((words[0] >> 8) + 0.5f) * (1.0f / 16777216.0f);
+                u2[b * 2] = ((words[1] >> 8) + 0.5f) * (1.0f / 16777216.0f);
+                u1[b * 2 + 1] = ((words[2] >> 8) + 0.5f) * (1.0f / 16777216.0f);
+                u2[b * 2 + 1] = ((words[3] >> 8) + 0.5f) * (1.0f / 16777216.0f);
+            }
+
+            // Box-Muller over the whole batch at once so the transcendental loop vectorizes
+            for (size_t i = 0; i < counters * 2; i++) {
+                float radius = stddev * std::sqrt(-2.0f * std::log(u1[i]));
+                float theta = two_pi * u2[i];
+                z[i * 2] = radius * std::cos(theta);
+                z[i * 2 + 1] = radius * std::sin(theta);
+            }
+
+            size_t from = std::max(begin, first * 4);
+            size_t to = std::min({end, size, (first + counters) * 4});
+            for (size_t i = from; i < to; i++) weights[i] = z[i - first * 4];
+        }
+    }
+
+    // rows x depth weights from layer index's counters, each thread fills its own range in multiples of 4 so no counter is split between threads
+    std::vector<float> initialized_weights(size_t rows, size_t depth, uint32_t index, uint64_t seed) {
+        size_t size = rows * depth;
+        std::vector<float> weights(size);
+        float* data = weights.data();
+        parallel_for((size + 3) / 4, 1 << 14, [&](size_t begin, size_t end) {
+            initialize_weights(data, size, begin * 4, std::min(size, end * 4), index, static_cast<uint32_t>(depth), seed);
+        });
+        return weights;
+    }
+    // Branch-free exp (Cephes expf polynomial) so activation loops can vectorize
+    inline float fast_exp(float x) {
+        x = std::min(std::max(x, -87.3f), 88.3f);
+        float n = std::floor(x * 1.44269504f + 0.5f);
+        float r = x - n * 0.693359375f + n * 2.12194440e-4f;
+        float y = ((((((1.9875691500e-4f * r + 1.3981999507e-3f) * r + 8.3334519073e-3f) * r + 4.1665795894e-2f) * r + 1.6666665459e-1f) * r + 5.0000001201e-1f) * r * r) + r + 1.0f;
+        int32_t bits = (static_cast<int32_t>(n) + 127) << 23;
+        float scale;
+        std::memcpy(&scale, &bits, sizeof(scale));
+        return y * scale;
+    }
+    inline float fast_sigmoid(float x) {
+        return 1.0f / (1.0f + fast_exp(-x));
+    }
+    inline float fast_tanh(float x) {
+        return 2.0f * fast_sigmoid(2.0f * x) - 1.0f;
+    }
+    const float leaky_relu_slope = 0.01f;
+    const float gelu_scale = 0.7978845608f; // sqrt(2 / pi)
+
+    // Applies an activation to a whole layer at once, the switch sits outside the loops so each one vectorizes
+    void activation_function(NeuralNetwork::activation_type type, const float* input, float* output, size_t size) {
+        switch (type) {
+            case NeuralNetwork::activation_type::relu:
+                for (size_t i = 0; i < size; i++) output[i] = std::max(0.0f, input[i]);
+                break;
+            case NeuralNetwork::activation_type::leaky_relu:
+                for (size_t i = 0; i < size; i++) output[i] = (input[i] > 0.0f) ? input[i] : leaky_relu_slope * input[i];
+                break;
+            case NeuralNetwork::activation_type::sigmoid:
+                for (size_t i = 0; i < size; i++) output[i] = fast_sigmoid(input[i]);
+                break;
+            case NeuralNetwork::activation_type::tanh:
+                for (size_t i = 0; i < size; i++) output[i] = fast_tanh(input[i]);
+                break;
+            case NeuralNetwork::activation_type::gelu:
+                for (size_t i = 0; i < size; i++) {
+                    float x = input[i];
+                    output[i] = 0.5f * x * (1.0f + fast_tanh(gelu_scale * (x + 0.044715f * x * x * x)));
+                }
+                break;
+            case NeuralNetwork::activation_type::softmax: {
+                // Subtracting the max keeps every exponent <= 0
+                float max = input[0];
+                for (size_t i = 1; i < size; i++) max = std::max(max, input[i]);
+                float sum = 0.0f;
+                for (size_t i = 0; i < size; i++) {
+                    output[i] = fast_exp(input[i] - max);
+                    sum += output[i];
+                }
+                float inverse = 1.0f / sum;
+                for (size_t i = 0; i < size; i++) output[i] *= inverse;
+                break;
+            }
+        }
+    }
+
+    // d(activation)/d(pre-activation) for a whole layer, softmax is only ever differentiated through its fused loss
+    void activation_function_derivative(NeuralNetwork::activation_type type, const float* pre_activations, const float* activations, float* derivative, size_t size) {
+        switch (type) {
+            case NeuralNetwork::activation_type::relu:
+                for (size_t i = 0; i < size; i++) derivative[i] = (pre_activations[i] > 0.0f) ? 1.0f : 0.0f;
+                break;
+            case NeuralNetwork::activation_type::leaky_relu:
+                for (size_t i = 0; i < size; i++) derivative[i] = (pre_activations[i] > 0.0f) ? 1.0f : leaky_relu_slope;
+                break;
+            case NeuralNetwork::activation_type::sigmoid:
+                for (size_t i = 0; i < size; i++) derivative[i] = activations[i] * (1.0f - activations[i]);
+                break;
+            case NeuralNetwork::activation_type::tanh:
+                for (size_t i = 0; i < size; i++) derivative[i] = 1.0f - activations[i] * activations[i];
+                break;
+            case NeuralNetwork::activation_type::gelu:
+                for (size_t i = 0; i < size; i++) {
+                    float x = pre_activations[i];
+                    float t = fast_tanh(gelu_scale * (x + 0.044715f * x * x * x));
+                    derivative[i] = 0.5f * (1.0f + t) + 0.5f * x * (1.0f - t * t) * gelu_scale * (1.0f + 3.0f * 0.044715f * x * x);
+                }
+                break;
+            case NeuralNetwork::activation_type::softmax:
+                for (size_t i = 0; i < size; i++) derivative[i] = 1.0f;
+                break;
+        }
+    }
+
+    // Dot product with 8 independent accumulators so the compiler can vectorize without reassociating
+    inline float dot(const float* a, const float* b, size_t size) {
+        float lanes[8] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+        size_t k = 0;
+        for (; k + 8 <= size; k += 8) {
+            for (size_t l = 0; l < 8; l++) lanes[l] += a[k + l] * b[k + l];
+        }
+        for (size_t l = 0; k + l < size; l++) lanes[l] += a[k + l] * b[k + l];
+        return ((lanes[0] + lanes[4]) + (lanes[1] + lanes[5])) + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7]));
+    }
+
+    // Packed micro-kernel: COLS input rows against one NR wide panel, each input is broadcast across the panel's lanes
+    template <size_t NR, size_t COLS>
+    inline void packed_panel(const float* panel, size_t length, const float* inputs, size_t input_stride, float* outputs, size_t output_stride, size_t rows) {
+        float acc[COLS][NR] = {};
+        for (size_t k = 0; k < length; k++) {
+            const float* lanes = panel + k * NR;
+            for (size_t c = 0; c < COLS; c++) {
+                float x = inputs[c * input_stride + k];
+                for (size_t r = 0; r < NR; r++) acc[c][r] += x * lanes[r];
+            }
+        }
+        for (size_t c = 0; c < COLS; c++) {
+            for (size_t r = 0; r < rows; r++) outputs[c * output_stride + r] += acc[c][r];
+        }
+    }
+
+    // Rows and columns of a layer's weight matrix, convolutions have one row per filter and one column per value under the kernel
+    // Embeddings have one row per category and one column per dimension
+    size_t gemm_rows(const NeuralNetwork::layer& layer) {
+        if (layer.type == NeuralNetwork::layer_type::embedding) return layer.lookup.categories;
+        return layer.type == NeuralNetwork::layer_type::dense ? layer.output_size : layer.shape.filters;
+    }
+    size_t gemm_depth(const NeuralNetwork::layer& layer) {
+        if (layer.type == NeuralNetwork::layer_type::dense) return layer.input_size;
+        if (layer.type == NeuralNetwork::layer_type::embedding) return layer.lookup.dimensions;
+        return (size_t)layer.shape.channels * layer.shape.kernel_height * layer.shape.kernel_width;
+    }
+
+    // Ids arrive as floats, which hold every whole number up to 2^24 exactly
+    const uint32_t embedding_categories = 1u << 24;
+
+    // Table row an embedding input selects, UINT32_MAX for ids that aren't a whole number below the table's categories
+    uint32_t embedding_index(const NeuralNetwork::layer& layer, float id) {
+        if (!(id >= 0.0f && id < static_cast<float>(layer.lookup.categories))) return UINT32_MAX;
+        uint32_t index = static_cast<uint32_t>(id);
+        return static_cast<float>(index) == id ? index : UINT32_MAX;
+    }
+
+    // outputs[count x rows] = biases + inputs[count x depth] * weights^T for the outputs of panels [first, last), using the layer's panel-major weights
+    template <size_t NR>
+    void packed_gemm(const NeuralNetwork::layer& layer, const float* inputs, size_t count, float* outputs, size_t first, size_t last) {
+        size_t rows = gemm_rows(layer);
+        size_t depth = gemm_depth(layer);
+        size_t panels = (rows + NR - 1) / NR;
+        size_t first_row = first * NR, last_row = std::min(rows, last * NR);
+        for (size_t c = 0; c < count; c++) std::copy(layer.biases.begin() + first_row, layer.biases.begin() + last_row, outputs + c * rows + first_row);
+
+        // Walk K in cache sized blocks so each block's slice of the inputs stays hot across every panel
+        const float* block = layer.packed.data();
+        for (size_t k = 0; k < depth; k += layer.k_block) {
+            size_t length = std::min<size_t>(layer.k_block, depth - k);
+            for (size_t p = first; p < last; p++) {
+                const float* panel = block + p * length * NR;
+                size_t panel_rows = std::min(NR, rows - p * NR);
+                size_t c = 0;
+                for (; c + 4 <= count; c += 4) packed_panel<NR, 4>(panel, length, inputs + c * depth + k, depth, outputs + c * rows + p * NR, rows, panel_rows);
+                for (; c < count; c++) packed_panel<NR, 1>(panel, length, inputs + c * depth + k, depth, outputs + c * rows + p * NR, rows, panel_rows);
+            }
+            block += panels * length * NR;
+        }
+    }
+    void packed_gemm(const NeuralNetwork::layer& layer, const float* inputs, size_t count, float* outputs, size_t first, size_t last) {
+        switch (layer.panel_width) {
+            case 4: packed_gemm<4>(layer, inputs, count, outputs, first, last); break;
+            case 16: packed_gemm<16>(layer, inputs, count, outputs, first, last); break;
+            default: packed_gemm<8>(layer, inputs, count, outputs, first, last); break;
+        }
+    }
+
+    // Same product from the packed weights when there are some and the row-major weights otherwise. Tuned layers split their panels (or rows)
+    // over layer.threads threads, every output is still summed in the same order
+    void layer_gemm(const NeuralNetwork::layer& layer, const float* inputs, size_t count, float* outputs) {
+        size_t rows = gemm_rows(layer);
+        size_t depth = gemm_depth(layer);
+        bool packed = !layer.packed.empty();
+        size_t units = packed ? (rows + layer.panel_width - 1) / layer.panel_width : rows;
+        size_t grain = (units + std::max<size_t>(layer.threads, 1) - 1) / std::max<size_t>(layer.threads, 1);
+        parallel_for(units, std::max<size_t>(grain, 1), [&](size_t begin, size_t end) {
+            if (packed) {
+                packed_gemm(layer, inputs, count, outputs, begin, end);
+                return;
+            }
+            for (size_t c = 0; c < count; c++) {
+                for (size_t j = begin; j < end; j++) outputs[c * rows + j] = layer.biases[j] + dot(inputs + c * depth, &layer.weights[j * depth], depth);
+            }
+        });
+    }
+
+    // c[m x n] += a[m x depth] * b[depth x n] for products with no layer behind them, like a convolution's backward pass. b is copied into
+    // 8 wide panels so the product runs through the packed micro-kernel, rows of c are split over threads threads as in layer_gemm
+    void panel_gemm(const float* a, const float* b, size_t m, size_t n, size_t depth, float* c, uint32_t threads) {
+        constexpr size_t NR = 8;
+        size_t panels = (n + NR - 1) / NR;
+        std::vector<float> packed(panels * depth * NR, 0.0f);
+        for (size_t p = 0; p < panels; p++) {
+            size_t columns = std::min(NR, n - p * NR);
+            float* panel = packed.data() + p * depth * NR;
+            for (size_t k = 0; k < depth; k++) std::copy(b + k * n + p * NR, b + k * n + p * NR + columns, panel + k * NR);
+        }
+        size_t grain = (m + std::max<size_t>(threads, 1) - 1) / std::max<size_t>(threads, 1);
+        parallel_for(m, std::max<size_t>(grain, 1), [&](size_t begin, size_t end) {
+            for (size_t p = 0; p < panels; p++) {
+                const float* panel = packed.data() + p * depth * NR;
+                size_t columns = std::min(NR, n - p * NR);
+                size_t i = begin;
+                for (; i + 4 <= end; i += 4) packed_panel<NR, 4>(panel, depth, a + i * depth, depth, c + i * n + p * NR, n, columns);
+                for (; i < end; i++) packed_panel<NR, 1>(panel, depth, a + i * depth, depth, c + i * n + p * NR, n, columns);
+            }
+        });
+    }
+
+    // Output rows and columns of a convolution, only Conv2D layers are padded along their height
+    size_t convolution_height(const NeuralNetwork::convolution& shape, NeuralNetwork::layer_type type) {
+        size_t padding = type == NeuralNetwork::layer_type::conv2d ? shape.padding : 0;
+        return (shape.height + 2 * padding - shape.kernel_height) / shape.stride + 1;
+    }
+    size_t convolution_width(const NeuralNetwork::convolution& shape) {
+        return (shape.width + 2 * shape.padding - shape.kernel_width) / shape.stride + 1;
+    }
+
+    // Whether a shape can be convolved: every size is above zero and the kernel fits inside the padded input
+    bool valid_convolution(const NeuralNetwork::convolution& shape, NeuralNetwork::layer_type type) {
+        size_t padding = type == NeuralNetwork::layer_type::conv2d ? shape.padding : 0;
+        if (shape.channels == 0 || shape.height == 0 || shape.width == 0 || shape.filters == 0 || shape.kernel_height == 0 || shape.kernel_width == 0 || shape.stride == 0) return false;
+        if (type == NeuralNetwork::layer_type::conv1d && (shape.height != 1 || shape.kernel_height != 1)) return false;
+        return shape.height + 2 * padding >= shape.kernel_height && shape.width + 2 * shape.padding >= shape.kernel_width;
+    }
+
+    // im2col: one row per output position holding every input value under the kernel there, in the weights' [channel][row][column] order
+    // Positions outside the input read the padding's zeros
+    void convolution_columns(const NeuralNetwork::layer& layer, const float* inputs, float* columns) {
+        const NeuralNetwork::convolution& shape = layer.shape;
+        size_t out_height = convolution_height(shape, layer.type), out_width = convolution_width(shape);
+        long padding_y = layer.type == NeuralNetwork::layer_type::conv2d ? shape.padding : 0, padding_x = shape.padding;
+        size_t depth = gemm_depth(layer);
+        for (size_t oy = 0; oy < out_height; oy++) {
+            for (size_t ox = 0; ox < out_width; ox++) {
+                float* row = columns + (oy * out_width + ox) * depth;
+                for (size_t c = 0; c < shape.channels; c++) {
+                    const float* channel = inputs + c * shape.height * shape.width;
+                    for (size_t ky = 0; ky < shape.kernel_height; ky++) {
+                        long y = static_cast<long>(oy * shape.stride + ky) - padding_y;
+                        bool inside = y >= 0 && y < static_cast<long>(shape.height);
+                        for (size_t kx = 0; kx < shape.kernel_width; kx++) {
+                            long x = static_cast<long>(ox * shape.stride + kx) - padding_x;
+                            *row++ = (inside && x >= 0 && x < static_cast<long>(shape.width)) ? channel[y * shape.width + x] : 0.0f;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // col2im: adds each row's values back onto the input values they were read from, the padding's share is dropped
+    void add_convolution_columns(const NeuralNetwork::layer& layer, const float* columns, float* inputs) {
+        const NeuralNetwork::convolution& shape = layer.shape;
+        size_t out_height = convolution_height(shape, layer.type), out_width = convolution_width(shape);
+        long padding_y = layer.type == NeuralNetwork::layer_type::conv2d ? shape.padding : 0, padding_x = shape.padding;
+        size_t depth = gemm_depth(layer);
+        for (size_t oy = 0; oy < out_height; oy++) {
+            for (size_t ox = 0; ox < out_width; ox++) {
+                const float* row = columns + (oy * out_width + ox) * depth;
+                for (size_t c = 0; c < shape.channels; c++) {
+                    float* channel = inputs + c * shape.height * shape.width;
+                    for (size_t ky = 0; ky < shape.kernel_height; ky++) {
+                        long y = static_cast<long>(oy * shape.stride + ky) - padding_y;
+                        bool inside = y >= 0 && y < static_cast<long>(shape.height);
+                        for (size_t kx = 0; kx < shape.kernel_width; kx++, row++) {
+                            long x = static_cast<long>(ox * shape.stride + kx) - padding_x;
+                            if (inside && x >= 0 && x < static_cast<long>(shape.width)) channel[y * shape.width + x] += *row;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Sparse rows times a dense vector, 8 accumulators per row keep the gathers independent
+    void sparse_gemv(const NeuralNetwork::layer& layer, const float* inputs, float* outputs) {
+        const float* values = layer.sparse_values.data();
+        const uint32_t* columns = layer.sparse_columns.data();
+        for (size_t j = 0; j < layer.output_size; j++) {
+            float lanes[8] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};
+            size_t p = layer.sparse_rows[j];
+            size_t end = layer.sparse_rows[j + 1];
+            for (; p + 8 <= end; p += 8) {
+                for (size_t l = 0; l < 8; l++) lanes[l] += values[p + l] * inputs[columns[p + l]];
+            }
+            for (; p < end; p++) lanes[0] += values[p] * inputs[columns[p]];
+            outputs[j] = layer.biases[j] + (((lanes[0] + lanes[4]) + (lanes[1] + lanes[5])) + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7])));
+        }
+    }
+
+    // Layers at or below this fraction of non-zero weights are faster as compressed sparse rows
+    const float sparse_density = 0.3f;
+
+    // Index blocks are stored through the float block functions, bit for bit
+    std::vector<float> index_block(const std::vector<uint32_t>& indices) {
+        std::vector<float> block(indices.size());
+        if (!indices.empty()) std::memcpy(block.data(), indices.data(), indices.size() * sizeof(uint32_t));
+        return block;
+    }
+    std::vector<uint32_t> index_block(const std::vector<float>& block) {
+        std::vector<uint32_t> indices(block.size());
+        if (!block.empty()) std::memcpy(indices.data(), block.data(), block.size() * sizeof(uint32_t));
+        return indices;
+    }
+
+    // Sizes gradient buffers to match the network and zeroes them, sparse layers only get gradients for their non-zero weights
+    // Embedding tables are zeroed in full once, after that only the rows that were looked up are
+    template <typename Gradients>
+    void zero_gradients(const NeuralNetwork::network& neural_network, Gradients& gradients) {
+        gradients.weights.resize(neural_network.layers.size());
+        gradients.biases.resize(neural_network.layers.size());
+        gradients.rows.resize(neural_network.layers.size());
+        for (size_t l = 0; l < neural_network.layers.size(); l++) {
+            const NeuralNetwork::layer& layer = neural_network.layers[l];
+            size_t weights = layer.sparse_rows.empty() ? layer.weights.size() : layer.sparse_values.size();
+            if (layer.type == NeuralNetwork::layer_type::embedding && gradients.weights[l].size() == weights) {
+                size_t dimensions = layer.lookup.dimensions;
+                for (uint32_t row : gradients.rows[l]) std::fill_n(&gradients.weights[l][row * dimensions], dimensions, 0.0f);
+                gradients.rows[l].clear();
+                gradients.biases[l].assign(layer.biases.size(), 0.0f);
+                continue;
+            }
+            gradients.rows[l].clear();
+            bool allocated = gradients.weights[l].capacity() < weights;
+            gradients.weights[l].assign(weights, 0.0f);
+            gradients.biases[l].assign(layer.biases.size(), 0.0f);
+            // Training buffers are shared by every thread, so they're spread over the nodes instead of all living on the first one
+            if (allocated) interleave_memory(gradients.weights[l].data(), weights * sizeof(float));
+        }
+    }
+    // Each row once, in order, however many times it was looked up
+    template <typename Rows>
+    Rows unique_rows(Rows rows) {
+        std::sort(rows.begin(), rows.end());
+        rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+        return rows;
+    }
+    template <typename Gradients>
+    void scale_gradients(const NeuralNetwork::network& neural_network, Gradients& gradients, float scale) {
+        for (size_t l = 0; l < gradients.weights.size(); l++) {
+            if (l < neural_network.layers.size() && neural_network.layers[l].type == NeuralNetwork::layer_type::embedding) {
+                size_t dimensions = neural_network.layers[l].lookup.dimensions;
+                gradients.rows[l] = unique_rows(std::move(gradients.rows[l]));
+                for (uint32_t row : gradients.rows[l]) for (size_t d = 0; d < dimensions; d++) gradients.weights[l][row * dimensions + d] *= scale;
+            } else {
+                for (float& gradient : gradients.weights[l]) gradient *= scale;
+            }
+        }
+        for (auto& layer : gradients.biases) for (float& gradient : layer) gradient *= scale;
+    }
+
+    // Backward pass of one sample through layers [begin, end). pre_activations and activations hold those layers' values back to back and inputs
+    // is layer begin's input. back holds the loss gradient of layer end - 1's activations on entry, and that of layer begin's inputs on return
+    // (unless begin is 0). layer_done is called with each layer's index as soon as its gradients are summed, last layer first
+    template <typename Gradients>
+    void backward_layers(const NeuralNetwork::network& neural_network, size_t begin, size_t end, const float* inputs, const float* pre_activations, const float* activations, std::vector<float>& back, Gradients& gradients, const std::function<void(size_t)>& layer_done) {
+        size_t offset = 0;
+        for (size_t l = begin; l < end; l++) offset += neural_network.layers[l].output_size;
+
+        std::vector<float> delta, derivative, columns, transposed;
+        for (size_t l = end; l-- > begin;) {
+            const NeuralNetwork::layer& layer = neural_network.layers[l];
+            offset -= layer.output_size;
+
+            // Embeddings have no activation, each looked up row gets its field's slice of back. They're always the first layer
+            if (layer.type == NeuralNetwork::layer_type::embedding) {
+                size_t dimensions = layer.lookup.dimensions;
+                for (size_t i = 0; i < layer.lookup.fields; i++) {
+                    const float* slice = &back[i * dimensions];
+                    for (size_t d = 0; d < dimensions; d++) gradients.biases[l][d] += slice[d];
+                    uint32_t row = embedding_index(layer, inputs[i]);
+                    if (row == UINT32_MAX) continue;
+                    float* gradient = &gradients.weights[l][row * dimensions];
+                    for (size_t d = 0; d < dimensions; d++) gradient[d] += slice[d];
+                    gradients.rows[l].push_back(row);
+                }
+                if (layer_done) layer_done(l);
+                break;
+            }
+
+            // Delta = back * f'(pre-activations)
+            derivative.resize(layer.output_size);
+            activation_function_derivative(layer.activation, pre_activations + offset, activations + offset, derivative.data(), layer.output_size);
+            delta.resize(layer.output_size);
+            for (size_t j = 0; j < layer.output_size; j++) delta[j] = back[j] * derivative[j];
+
+            const float* layer_inputs = (l == begin) ? inputs : activations + offset - layer.input_size;
+            float* weight_gradients = gradients.weights[l].data();
+            float* bias_gradients = gradients.biases[l].data();
+
+            // Convolutions work on their im2col rows, dW = delta * columns and the columns' gradient delta^T * W is added back onto the inputs
+            // Both are GEMMs through the packed micro-kernel, delta is stored filter by filter so it's transposed for the second one
+            if (layer.type != NeuralNetwork::layer_type::dense) {
+                size_t filters = layer.shape.filters, depth = gemm_depth(layer);
+                size_t positions = layer.output_size / filters;
+                columns.resize(positions * depth);
+                convolution_columns(layer, layer_inputs, columns.data());
+                for (size_t f = 0; f < filters; f++) {
+                    for (size_t p = 0; p < positions; p++) bias_gradients[f] += delta[f * positions + p];
+                }
+                panel_gemm(delta.data(), columns.data(), filters, depth, positions, weight_gradients, layer.threads);
+                if (layer_done) layer_done(l);
+                if (l == 0) break;
+
+                transposed.resize(positions * filters);
+                for (size_t f = 0; f < filters; f++) {
+                    for (size_t p = 0; p < positions; p++) transposed[p * filters + f] = delta[f * positions + p];
+                }
+                std::fill(columns.begin(), columns.end(), 0.0f);
+                panel_gemm(transposed.data(), layer.weights.data(), positions, depth, filters, columns.data(), layer.threads);
+                back.assign(layer.input_size, 0.0f);
+                add_convolution_columns(layer, columns.data(), back.data());
+                continue;
+            }
+
+            // dW = delta * inputs^T, one row at a time
+            for (size_t j = 0; j < layer.output_size; j++) {
+                bias_gradients[j] += delta[j];
+                if (delta[j] == 0.0f) continue;
+                if (layer.sparse_rows.empty()) {
+                    float* row = weight_gradients + j * layer.input_size;
+                    for (size_t k = 0; k < layer.input_size; k++) row[k] += delta[j] * layer_inputs[k];
+                } else {
+                    for (size_t p = layer.sparse_rows[j]; p < layer.sparse_rows[j + 1]; p++) weight_gradients[p] += delta[j] * layer_inputs[layer.sparse_columns[p]];
+                }
+            }
+            if (layer_done) layer_done(l);
+            if (l == 0) break;
+
+            // Back = W^T delta
+            back.assign(layer.input_size, 0.0f);
+            for (size_t j = 0; j < layer.output_size; j++) {
+                if (delta[j] == 0.0f) continue;
+                if (layer.sparse_rows.empty()) {
+                    const float* row = &layer.weights[j * layer.input_size];
+                    for (size_t k = 0; k < layer.input_size; k++) back[k] += row[k] * delta[j];
+                } else {
+                    for (size_t p = layer.sparse_rows[j]; p < layer.sparse_rows[j + 1]; p++) back[layer.sparse_columns[p]] += layer.sparse_values[p] * delta[j];
+                }
+            }
+        }
+    }
+
+    // Adds one sample's gradients to gradients, which must already be sized by zero_gradients or hold earlier sums
+    // layer_done is called with each layer's index as soon as its gradients are summed, last layer first
+    template <typename Output, typename Gradients>
+    bool accumulate_gradients(const NeuralNetwork::network& neural_network, const std::vector<float>& inputs, const Output& forward_output, const std::vector<float>& expected, Gradients& gradients, const std::function<void(size_t)>& layer_done = nullptr) {
+        if (neural_network.layers.empty()) {std::cerr << "backpropagate: network has no layers\n";return false;}
+        const NeuralNetwork::layer& last = neural_network.layers.back();
+        if (expected.size() != last.output_size || inputs.size() != neural_network.layers[0].input_size) {std::cerr << "backpropagate: inputs or expected outputs do not match that of the provided neural network\n";return false;}
+
+        size_t total = 0;
+        for (const NeuralNetwork::layer& layer : neural_network.layers) total += layer.output_size;
+        if (forward_output.activations.size() != total || forward_output.pre_activations.size() != total) {std::cerr << "backpropagate: forward pass does not match the provided neural network\n";return false;}
+        if (gradients.weights.size() != neural_network.layers.size()) zero_gradients(neural_network, gradients);
+
+        // Output gradient, softmax with cross-entropy reduces to (outputs - expected)
+        const float* outputs = &forward_output.activations[total - last.output_size];
+        std::vector<float> back(last.output_size);
+        for (size_t j = 0; j < last.output_size; j++) back[j] = outputs[j] - expected[j];
+        backward_layers(neural_network, 0, neural_network.layers.size(), inputs.data(), forward_output.pre_activations.data(), forward_output.activations.data(), back, gradients, layer_done);
+        return true;
+    }
+
+    // One fused pass over a parameter buffer: decay, moments and the parameter itself are updated together so each value is loaded once
+    void optimizer_update(const NeuralNetwork::optimizer& optimizer, float* parameters, const float* gradients, float* moments, float* variances, size_t size, float weight_decay) {
+        float learning_rate = optimizer.learning_rate;
+        float beta1 = optimizer.momentum;
+        float beta2 = optimizer.beta2;
+        float epsilon = optimizer.epsilon;
+        switch (optimizer.type) {
+            case NeuralNetwork::optimizer_type::sgd:
+                for (size_t i = 0; i < size; i++) parameters[i] -= learning_rate * (gradients[i] + weight_decay * parameters[i]);
+                break;
+            case NeuralNetwork::optimizer_type::momentum:
+                for (size_t i = 0; i < size; i++) {
+                    moments[i] = beta1 * moments[i] + gradients[i] + weight_decay * parameters[i];
+                    parameters[i] -= learning_rate * moments[i];
+                }
+                break;
+            case NeuralNetwork::optimizer_type::adam:
+            case NeuralNetwork::optimizer_type::adamw: {
+                // Bias corrections fold into two per-step constants
+                double step = static_cast<double>(optimizer.step);
+                float first_correction = static_cast<float>(1.0 / (1.0 - std::pow(static_cast<double>(beta1), step)));
+                float second_correction = static_cast<float>(1.0 / (1.0 - std::pow(static_cast<double>(beta2), step)));
+                float coupled_decay = (optimizer.type == NeuralNetwork::optimizer_type::adam) ? weight_decay : 0.0f;
+                float decoupled_decay = (optimizer.type == NeuralNetwork::optimizer_type::adamw) ? learning_rate * weight_decay : 0.0f;
+                for (size_t i = 0; i < size; i++) {
+                    float gradient = gradients[i] + coupled_decay * parameters[i];
+                    moments[i] = beta1 * moments[i] + (1.0f - beta1) * gradient;
+                    variances[i] = beta2 * variances[i] + (1.0f - beta2) * gradient * gradient;
+                    parameters[i] -= learning_rate * (moments[i] * first_correction) / (std::sqrt(variances[i] * second_correction) + epsilon) + decoupled_decay * parameters[i];
+                }
+                break;
+            }
+        }
+    }
+
+    // Byte offset of a block, the blocks are stored back to back after the metadata unless the file is append-only
+    uint64_t block_offset(const NeuralNetwork::file_metadata& metadata, uint32_t block) {
+        if (!metadata.block_offsets.empty()) return metadata.block_offsets[block];
+        uint64_t offset = sizeof(uint32_t) * (3 + static_cast<uint64_t>(metadata.blocks) + metadata.config_size);
+        for (uint32_t i = 0; i < block; i++) offset += metadata.block_sizes[i];
+        return offset;
+    }
+
+    // Reads count floats from offset in chunks, so a block never has to fit in memory at once
+    template <typename F>
+    bool stream_block(std::fstream& file, uint64_t offset, size_t count, F&& body, size_t chunk) {
+        std::vector<float> buffer(std::min(count, chunk));
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+        for (size_t done = 0; done < count;) {
+            size_t size = std::min(chunk, count - done);
+            file.read(reinterpret_cast<char*>(buffer.data()), static_cast<std::streamsize>(size * sizeof(float)));
+            if (!file) {std::cerr << "stream_block: error reading block data\n";return false;}
+            body(buffer.data(), size);
+            done += size;
+        }
+        return true;
+    }
+
+    // Reads one whole block through an already open file, callers resolve the metadata once and read every block against the same index
+    std::vector<float> read_block(std::fstream& file, const NeuralNetwork::file_metadata& metadata, uint32_t block) {
+        if (block >= metadata.blocks) {std::cerr << "Block # requested is invalid.\n";return {};}
+        size_t bytes = static_cast<size_t>(metadata.block_sizes[block]);
+        if (bytes % sizeof(float) != 0) {std::cerr << "read_block: block size not aligned with type\n";return {};}
+
+        std::vector<float> wanted_block(bytes / sizeof(float));
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(block_offset(metadata, block)), std::ios::beg);
+        if (!file) {std::cerr << "read_block: seekg failed for block " << block << "\n";return {};}
+        file.read(reinterpret_cast<char*>(wanted_block.data()), static_cast<std::streamsize>(bytes));
+        if (!file) {std::cerr << "read_block: error reading block " << block << "\n";return {};}
+        return wanted_block;
+    }
+
+    // Two streaming passes over one block of an open file: min, max and mean first, then the deviations and the histogram
+    NeuralNetwork::block_summary summarize_block(std::fstream& file, const NeuralNetwork::file_metadata& metadata, uint32_t block, uint32_t bins) {
+        NeuralNetwork::block_summary summary;
+        summary.count = metadata.block_sizes[block] / sizeof(float);
+        summary.histogram.assign(std::max(1u, bins), 0);
+        if (summary.count == 0) return summary;
+
+        // First pass: min, max and sum, with 8 lanes per chunk folded into doubles
+        float min = std::numeric_limits<float>::infinity();
+        float max = -std::numeric_limits<float>::infinity();
+        double sum = 0.0;
+        stream_block(file, block_offset(metadata, block), summary.count, [&](const float* values, size_t size) {
+            float lane_min[8], lane_max[8], lane_sum[8] = {};
+            std::fill(lane_min, lane_min + 8, min);
+            std::fill(lane_max, lane_max + 8, max);
+            size_t i = 0;
+            for (; i + 8 <= size; i += 8) {
+                for (size_t l = 0; l < 8; l++) {
+                    float value = values[i + l];
+                    lane_min[l] = std::min(lane_min[l], value);
+                    lane_max[l] = std::max(lane_max[l], value);
+                    lane_sum[l] += value;
+                }
+            }
+            for (; i < size; i++) {
+                lane_min[0] = std::min(lane_min[0], values[i]);
+                lane_max[0] = std::max(lane_max[0], values[i]);
+                lane_sum[0] += values[i];
+            }
+            for (size_t l = 0; l < 8; l++) {
+                min = std::min(min, lane_min[l]);
+                max = std::max(max, lane_max[l]);
+                sum += lane_sum[l];
+            }
+        }, 4096);
+        summary.min = min;
+        summary.max = max;
+        summary.mean = sum / summary.count;
+
+        // Second pass: squared deviations from the mean, and a histogram of equal width bins between min and max
+        double scale = (max > min) ? summary.histogram.size() / (static_cast<double>(max) - min) : 0.0;
+        size_t last = summary.histogram.size() - 1;
+        float mean = static_cast<float>(summary.mean);
+        double deviations = 0.0;
+        stream_block(file, block_offset(metadata, block), summary.count, [&](const float* values, size_t size) {
+            float lane_deviations[8] = {};
+            size_t i = 0;
+            for (; i + 8 <= size; i += 8) {
+                for (size_t l = 0; l < 8; l++) lane_deviations[l] += (values[i + l] - mean) * (values[i + l] - mean);
+            }
+            for (; i < size; i++) lane_deviations[0] += (values[i] - mean) * (values[i] - mean);
+            for (size_t l = 0; l < 8; l++) deviations += lane_deviations[l];
+
+            for (i = 0; i < size; i++) {
+                size_t bin = static_cast<size_t>((values[i] - min) * scale);
+                summary.histogram[std::min(bin, last)]++;
+            }
+        }, 4096);
+        summary.stddev = std::sqrt(deviations / summary.count);
+        return summary;
+    }
+
+    // Flushes a written file to disk so a rename over the old file can't leave a half-written file behind after a crash
+    bool sync_file(const char* location) {
+#if defined(__unix__) || defined(__APPLE__)
+        int descriptor = open(location, O_RDONLY);
+        if (descriptor < 0) return false;
+        bool synced = fsync(descriptor) == 0;
+        close(descriptor);
+        return synced;
+#else
+        (void)location;
+        return true;
+#endif
+    }
+
+    // Flushes the directory holding location, so a file just renamed into it is still there after a crash
+    bool sync_directory(const char* location) {
+#if defined(__unix__) || defined(__APPLE__)
+        std::filesystem::path directory = std::filesystem::path(location).parent_path();
+        int descriptor = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (descriptor < 0) return false;
+        bool synced = fsync(descriptor) == 0;
+        close(descriptor);
+        return synced;
+#else
+        (void)location;
+        return true;
+#endif
+    }
+
+    // A file next to location under a name no other writer picks, from this process or another. It's removed again unless it replaced location
+    class temporary_file {
+    public:
+        explicit temporary_file(const char* location) {
+            static std::atomic<uint64_t> counter{0};
+#if defined(__unix__) || defined(__APPLE__)
+            long process = static_cast<long>(getpid());
+#else
+            long process = 0;
+#endif
+            path = std::string(location) + "." + std::to_string(process) + "." + std::to_string(counter++) + ".tmp";
+        }
+        ~temporary_file() {
+            if (replaced) return;
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+        }
+        temporary_file(const temporary_file&) = delete;
+        temporary_file& operator=(const temporary_file&) = delete;
+
+        // Flushes the file to disk, renames it over location in one step, then flushes location's directory so the rename survives a crash too
+        bool replace(const char* location, const char* caller) {
+            if (!sync_file(path.c_str())) {std::cerr << caller << ": failed to flush \"" << path << "\" to disk\n";return false;}
+            std::error_code ec;
+            std::filesystem::rename(path, location, ec);
+            if (ec) {std::cerr << caller << ": failed to replace \"" << location << "\": " << ec.message() << "\n";return false;}
+            replaced = true;
+            if (!sync_directory(location)) {std::cerr << caller << ": failed to flush the directory of \"" << location << "\" to disk\n";return false;}
+            return true;
+        }
+
+        std::string path;
+
+    private:
+        bool replaced = false;
+    };
+
+    // 64 bit FNV-1a over 8 byte words, used to spot blocks that didn't change since the last append. Chunks hashed one after another must be multiples of 8 bytes
+    const uint64_t hash_seed = 0xCBF29CE484222325ull;
+    uint64_t hash_bytes(uint64_t hash, const char* data, size_t bytes) {
+        const uint64_t prime = 0x100000001B3ull;
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, data + i, sizeof(word));
+            hash = (hash ^ word) * prime;
+        }
+        for (; i < bytes; i++) hash = (hash ^ static_cast<unsigned char>(data[i])) * prime;
+        return hash;
+    }
+
+    // Hash of count floats' bits seeded with a model version. Eight independent 32-bit lanes keep the main loop vectorizable, they're folded into 64 bits at the end
+    uint64_t hash_floats(const float* values, size_t count, uint64_t seed) {
+        const uint32_t lane_prime = 0x9E3779B1u;
+        const uint64_t prime = 0x100000001B3ull;
+        uint32_t lanes[8];
+        for (uint32_t l = 0; l < 8; l++) lanes[l] = static_cast<uint32_t>(seed >> (l % 2 * 32)) + l * 0x85EBCA77u;
+        size_t i = 0;
+        for (; i + 8 <= count; i += 8) {
+            uint32_t words[8];
+            std::memcpy(words, values + i, sizeof(words));
+            for (uint32_t l = 0; l < 8; l++) {
+                lanes[l] = (lanes[l] ^ words[l]) * lane_prime;
+                lanes[l] ^= lanes[l] >> 15;
+            }
+        }
+        uint64_t hash = seed ^ (count * 0x9E3779B97F4A7C15ull);
+        for (uint32_t l = 0; l < 8; l++) hash = (hash ^ lanes[l]) * prime;
+        for (; i < count; i++) {
+            uint32_t word;
+            std::memcpy(&word, values + i, sizeof(word));
+            hash = (hash ^ word) * prime;
+        }
+        hash ^= hash >> 33;
+        hash *= 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    // Append-only (v3) files end in a trailer: index offset, index size and index hash as uint64_t's, then this magic
+    const uint32_t log_magic = 0x474C5A45; // "EZLG"
+    const uint64_t log_trailer_size = 3 * sizeof(uint64_t) + sizeof(uint32_t);
+
+    // Reads the index a trailer ending at end points to, false if there is no valid trailer there
+    bool read_log_index(std::fstream& file, uint64_t end, uint64_t header_size, NeuralNetwork::file_metadata& metadata) {
+        if (end < header_size + log_trailer_size) return false;
+        uint64_t trailer[3];
+        uint32_t magic;
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(end - log_trailer_size), std::ios::beg);
+        file.read(reinterpret_cast<char*>(trailer), sizeof(trailer));
+        file.read(reinterpret_cast<char*>(&magic), sizeof(magic));
+        if (!file || magic != log_magic) return false;
+        uint64_t offset = trailer[0], size = trailer[1];
+        if (offset < header_size || size < 2 * sizeof(uint32_t) || offset + size != end - log_trailer_size) return false;
+
+        std::vector<char> index(size);
+        file.seekg(static_cast<std::streamoff>(offset), std::ios::beg);
+        file.read(index.data(), static_cast<std::streamsize>(size));
+        if (!file || hash_bytes(hash_seed, index.data(), index.size()) != trailer[2]) return false;
+
+        // Index: blocks, block sizes, config size, config data, then a uint64_t offset and a uint64_t hash per block
+        const char* cursor = index.data();
+        const char* last = index.data() + index.size();
+        auto take = [&](void* out, size_t bytes) {
+            if (static_cast<size_t>(last - cursor) < bytes) return false;
+            std::memcpy(out, cursor, bytes);
+            cursor += bytes;
+            return true;
+        };
+        uint32_t blocks, config_size;
+        if (!take(&blocks, sizeof(blocks))) return false;
+        std::vector<uint32_t> block_sizes(blocks);
+        if (!take(block_sizes.data(), blocks * sizeof(uint32_t)) || !take(&config_size, sizeof(config_size))) return false;
+        std::vector<uint32_t> config_data(config_size);
+        std::vector<uint64_t> block_offsets(blocks), block_hashes(blocks);
+        if (!take(config_data.data(), config_size * sizeof(uint32_t))) return false;
+        if (!take(block_offsets.data(), blocks * sizeof(uint64_t)) || !take(block_hashes.data(), blocks * sizeof(uint64_t)) || cursor != last) return false;
+        for (uint32_t i = 0; i < blocks; i++) {
+            if (block_offsets[i] < header_size || block_offsets[i] + block_sizes[i] > offset) return false;
+        }
+
+        metadata.blocks = blocks;
+        metadata.block_sizes = std::move(block_sizes);
+        metadata.config_size = config_size;
+        metadata.config_data = std::move(config_data);
+        metadata.block_offsets = std::move(block_offsets);
+        metadata.block_hashes = std::move(block_hashes);
+        metadata.end = end;
+        return true;
+    }
+
+    // Finds the newest valid index of an append-only file. A crash mid-append leaves a torn segment without a trailer, so the file is
+    // scanned back for the last complete one
+    bool find_log_index(std::fstream& file, uint64_t header_size, NeuralNetwork::file_metadata& metadata) {
+        file.clear();
+        file.seekg(0, std::ios::end);
+        uint64_t size = static_cast<uint64_t>(file.tellg());
+        if (read_log_index(file, size, header_size, metadata)) return true;
+
+        // Everything in the file is 4 byte aligned, so trailers can only end on a multiple of 4
+        const size_t chunk = 1 << 16;
+        std::vector<uint32_t> words(chunk);
+        uint64_t end = (size - header_size) / sizeof(uint32_t) * sizeof(uint32_t) + header_size;
+        while (end > header_size + log_trailer_size) {
+            uint64_t begin = end - std::min<uint64_t>(end - header_size, chunk * sizeof(uint32_t));
+            size_t count = static_cast<size_t>((end - begin) / sizeof(uint32_t));
+            file.clear();
+            file.seekg(static_cast<std::streamoff>(begin), std::ios::beg);
+            file.read(reinterpret_cast<char*>(words.data()), static_cast<std::streamsize>(count * sizeof(uint32_t)));
+            if (!file) return false;
+            for (size_t i = count; i-- > 0;) {
+                if (words[i] != log_magic) continue;
+                uint64_t candidate = begin + (i + 1) * sizeof(uint32_t);
+                if (candidate < size && read_log_index(file, candidate, header_size, metadata)) {
+                    std::cerr << "read_metadata: ignoring " << size - candidate << " bytes of an unfinished append\n";
+                    return true;
+                }
+            }
+            end = begin;
+        }
+        return false;
+    }
+
+    // Collects the blocks a network is saved as, in file order, and the config data describing them. index_blocks holds the converted sparse indices the blocks point into
+    bool collect_blocks(const NeuralNetwork::network& neural_network, std::vector<uint32_t>& config_data, std::vector<const std::vector<float>*>& blocks, std::vector<std::vector<float>>& index_blocks, const char* caller) {
+        if (neural_network.layers.empty()) {std::cerr << caller << ": provided network is too small\n";return false;}
+        config_data = neural_network.config_data;
+        if (config_data.empty()) config_data.push_back(neural_network.layers[0].input_size);
+
+        // The layers are the source of truth for their activations
+        std::vector<uint32_t> layer_activations;
+        for (const NeuralNetwork::layer& layer : neural_network.layers) layer_activations.push_back(static_cast<uint32_t>(layer.activation));
+        NeuralNetwork::write_config_record(config_data, NeuralNetwork::config_activations, layer_activations);
+
+        // Convolution shapes, only recorded when the network has a convolution
+        std::vector<uint32_t> convolutions;
+        bool any_convolution = false;
+        for (const NeuralNetwork::layer& layer : neural_network.layers) {
+            const NeuralNetwork::convolution& shape = layer.shape;
+            if (layer.type != NeuralNetwork::layer_type::conv1d && layer.type != NeuralNetwork::layer_type::conv2d) convolutions.insert(convolutions.end(), 9, 0);
+            else convolutions.insert(convolutions.end(), {static_cast<uint32_t>(layer.type), shape.channels, shape.height, shape.width, shape.filters, shape.kernel_height, shape.kernel_width, shape.stride, shape.padding});
+            any_convolution = any_convolution || layer.type == NeuralNetwork::layer_type::conv1d || layer.type == NeuralNetwork::layer_type::conv2d;
+        }
+        if (!any_convolution) convolutions.clear();
+        NeuralNetwork::write_config_record(config_data, NeuralNetwork::config_convolution, convolutions);
+
+        // Embedding shapes, only recorded when the network has an embedding
+        std::vector<uint32_t> embeddings;
+        bool any_embedding = false;
+        for (const NeuralNetwork::layer& layer : neural_network.layers) {
+            const NeuralNetwork::embedding& lookup = layer.lookup;
+            if (layer.type != NeuralNetwork::layer_type::embedding) embeddings.insert(embeddings.end(), 4, 0);
+            else embeddings.insert(embeddings.end(), {lookup.categories, lookup.dimensions, lookup.fields, lookup.features});
+            any_embedding = any_embedding || layer.type == NeuralNetwork::layer_type::embedding;
+        }
+        if (!any_embedding) embeddings.clear();
+        NeuralNetwork::write_config_record(config_data, NeuralNetwork::config_embedding, embeddings);
+
+        // Packed and sparse layers get extra blocks, numbered after the layer blocks
+        std::vector<const std::vector<float>*> extra_blocks;
+        index_blocks.clear();
+        index_blocks.reserve(neural_network.layers.size() * 2);
+        uint32_t first_extra = static_cast<uint32_t>(neural_network.layers.size() * 2);
+        std::vector<uint32_t> packed;
+        for (const NeuralNetwork::layer& layer : neural_network.layers) {
+            if (layer.packed.empty()) {
+                packed.insert(packed.end(), {UINT32_MAX, 0, 0});
+            } else {
+                packed.insert(packed.end(), {first_extra + static_cast<uint32_t>(extra_blocks.size()), layer.panel_width, layer.k_block});
+                extra_blocks.push_back(&layer.packed);
+            }
+        }
+        if (extra_blocks.empty()) packed.clear();
+        NeuralNetwork::write_config_record(config_data, NeuralNetwork::config_packed, packed);
+
+        std::vector<uint32_t> sparse;
+        for (const NeuralNetwork::layer& layer : neural_network.layers) {
+            if (layer.sparse_rows.empty()) {
+                sparse.insert(sparse.end(), {UINT32_MAX, UINT32_MAX});
+            } else {
+                sparse.insert(sparse.end(), {first_extra + static_cast<uint32_t>(extra_blocks.size()), first_extra + static_cast<uint32_t>(extra_blocks.size() + 1)});
+                index_blocks.push_back(index_block(layer.sparse_rows));
+                extra_blocks.push_back(&index_blocks.back());
+                index_blocks.push_back(index_block(layer.sparse_columns));
+                extra_blocks.push_back(&index_blocks.back());
+            }
+        }
+        if (index_blocks.empty()) sparse.clear();
+        NeuralNetwork::write_config_record(config_data, NeuralNetwork::config_sparse, sparse);
+
+        // Optimizer hyperparameters, step and moment buffers, so training resumes exactly where it stopped
+        const NeuralNetwork::optimizer& optimizer = neural_network.optimizer;
+        std::vector<uint32_t> optimizer_record = {static_cast<uint32_t>(optimizer.type), static_cast<uint32_t>(optimizer.step), static_cast<uint32_t>(optimizer.step >> 32)};
+        for (float hyperparameter : {optimizer.learning_rate, optimizer.momentum, optimizer.beta2, optimizer.epsilon, optimizer.weight_decay}) {
+            uint32_t bits;
+            std::memcpy(&bits, &hyperparameter, sizeof(bits));
+            optimizer_record.push_back(bits);
+        }
+        for (size_t l = 0; l < neural_network.layers.size(); l++) {
+            for (const std::vector<std::vector<float>>* moments : {&optimizer.weight_moments, &optimizer.bias_moments, &optimizer.weight_variances, &optimizer.bias_variances}) {
+                if (l < moments->size() && !(*moments)[l].empty()) {
+                    optimizer_record.push_back(first_extra + static_cast<uint32_t>(extra_blocks.size()));
+                    extra_blocks.push_back(&(*moments)[l]);
+                } else {
+                    optimizer_record.push_back(UINT32_MAX);
+                }
+            }
+        }
+        NeuralNetwork::write_config_record(config_data, NeuralNetwork::config_optimizer, optimizer_record);
+
+        // Biases go on even blocks, weights on odd blocks, sparse layers keep their non-zero weights in the weight block
+        blocks.clear();
+        for (size_t i = 0; i < neural_network.layers.size(); i++) {
+            const NeuralNetwork::layer& layer = neural_network.layers[i];
+            if (layer.biases.size() == 0) {std::cerr << caller << ": layer " << i << "'s # of biases is 0\n";return false;}
+            if (layer.weights.size() == 0 && layer.sparse_rows.empty()) {std::cerr << caller << ": layer " << i << "'s # of weights is 0\n";return false;}
+            blocks.push_back(&layer.biases);
+            blocks.push_back(layer.sparse_rows.empty() ? &layer.weights : &layer.sparse_values);
+        }
+        blocks.insert(blocks.end(), extra_blocks.begin(), extra_blocks.end());
+
+        for (const std::vector<float>* block : blocks) {
+            if (block->size() > UINT32_MAX / sizeof(float)) {std::cerr << caller << ": a block is too large for the format\n";return false;}
+        }
+        return true;
+    }
+
+    // Delta files start with this magic, then the delta format version
+    const uint32_t delta_magic = 0x4C445A45; // "EZDL"
+    enum delta_mode : uint32_t {
+        delta_unchanged = 0, // Copy of a block of the old file
+        delta_xor = 1,       // XOR against a block of the old file, encoded
+        delta_full = 2       // Encoded on its own
+    };
+
+    void put_varint(std::vector<uint8_t>& out, size_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<uint8_t>(value));
     }
-    float activation_function(float input) {
-        return std::max(0.0f, input);
+    bool get_varint(const uint8_t*& data, const uint8_t* last, size_t& value) {
+        value = 0;
+        for (int shift = 0; data < last && shift < 64; shift += 7) {
+            uint8_t byte = *data++;
+            value |= static_cast<size_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+    // XORs the new words against the old ones (or nothing), splits the result into 4 byte planes and run-length encodes the zero bytes.
+    // Small float changes leave the sign and exponent bytes zero, so a fine-tuned block shrinks to a fraction of its size and compresses well after
+    std::vector<uint8_t> encode_delta(const uint32_t* old_words, const uint32_t* new_words, size_t count) {
+        std::vector<uint8_t> planes(count * sizeof(uint32_t));
+        for (size_t i = 0; i < count; i++) {
+            uint32_t word = old_words ? (old_words[i] ^ new_words[i]) : new_words[i];
+            for (size_t plane = 0; plane < sizeof(uint32_t); plane++) planes[plane * count + i] = static_cast<uint8_t>(word >> (8 * plane));
+        }
+
+        // Pairs of (zero run, literal run) followed by the literal bytes
+        std::vector<uint8_t> out;
+        for (size_t i = 0; i < planes.size();) {
+            size_t zeros = i;
+            while (zeros < planes.size() && planes[zeros] == 0) zeros++;
+            size_t literals = zeros;
+            while (literals < planes.size() && (planes[literals] != 0 || (literals + 1 < planes.size() && planes[literals + 1] != 0))) literals++;
+            put_varint(out, zeros - i);
+            put_varint(out, literals - zeros);
+            out.insert(out.end(), planes.begin() + zeros, planes.begin() + literals);
+            i = literals;
+        }
+        return out;
+    }
+    bool decode_delta(const uint8_t* data, size_t size, const uint32_t* old_words, uint32_t* new_words, size_t count) {
+        std::vector<uint8_t> planes(count * sizeof(uint32_t));
+        const uint8_t* last = data + size;
+        for (size_t i = 0; i < planes.size();) {
+            size_t zeros, literals;
+            if (!get_varint(data, last, zeros) || !get_varint(data, last, literals)) return false;
+            if (zeros > planes.size() - i || literals > planes.size() - i - zeros || literals > static_cast<size_t>(last - data)) return false;
+            i += zeros;
+            std::memcpy(planes.data() + i, data, literals);
+            data += literals;
+            i += literals;
+        }
+        if (data != last) return false;
+
+        for (size_t i = 0; i < count; i++) {
+            uint32_t word = 0;
+            for (size_t plane = 0; plane < sizeof(uint32_t); plane++) word |= static_cast<uint32_t>(planes[plane * count + i]) << (8 * plane);
+            new_words[i] = old_words ? (old_words[i] ^ word) : word;
+        }
+        return true;
+    }
+
+    // Reads a whole block as raw words
+    bool read_words(std::fstream& file, const NeuralNetwork::file_metadata& metadata, uint32_t block, std::vector<uint32_t>& words) {
+        words.resize(metadata.block_sizes[block] / sizeof(uint32_t));
+        file.clear();
+        file.seekg(static_cast<std::streamoff>(block_offset(metadata, block)), std::ios::beg);
+        file.read(reinterpret_cast<char*>(words.data()), static_cast<std::streamsize>(words.size() * sizeof(uint32_t)));
+        return static_cast<bool>(file);
     }
-    float activation_function_derivative(float input) {
-        if (input > 0) {
-            return 1.0f;
+
+    // Identifies the file behind a path, so hard links, symlinks and relative paths to one file share a cache entry. Size and modification
+    // time are part of it, so a file replaced on disk is loaded again instead of served stale
+    std::string file_identity(const char* location) {
+#if defined(__unix__) || defined(__APPLE__)
+        struct stat info;
+        if (stat(location, &info) != 0) return {};
+#if defined(__APPLE__)
+        int64_t nanoseconds = static_cast<int64_t>(info.st_mtimespec.tv_sec) * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+        int64_t nanoseconds = static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+        return std::to_string(info.st_dev) + ":" + std::to_string(info.st_ino) + ":" + std::to_string(info.st_size) + ":" + std::to_string(nanoseconds);
+#else
+        std::error_code ec;
+        std::filesystem::path path = std::filesystem::weakly_canonical(location, ec);
+        if (ec) return {};
+        uintmax_t size = std::filesystem::file_size(path, ec);
+        if (ec) return {};
+        auto modified = std::filesystem::last_write_time(path, ec);
+        if (ec) return {};
+        return path.string() + ":" + std::to_string(size) + ":" + std::to_string(modified.time_since_epoch().count());
+#endif
+    }
+
+    // Bytes held by a network's buffers
+    uint64_t network_bytes(const NeuralNetwork::network& neural_network) {
+        uint64_t bytes = neural_network.config_data.size() * sizeof(uint32_t);
+        for (const NeuralNetwork::layer& layer : neural_network.layers) {
+            bytes += (layer.weights.size() + layer.biases.size() + layer.packed.size() + layer.sparse_values.size()) * sizeof(float);
+            bytes += (layer.sparse_columns.size() + layer.sparse_rows.size()) * sizeof(uint32_t);
+        }
+        const NeuralNetwork::optimizer& optimizer = neural_network.optimizer;
+        for (const std::vector<std::vector<float>>* moments : {&optimizer.weight_moments, &optimizer.bias_moments, &optimizer.weight_variances, &optimizer.bias_variances}) {
+            for (const std::vector<float>& buffer : *moments) bytes += buffer.size() * sizeof(float);
+        }
+        return bytes;
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    // Sends never raise SIGPIPE, a closed peer shows up as an error instead
+    ssize_t send_bytes(int socket, const char* data, size_t size) {
+#ifdef MSG_NOSIGNAL
+        return send(socket, data, size, MSG_NOSIGNAL);
+#else
+        return send(socket, data, size, 0);
+#endif
+    }
+    int open_connection(const std::string& host, uint16_t port) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) return -1;
+        int connection = -1;
+        for (addrinfo* address = addresses; address && connection < 0; address = address->ai_next) {
+            connection = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (connection < 0) continue;
+            if (::connect(connection, address->ai_addr, address->ai_addrlen) != 0) {
+                ::close(connection);
+                connection = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+        return connection;
+    }
+
+    // Ring sockets are non-blocking so one poll loop can send and receive at the same time, and Nagle is off since every message is one whole segment
+    void configure_socket(int connection) {
+        int enabled = 1;
+        setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+#ifdef SO_NOSIGPIPE
+        setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &enabled, sizeof(enabled));
+#endif
+        fcntl(connection, F_SETFL, fcntl(connection, F_GETFL, 0) | O_NONBLOCK);
+    }
+#endif
+
+    // Runs all-reduces of gradient buckets on a background thread, in the order they were queued, so communication overlaps the backward pass
+    class bucket_reducer {
+    public:
+        explicit bucket_reducer(NeuralNetwork::ring& workers) : workers(workers), thread(&bucket_reducer::run, this) {}
+        ~bucket_reducer() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            condition.notify_all();
+            thread.join();
+        }
+
+        // Buckets are capped so the first one starts moving before a large layer's gradients are all queued
+        void reduce(float* data, size_t count) {
+            const size_t bucket = 1 << 18;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                for (size_t first = 0; first < count; first += bucket) buckets.push_back({data + first, std::min(bucket, count - first)});
+            }
+            condition.notify_all();
+        }
+
+        // Waits for every queued bucket, false if any all-reduce failed
+        bool wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]() {return buckets.empty() && !busy;});
+            return !failed;
+        }
+
+    private:
+        void run() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                condition.wait(lock, [this]() {return !buckets.empty() || stopping;});
+                if (buckets.empty()) return;
+                std::pair<float*, size_t> next = buckets.front();
+                buckets.pop_front();
+                busy = true;
+                lock.unlock();
+                bool reduced = failed || workers.all_reduce(next.first, next.second);
+                lock.lock();
+                if (!reduced) failed = true;
+                busy = false;
+                condition.notify_all();
+            }
+        }
+
+        NeuralNetwork::ring& workers;
+        std::deque<std::pair<float*, size_t>> buckets;
+        bool busy = false;
+        bool failed = false;
+        bool stopping = false;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::thread thread;
+    };
+
+    // Dense layer: matrix-vector product with the activation fused into the epilogue while the outputs are still in cache
+    // Convolution layer: im2col, then every output position goes through the dense layers' GEMM at once
+    // Embedding layer: a gather of the looked up rows, the next field's row is prefetched while the current one is copied
+    void layer_forward(const NeuralNetwork::layer& layer, const float* inputs, float* pre_activations, float* activations) {
+        if (layer.type == NeuralNetwork::layer_type::embedding) {
+            size_t dimensions = layer.lookup.dimensions, fields = layer.lookup.fields;
+            uint32_t next = fields > 0 ? embedding_index(layer, inputs[0]) : UINT32_MAX;
+            for (size_t i = 0; i < fields; i++) {
+                uint32_t row = next;
+                next = (i + 1 < fields) ? embedding_index(layer, inputs[i + 1]) : UINT32_MAX;
+#if defined(__GNUC__)
+                if (next != UINT32_MAX) __builtin_prefetch(&layer.weights[(size_t)next * dimensions]);
+#endif
+                float* output = pre_activations + i * dimensions;
+                // Unknown ids only get the biases
+                if (row == UINT32_MAX) std::copy(layer.biases.begin(), layer.biases.end(), output);
+                else for (size_t d = 0; d < dimensions; d++) output[d] = layer.weights[(size_t)row * dimensions + d] + layer.biases[d];
+            }
+            std::copy(inputs + fields, inputs + fields + layer.lookup.features, pre_activations + fields * dimensions);
+            std::copy(pre_activations, pre_activations + layer.output_size, activations);
+            return;
+        }
+        if (layer.type != NeuralNetwork::layer_type::dense) {
+            thread_local std::vector<float> columns, products;
+            size_t filters = layer.shape.filters, positions = layer.output_size / filters;
+            columns.resize(positions * gemm_depth(layer));
+            products.resize(positions * filters);
+            convolution_columns(layer, inputs, columns.data());
+            layer_gemm(layer, columns.data(), positions, products.data());
+
+            // The GEMM gives [position][filter], outputs are stored filter by filter
+            for (size_t f = 0; f < filters; f++) {
+                for (size_t p = 0; p < positions; p++) pre_activations[f * positions + p] = products[p * filters + f];
+            }
+        } else if (!layer.sparse_rows.empty()) {
+            sparse_gemv(layer, inputs, pre_activations);
         } else {
-            return 0.0f;
+            layer_gemm(layer, inputs, 1, pre_activations);
+        }
+        activation_function(layer.activation, pre_activations, activations, layer.output_size);
+    }
+
+    // Forward pass of one sample through layers [begin, end), their pre-activations and activations are stored back to back
+    void forward_layers(const NeuralNetwork::network& neural_network, size_t begin, size_t end, const float* inputs, float* pre_activations, float* activations) {
+        size_t offset = 0;
+        for (size_t l = begin; l < end; l++) {
+            layer_forward(neural_network.layers[l], inputs, pre_activations + offset, activations + offset);
+            inputs = activations + offset;
+            offset += neural_network.layers[l].output_size;
         }
     }
-    float loss_function(float y_hat, float y) {
-        return ((y_hat - y) * (y_hat - y)) / 2;
+
+    // Forward pass of count samples at once, stored back to back. Dense layers run as one GEMM over every sample, so packed layers use the
+    // wide micro-kernel, and each output is summed in the same order as a single sample's. pre_activations and activations hold count x width values
+    void forward_rows(const NeuralNetwork::network& neural_network, const float* inputs, size_t count, float* pre_activations, float* activations) {
+        size_t width = 0;
+        for (const NeuralNetwork::layer& layer : neural_network.layers) width += layer.output_size;
+        size_t input_size = neural_network.layers[0].input_size, offset = 0;
+        thread_local std::vector<float> layer_inputs, layer_outputs;
+        layer_inputs.assign(inputs, inputs + count * input_size);
+        for (const NeuralNetwork::layer& layer : neural_network.layers) {
+            layer_outputs.resize(count * layer.output_size);
+            if (layer.type == NeuralNetwork::layer_type::dense && layer.sparse_rows.empty()) {
+                layer_gemm(layer, layer_inputs.data(), count, layer_outputs.data());
+                for (size_t c = 0; c < count; c++) {
+                    std::copy_n(&layer_outputs[c * layer.output_size], layer.output_size, pre_activations + c * width + offset);
+                    activation_function(layer.activation, pre_activations + c * width + offset, activations + c * width + offset, layer.output_size);
+                }
+            } else {
+                for (size_t c = 0; c < count; c++) layer_forward(layer, &layer_inputs[c * layer.input_size], pre_activations + c * width + offset, activations + c * width + offset);
+            }
+            for (size_t c = 0; c < count; c++) std::copy_n(activations + c * width + offset, layer.output_size, &layer_outputs[c * layer.output_size]);
+            std::swap(layer_inputs, layer_outputs);
+            offset += layer.output_size;
+        }
     }
+
+    // Bounded single-producer single-consumer queue, the two sides only share the head and tail counters
+    template <typename T>
+    class spsc_queue {
+    public:
+        explicit spsc_queue(size_t capacity) : slots(capacity) {}
+
+        void push(T& value) {
+            size_t position = tail.load(std::memory_order_relaxed);
+            while (position - head.load(std::memory_order_acquire) == slots.size()) std::this_thread::yield();
+            slots[position % slots.size()] = std::move(value);
+            tail.store(position + 1, std::memory_order_release);
+        }
+        void pop(T& value) {
+            size_t position = head.load(std::memory_order_relaxed);
+            while (position == tail.load(std::memory_order_acquire)) std::this_thread::yield();
+            value = std::move(slots[position % slots.size()]);
+            head.store(position + 1, std::memory_order_release);
+        }
+
+    private:
+        std::vector<T> slots;
+        alignas(64) std::atomic<size_t> head{0};
+        alignas(64) std::atomic<size_t> tail{0};
+    };
+
+    // Data cache size in bytes at the given level, with common defaults when the OS can't tell us
+    size_t cache_size(int level) {
+        long size = -1;
+#if defined(_SC_LEVEL1_DCACHE_SIZE) && defined(_SC_LEVEL2_CACHE_SIZE)
+        size = sysconf(level == 1 ? _SC_LEVEL1_DCACHE_SIZE : _SC_LEVEL2_CACHE_SIZE);
+#endif
+        if (size <= 0) return (level == 1) ? 32 * 1024 : 256 * 1024;
+        return static_cast<size_t>(size);
+    }
+
+    // Seconds per call of the layer's GEMM over count rows of inputs, the best of three rounds of about seconds each after a warm up call
+    double time_gemm(const NeuralNetwork::layer& layer, const float* inputs, size_t count, float* outputs, double seconds) {
+        layer_gemm(layer, inputs, count, outputs);
+        double best = std::numeric_limits<double>::max();
+        for (int round = 0; round < 3; round++) {
+            auto start = std::chrono::steady_clock::now();
+            size_t calls = 0;
+            double taken = 0.0;
+            do {
+                layer_gemm(layer, inputs, count, outputs);
+                calls++;
+                taken = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            } while (taken < seconds);
+            best = std::min(best, taken / static_cast<double>(calls));
+        }
+        return best;
+    }
+
+    // Half mean squared error, or softmax cross-entropy computed from the logits with log-sum-exp
+    float loss_function(NeuralNetwork::activation_type type, const float* pre_activations, const float* activations, const float* y, size_t size) {
+        float loss = 0.0f;
+        if (type == NeuralNetwork::activation_type::softmax) {
+            float max = pre_activations[0];
+            for (size_t i = 1; i < size; i++) max = std::max(max, pre_activations[i]);
+            float sum = 0.0f, y_sum = 0.0f, y_dot = 0.0f;
+            for (size_t i = 0; i < size; i++) {
+                sum += fast_exp(pre_activations[i] - max);
+                y_sum += y[i];
+                y_dot += y[i] * (pre_activations[i] - max);
+            }
+            loss = y_sum * std::log(sum) - y_dot;
+        } else {
+            for (size_t i = 0; i < size; i++) loss += ((activations[i] - y[i]) * (activations[i] - y[i])) / 2;
+        }
+        return loss;
+    }
+
+    // Bodies shared by the default and pmr variants of forward_pass, loss and apply_gradients. fp_output arrives empty, holding the allocators its buffers come from
+    template <typename Output>
+    Output forward_output(const NeuralNetwork::network& neural_network, const std::vector<float>& inputs, Output fp_output) {
+        if (neural_network.layers.empty()) {
+            std::cerr << "forward_pass: network has no layers\n";
+            return fp_output;
+        }
+        if (inputs.size() != neural_network.layers[0].input_size) {
+            std::cerr << "forward_pass: inputs do not match that of the provided neural network\n";
+            return fp_output;
+        }
+
+        // Initialize the forward pass's outputs, every layer's values are stored back to back
+        size_t total = 0;
+        for (const NeuralNetwork::layer& layer : neural_network.layers) total += layer.output_size;
+        fp_output.pre_activations.resize(total);
+        fp_output.activations.resize(total);
+
+        // Each layer's activations become the next layer's inputs
+        forward_layers(neural_network, 0, neural_network.layers.size(), inputs.data(), fp_output.pre_activations.data(), fp_output.activations.data());
+
+        fp_output.outputs.assign(fp_output.activations.end() - neural_network.layers.back().output_size, fp_output.activations.end());
+        return fp_output;
+    }
+    template <typename Output>
+    float output_loss(const NeuralNetwork::network& neural_network, const Output& forward_output, const std::vector<float>& expected) {
+        if (neural_network.layers.empty()) {std::cerr << "loss: network has no layers\n";return 0.0f;}
+        const NeuralNetwork::layer& last = neural_network.layers.back();
+        if (expected.size() != last.output_size || forward_output.pre_activations.size() < last.output_size) {std::cerr << "loss: expected outputs do not match that of the provided neural network\n";return 0.0f;}
+
+        size_t offset = forward_output.pre_activations.size() - last.output_size;
+        return loss_function(last.activation, &forward_output.pre_activations[offset], &forward_output.activations[offset], expected.data(), last.output_size);
+    }
+    template <typename Gradients>
+    void optimizer_step(NeuralNetwork::network& neural_network, const Gradients& gradients) {
+        NeuralNetwork::optimizer& optimizer = neural_network.optimizer;
+        size_t layers = neural_network.layers.size();
+        if (gradients.weights.size() != layers || gradients.biases.size() != layers) {std::cerr << "apply_gradients: gradients do not match the provided neural network\n";return;}
+
+        // Moments are created on the first step, and after loading a file that had none
+        bool first_moments = optimizer.type != NeuralNetwork::optimizer_type::sgd;
+        bool second_moments = optimizer.type == NeuralNetwork::optimizer_type::adam || optimizer.type == NeuralNetwork::optimizer_type::adamw;
+        if (first_moments && optimizer.weight_moments.size() != layers) {
+            optimizer.weight_moments.assign(layers, {});
+            optimizer.bias_moments.assign(layers, {});
+        }
+        if (second_moments && optimizer.weight_variances.size() != layers) {
+            optimizer.weight_variances.assign(layers, {});
+            optimizer.bias_variances.assign(layers, {});
+        }
+        optimizer.step++;
+
+        for (size_t l = 0; l < layers; l++) {
+            NeuralNetwork::layer& layer = neural_network.layers[l];
+            std::vector<float>& weights = layer.sparse_rows.empty() ? layer.weights : layer.sparse_values;
+            if (gradients.weights[l].size() != weights.size() || gradients.biases[l].size() != layer.biases.size()) {std::cerr << "apply_gradients: layer " << l << "'s gradients do not match its weights\n";return;}
+            if (first_moments) {
+                bool allocated = optimizer.weight_moments[l].capacity() < weights.size();
+                optimizer.weight_moments[l].resize(weights.size(), 0.0f);
+                optimizer.bias_moments[l].resize(layer.biases.size(), 0.0f);
+                if (allocated) interleave_memory(optimizer.weight_moments[l].data(), weights.size() * sizeof(float));
+            }
+            if (second_moments) {
+                bool allocated = optimizer.weight_variances[l].capacity() < weights.size();
+                optimizer.weight_variances[l].resize(weights.size(), 0.0f);
+                optimizer.bias_variances[l].resize(layer.biases.size(), 0.0f);
+                if (allocated) interleave_memory(optimizer.weight_variances[l].data(), weights.size() * sizeof(float));
+            }
+
+            // Weight decay only applies to weights. Embeddings only update the rows that were looked up, their moments and decay are lazy
+            if (layer.type == NeuralNetwork::layer_type::embedding) {
+                size_t dimensions = layer.lookup.dimensions;
+                std::vector<uint32_t> rows;
+                if (l < gradients.rows.size()) rows.assign(gradients.rows[l].begin(), gradients.rows[l].end());
+                for (uint32_t row : unique_rows(std::move(rows))) {
+                    size_t first = (size_t)row * dimensions;
+                    optimizer_update(optimizer, &weights[first], &gradients.weights[l][first], first_moments ? &optimizer.weight_moments[l][first] : nullptr, second_moments ? &optimizer.weight_variances[l][first] : nullptr, dimensions, optimizer.weight_decay);
+                }
+            } else {
+                optimizer_update(optimizer, weights.data(), gradients.weights[l].data(), first_moments ? optimizer.weight_moments[l].data() : nullptr, second_moments ? optimizer.weight_variances[l].data() : nullptr, weights.size(), optimizer.weight_decay);
+            }
+            optimizer_update(optimizer, layer.biases.data(), gradients.biases[l].data(), first_moments ? optimizer.bias_moments[l].data() : nullptr, second_moments ? optimizer.bias_variances[l].data() : nullptr, layer.biases.size(), 0.0f);
+
+            // Keep the packed copy in sync
+            if (!layer.packed.empty()) NeuralNetwork::pack_layer(layer, layer.panel_width, layer.k_block);
+        }
+    }
+
     float gradient(float loss, float activation, float pre_activation) {
         return 0.0f;
     }
 
-// Public functions
-    namespace NeuralNetwork {
+    // Reads a .csv dataset a chunk of rows at a time, rows are comma separated numbers and a first row that isn't is a header
+    class dataset_reader {
+    public:
+        dataset_reader(char* location, uint32_t input_size, const char* caller) : file(location), location(location), input_size(input_size), caller(caller) {
+            if (!file.is_open()) {std::cerr << caller << ": failed to open \"" << location << "\".\n";failed = true;}
+            if (input_size == 0) {std::cerr << caller << ": input size is zero\n";failed = true;}
+        }
+
+        // Replaces chunk with up to rows rows, returns false once the file is done or a row is malformed
+        bool next(NeuralNetwork::dataset& chunk, size_t rows) {
+            chunk.inputs.clear();
+            chunk.outputs.clear();
+            chunk.input_size = input_size;
+            chunk.output_size = output_size;
+            if (failed) return false;
+            size_t read = 0;
+            std::string line;
+            while (read < rows && std::getline(file, line)) {
+                number++;
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                if (line.find_first_not_of(" \t") == std::string::npos) continue;
+
+                row.clear();
+                bool numeric = true;
+                const char* cursor = line.c_str();
+                while (true) {
+                    char* parsed;
+                    float value = std::strtof(cursor, &parsed);
+                    if (parsed == cursor) {numeric = false;break;}
+                    row.push_back(value);
+                    while (*parsed == ' ' || *parsed == '\t') parsed++;
+                    if (*parsed == '\0') break;
+                    if (*parsed != ',') {numeric = false;break;}
+                    cursor = parsed + 1;
+                }
+                if (!numeric) {
+                    if (number == 1) continue;
+                    std::cerr << caller << ": line " << number << " isn't a row of numbers\n";failed = true;return false;
+                }
+
+                if (row.size() <= input_size) {std::cerr << caller << ": line " << number << " has no expected outputs\n";failed = true;return false;}
+                if (output_size == 0) output_size = chunk.output_size = static_cast<uint32_t>(row.size() - input_size);
+                if (row.size() != input_size + output_size) {std::cerr << caller << ": line " << number << " has " << row.size() << " values instead of " << input_size + output_size << "\n";failed = true;return false;}
+                chunk.inputs.insert(chunk.inputs.end(), row.begin(), row.begin() + input_size);
+                chunk.outputs.insert(chunk.outputs.end(), row.begin() + input_size, row.end());
+                read++;
+            }
+            if (number == 0 || (read == 0 && output_size == 0)) {std::cerr << caller << ": \"" << location << "\" has no rows\n";failed = true;return false;}
+            return read > 0;
+        }
+        bool ok() const {
+            return !failed;
+        }
+
+    private:
+        std::ifstream file;
+        char* location;
+        uint32_t input_size;
+        uint32_t output_size = 0;
+        const char* caller;
+        size_t number = 0;
+        bool failed = false;
+        std::vector<float> row;
+    };
+
+    // Running sums of an evaluation, each range of rows gets its own so threads never share them
+    struct evaluation_sums {
+        double loss = 0.0;
+        uint64_t rows = 0;
+        uint64_t correct = 0;
+        std::vector<uint64_t> confusion;
+    };
+
+    // A row's class: its highest value, or whether its only value is at least 0.5
+    uint32_t row_class(const float* values, size_t size) {
+        if (size == 1) return values[0] >= 0.5f ? 1 : 0;
+        return static_cast<uint32_t>(std::max_element(values, values + size) - values);
+    }
+
+    // Scores every row of a chunk, batches of rows are forward passed together. Each batch's loss is kept apart and they're added in row order,
+    // so the result never depends on the thread count
+    void score_chunk(const NeuralNetwork::network& neural_network, const NeuralNetwork::dataset& chunk, uint32_t classes, evaluation_sums& total) {
+        const size_t batch = 64;
+        size_t rows = chunk.inputs.size() / chunk.input_size;
+        size_t batches = (rows + batch - 1) / batch;
+        size_t width = 0;
+        for (const NeuralNetwork::layer& layer : neural_network.layers) width += layer.output_size;
+        const NeuralNetwork::layer& last = neural_network.layers.back();
+
+        std::vector<double> batch_losses(batches, 0.0);
+        std::mutex mutex;
+        parallel_for(batches, 4, [&](size_t begin, size_t end) {
+            evaluation_sums sums;
+            sums.confusion.assign((size_t)classes * classes, 0);
+            std::vector<float> pre_activations(batch * width), activations(batch * width);
+            for (size_t b = begin; b < end; b++) {
+                size_t first = b * batch, count = std::min(batch, rows - first);
+                forward_rows(neural_network, &chunk.inputs[first * chunk.input_size], count, pre_activations.data(), activations.data());
+                for (size_t c = 0; c < count; c++) {
+                    const float* outputs = &activations[c * width + width - last.output_size];
+                    const float* expected = &chunk.outputs[(first + c) * chunk.output_size];
+                    batch_losses[b] += loss_function(last.activation, &pre_activations[c * width + width - last.output_size], outputs, expected, last.output_size);
+                    uint32_t expected_class = row_class(expected, last.output_size), predicted_class = row_class(outputs, last.output_size);
+                    sums.correct += expected_class == predicted_class;
+                    sums.confusion[expected_class * classes + predicted_class]++;
+                    sums.rows++;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            total.rows += sums.rows;
+            total.correct += sums.correct;
+            for (size_t i = 0; i < total.confusion.size(); i++) total.confusion[i] += sums.confusion[i];
+        });
+        for (double loss : batch_losses) total.loss += loss;
+    }
+
+    // Turns the sums into averages and per class precision, recall and F1
+    NeuralNetwork::evaluation finish_evaluation(const evaluation_sums& sums, uint32_t classes, double seconds) {
+        NeuralNetwork::evaluation result;
+        result.rows = sums.rows;
+        result.classes = classes;
+        result.confusion = sums.confusion;
+        result.loss = sums.rows ? sums.loss / sums.rows : 0.0;
+        result.accuracy = sums.rows ? static_cast<double>(sums.correct) / sums.rows : 0.0;
+        for (uint32_t k = 0; k < classes; k++) {
+            uint64_t true_positives = sums.confusion[k * classes + k], expected = 0, predicted = 0;
+            for (uint32_t j = 0; j < classes; j++) {
+                expected += sums.confusion[k * classes + j];
+                predicted += sums.confusion[j * classes + k];
+            }
+            double precision = predicted ? static_cast<double>(true_positives) / predicted : 0.0;
+            double recall = expected ? static_cast<double>(true_positives) / expected : 0.0;
+            result.precision.push_back(precision);
+            result.recall.push_back(recall);
+            result.f1.push_back(precision + recall > 0.0 ? 2.0 * precision * recall / (precision + recall) : 0.0);
+        }
+        result.seconds = seconds;
+        result.rows_per_second = seconds > 0.0 ? sums.rows / seconds : 0.0;
+        return result;
+    }
+
+// Public functions
+    namespace NeuralNetwork {
+        checkpointer::checkpointer(bool append) : append(append), worker(&checkpointer::run, this) {}
+        checkpointer::~checkpointer() {
+            wait();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            condition.notify_all();
+            worker.join();
+        }
+        void checkpointer::save(const char* location, const NeuralNetwork::network& neural_network) {
+            std::lock_guard<std::mutex> producer(saving);
+
+            // Take the waiting slot back if there is one, otherwise the slot that isn't being written
+            int slot;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (pending != -1) {
+                    slot = pending;
+                    pending = -1;
+                    replaced_count++;
+                } else {
+                    slot = (writing == 0) ? 1 : 0;
+                }
+            }
+
+            // Copying into the old snapshot reuses its buffers, so steady state checkpoints don't allocate
+            snapshots[slot] = neural_network;
+            locations[slot] = location;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending = slot;
+            }
+            condition.notify_all();
+        }
+        void checkpointer::wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this]() {return pending == -1 && writing == -1;});
+        }
+        uint64_t checkpointer::written() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return written_count;
+        }
+        uint64_t checkpointer::replaced() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return replaced_count;
+        }
+        void checkpointer::run() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                condition.wait(lock, [this]() {return pending != -1 || stopping;});
+                if (pending == -1) return;
+
+                writing = pending;
+                pending = -1;
+                lock.unlock();
+                if (append) append_network(locations[writing].data(), snapshots[writing]);
+                else save_network(locations[writing].data(), snapshots[writing]);
+                lock.lock();
+                writing = -1;
+                written_count++;
+                condition.notify_all();
+            }
+        }
+        counting_resource::counting_resource(std::pmr::memory_resource* upstream) : upstream(upstream) {}
+        NeuralNetwork::allocation_stats counting_resource::statistics() const {
+            NeuralNetwork::allocation_stats stats;
+            stats.allocations = allocations.load();
+            stats.deallocations = deallocations.load();
+            stats.bytes_allocated = bytes_allocated.load();
+            stats.bytes_in_use = bytes_in_use.load();
+            stats.peak_bytes = peak_bytes.load();
+            return stats;
+        }
+        void counting_resource::reset_statistics() {
+            // What's still allocated stays counted as in use, so later deallocations can't underflow it
+            allocations = 0;
+            deallocations = 0;
+            bytes_allocated = 0;
+            peak_bytes = bytes_in_use.load();
+        }
+        std::pmr::memory_resource* counting_resource::upstream_resource() const {
+            return upstream;
+        }
+        void* counting_resource::do_allocate(size_t bytes, size_t alignment) {
+            void* pointer = upstream->allocate(bytes, alignment);
+            allocations++;
+            bytes_allocated += bytes;
+            uint64_t in_use = bytes_in_use += bytes;
+            uint64_t peak = peak_bytes.load();
+            while (in_use > peak && !peak_bytes.compare_exchange_weak(peak, in_use)) {}
+            return pointer;
+        }
+        void counting_resource::do_deallocate(void* pointer, size_t bytes, size_t alignment) {
+            upstream->deallocate(pointer, bytes, alignment);
+            deallocations++;
+            bytes_in_use -= bytes;
+        }
+        bool counting_resource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+            return this == &other;
+        }
+        model_handle::model_handle(NeuralNetwork::network neural_network) {
+            publish(std::move(neural_network));
+        }
+        model_handle::~model_handle() {
+            delete current.load();
+        }
+        model_handle::snapshot model_handle::acquire() const {
+            // Announce the read on the current epoch's counter, retry if a writer flipped the epoch in between so it can't miss this read
+            uint64_t reading;
+            while (true) {
+                reading = epoch.load();
+                readers[reading & 1].fetch_add(1);
+                if (epoch.load() == reading) break;
+                readers[reading & 1].fetch_sub(1);
+            }
+
+            // Only the copy is protected, the snapshot's own reference keeps its version alive afterwards
+            snapshot result;
+            if (snapshot* version = current.load()) result = *version;
+            readers[reading & 1].fetch_sub(1);
+            return result;
+        }
+        void model_handle::publish(NeuralNetwork::network neural_network) {
+            std::lock_guard<std::mutex> lock(writer);
+            snapshot* old = current.exchange(new snapshot(std::make_shared<const NeuralNetwork::network>(std::move(neural_network))));
+            published++;
+
+            // Grace period: readers that could still be copying the old snapshot all counted themselves on the old epoch
+            uint64_t previous = epoch.fetch_add(1);
+            while (readers[previous & 1].load() != 0) std::this_thread::yield();
+            delete old;
+        }
+        void model_handle::reload(char* location) {
+            NeuralNetwork::network neural_network = load_network(location);
+            if (neural_network.layers.empty()) {std::cerr << "model_handle: failed to reload \"" << location << "\", keeping the current version\n";return;}
+            publish(std::move(neural_network));
+        }
+        uint64_t model_handle::version() const {
+            return published.load();
+        }
+        model_registry::model_registry(uint64_t budget_bytes) : budget(budget_bytes) {}
+        model_handle::snapshot model_registry::get(char* location) {
+            std::string key = file_identity(location);
+            if (key.empty()) {std::cerr << "model_registry: failed to find \"" << location << "\"\n";return {};}
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto found = index.find(key);
+                if (found != index.end()) {
+                    entries.splice(entries.begin(), entries, found->second);
+                    totals.hits++;
+                    return found->second->neural_network;
+                }
+                totals.misses++;
+            }
+
+            // Loaded outside the lock so other models stay available, a concurrent load of the same file keeps the first copy
+            NeuralNetwork::network loaded = load_network(location);
+            if (loaded.layers.empty()) return {};
+            uint64_t bytes = network_bytes(loaded);
+            model_handle::snapshot neural_network = std::make_shared<const NeuralNetwork::network>(std::move(loaded));
+
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = index.find(key);
+            if (found != index.end()) return found->second->neural_network;
+            entries.push_front(entry{key, neural_network, bytes});
+            index[key] = entries.begin();
+            totals.bytes += bytes;
+            totals.models++;
+            evict();
+            return neural_network;
+        }
+        void model_registry::set_budget(uint64_t budget_bytes) {
+            std::lock_guard<std::mutex> lock(mutex);
+            budget = budget_bytes;
+            evict();
+        }
+        void model_registry::clear() {
+            std::lock_guard<std::mutex> lock(mutex);
+            entries.clear();
+            index.clear();
+            totals.bytes = 0;
+            totals.models = 0;
+        }
+        NeuralNetwork::registry_counters model_registry::counters() {
+            std::lock_guard<std::mutex> lock(mutex);
+            return totals;
+        }
+        void model_registry::evict() {
+            // The most recently used model always stays, even when it's over the budget on its own
+            while (totals.bytes > budget && entries.size() > 1) {
+                entry& last = entries.back();
+                totals.bytes -= last.bytes;
+                totals.models--;
+                totals.evictions++;
+                index.erase(last.key);
+                entries.pop_back();
+            }
+        }
+        inference_cache::inference_cache(uint64_t budget_bytes, uint32_t shards) : budget(budget_bytes) {
+            for (uint32_t i = 0; i < std::max<uint32_t>(shards, 1); i++) this->shards.push_back(std::make_unique<shard>());
+        }
+        std::vector<float> inference_cache::forward(const NeuralNetwork::network& neural_network, uint64_t version, const std::vector<float>& inputs) {
+            std::vector<float> outputs;
+            if (lookup(version, inputs, outputs)) return outputs;
+
+            // Computed outside the lock, so a slow miss never holds up its shard
+            outputs = forward_pass(neural_network, inputs).outputs;
+            if (!outputs.empty()) insert(version, inputs, outputs);
+            return outputs;
+        }
+        bool inference_cache::lookup(uint64_t version, const std::vector<float>& inputs, std::vector<float>& outputs) {
+            uint64_t key = hash_floats(inputs.data(), inputs.size(), version);
+            shard& part = shard_of(key);
+            std::lock_guard<std::mutex> lock(part.mutex);
+
+            // Hashes can collide, an entry only counts when its version and inputs match bit for bit
+            auto found = part.index.find(key);
+            if (found != part.index.end()) {
+                const entry& cached = *found->second;
+                if (cached.version == version && cached.inputs.size() == inputs.size() && (inputs.empty() || std::memcmp(cached.inputs.data(), inputs.data(), inputs.size() * sizeof(float)) == 0)) {
+                    part.entries.splice(part.entries.begin(), part.entries, found->second);
+                    outputs = cached.outputs;
+                    part.totals.hits++;
+                    return true;
+                }
+            }
+            part.totals.misses++;
+            return false;
+        }
+        void inference_cache::insert(uint64_t version, const std::vector<float>& inputs, const std::vector<float>& outputs) {
+            uint64_t key = hash_floats(inputs.data(), inputs.size(), version);
+            uint64_t bytes = sizeof(entry) + (inputs.size() + outputs.size()) * sizeof(float) + 4 * sizeof(void*); // Plus the list node and index slot
+            shard& part = shard_of(key);
+            std::lock_guard<std::mutex> lock(part.mutex);
+
+            // A concurrent miss on the same inputs, or a colliding entry, is replaced
+            auto found = part.index.find(key);
+            if (found != part.index.end()) {
+                part.totals.bytes -= found->second->bytes;
+                part.totals.entries--;
+                part.entries.erase(found->second);
+                part.index.erase(found);
+            }
+            part.entries.push_front(entry{key, version, inputs, outputs, bytes});
+            part.index[key] = part.entries.begin();
+            part.totals.bytes += bytes;
+            part.totals.entries++;
+            evict(part);
+        }
+        void inference_cache::set_budget(uint64_t budget_bytes) {
+            budget = budget_bytes;
+            for (std::unique_ptr<shard>& part : shards) {
+                std::lock_guard<std::mutex> lock(part->mutex);
+                evict(*part);
+            }
+        }
+        void inference_cache::clear() {
+            for (std::unique_ptr<shard>& part : shards) {
+                std::lock_guard<std::mutex> lock(part->mutex);
+                part->entries.clear();
+                part->index.clear();
+                part->totals.bytes = 0;
+                part->totals.entries = 0;
+            }
+        }
+        NeuralNetwork::cache_counters inference_cache::counters() {
+            NeuralNetwork::cache_counters sum;
+            for (std::unique_ptr<shard>& part : shards) {
+                std::lock_guard<std::mutex> lock(part->mutex);
+                sum.hits += part->totals.hits;
+                sum.misses += part->totals.misses;
+                sum.evictions += part->totals.evictions;
+                sum.bytes += part->totals.bytes;
+                sum.entries += part->totals.entries;
+            }
+            return sum;
+        }
+        inference_cache::shard& inference_cache::shard_of(uint64_t key) {
+            // The index uses the low bits, the shard the high ones
+            return *shards[(key >> 32) % shards.size()];
+        }
+        void inference_cache::evict(shard& part) {
+            // Every shard gets an equal share of the budget
+            uint64_t share = budget.load() / shards.size();
+            while (part.totals.bytes > share && !part.entries.empty()) {
+                entry& last = part.entries.back();
+                part.totals.bytes -= last.bytes;
+                part.totals.entries--;
+                part.totals.evictions++;
+                part.index.erase(last.key);
+                part.entries.pop_back();
+            }
+        }
+        ring::~ring() {
+            close();
+        }
+        bool ring::connect(uint32_t rank, const std::vector<std::string>& hosts, uint16_t base_port, double timeout_seconds) {
+            close();
+            if (rank >= hosts.size()) {std::cerr << "ring: rank " << rank << " is outside the " << hosts.size() << " hosts\n";return false;}
+            position = rank;
+            workers = static_cast<uint32_t>(hosts.size());
+            if (workers == 1) return true;
+#if defined(__unix__) || defined(__APPLE__)
+            // Listen before connecting, so every worker's connect lands in a backlog no matter who starts first
+            int listener = socket(AF_INET, SOCK_STREAM, 0);
+            if (listener < 0) {std::cerr << "ring: failed to create a socket\n";return false;}
+            int enabled = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons(static_cast<uint16_t>(base_port + rank));
+            if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 1) != 0) {
+                std::cerr << "ring: failed to listen on port " << base_port + rank << "\n";
+                ::close(listener);
+                return false;
+            }
+
+            // The next worker may not be listening yet, retry until the timeout
+            uint32_t following = (rank + 1) % workers;
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout_seconds);
+            while ((next = open_connection(hosts[following], static_cast<uint16_t>(base_port + following))) < 0) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    std::cerr << "ring: timed out connecting to worker " << following << " at " << hosts[following] << "\n";
+                    ::close(listener);
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            }
+
+            pollfd waiting{listener, POLLIN, 0};
+            int remaining = static_cast<int>(std::max(0.0, std::chrono::duration<double, std::milli>(deadline - std::chrono::steady_clock::now()).count()));
+            if (poll(&waiting, 1, remaining) == 1) previous = accept(listener, nullptr, nullptr);
+            ::close(listener);
+            if (previous < 0) {
+                std::cerr << "ring: timed out waiting for worker " << (rank + workers - 1) % workers << "\n";
+                close();
+                return false;
+            }
+            configure_socket(next);
+            configure_socket(previous);
+            return true;
+#else
+            std::cerr << "ring: sockets are only supported on unix systems\n";
+            return false;
+#endif
+        }
+        void ring::close() {
+#if defined(__unix__) || defined(__APPLE__)
+            if (next >= 0) ::close(next);
+            if (previous >= 0) ::close(previous);
+#endif
+            next = -1;
+            previous = -1;
+        }
+        bool ring::all_reduce(float* data, size_t count) {
+            if (workers == 1) return true;
+            if (next < 0 || previous < 0) {std::cerr << "ring: all_reduce called before connect\n";return false;}
+
+            // Segment i is [count * i / workers, count * (i + 1) / workers)
+            auto segment = [&](uint32_t i, size_t& first, size_t& size) {
+                i %= workers;
+                first = count * i / workers;
+                size = count * (i + 1) / workers - first;
+            };
+            size_t send_first, send_size, receive_first, receive_size;
+
+            // Reduce-scatter: after workers - 1 steps, worker r holds the full sum of segment r + 1
+            for (uint32_t step = 0; step + 1 < workers; step++) {
+                segment(position + workers - step, send_first, send_size);
+                segment(position + 2 * workers - step - 1, receive_first, receive_size);
+                incoming.resize(receive_size);
+                if (!exchange(reinterpret_cast<const char*>(data + send_first), send_size * sizeof(float), reinterpret_cast<char*>(incoming.data()), receive_size * sizeof(float))) return false;
+                float* sums = data + receive_first;
+                for (size_t i = 0; i < receive_size; i++) sums[i] += incoming[i];
+            }
+
+            // All-gather: every finished sum travels once around the ring, so every worker ends up with the same bits
+            for (uint32_t step = 0; step + 1 < workers; step++) {
+                segment(position + workers + 1 - step, send_first, send_size);
+                segment(position + workers - step, receive_first, receive_size);
+                if (!exchange(reinterpret_cast<const char*>(data + send_first), send_size * sizeof(float), reinterpret_cast<char*>(data + receive_first), receive_size * sizeof(float))) return false;
+            }
+            return true;
+        }
+        bool ring::exchange(const char* send, size_t send_size, char* receive, size_t receive_size) {
+#if defined(__unix__) || defined(__APPLE__)
+            size_t sent = 0, received = 0;
+            while (sent < send_size || received < receive_size) {
+                pollfd sockets[2] = {{next, static_cast<short>(sent < send_size ? POLLOUT : 0), 0}, {previous, static_cast<short>(received < receive_size ? POLLIN : 0), 0}};
+                if (poll(sockets, 2, -1) < 0) {
+                    if (errno == EINTR) continue;
+                    std::cerr << "ring: poll failed\n";return false;
+                }
+                if (sockets[0].revents & (POLLERR | POLLHUP)) {std::cerr << "ring: lost the connection to worker " << (position + 1) % workers << "\n";return false;}
+                if (sent < send_size && (sockets[0].revents & POLLOUT)) {
+                    ssize_t bytes = send_bytes(next, send + sent, send_size - sent);
+                    if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {std::cerr << "ring: failed sending to worker " << (position + 1) % workers << "\n";return false;}
+                    if (bytes > 0) sent += static_cast<size_t>(bytes);
+                }
+                if (received < receive_size && (sockets[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    ssize_t bytes = recv(previous, receive + received, receive_size - received, 0);
+                    if (bytes == 0) {std::cerr << "ring: worker " << (position + workers - 1) % workers << " closed the connection\n";return false;}
+                    if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {std::cerr << "ring: failed receiving from worker " << (position + workers - 1) % workers << "\n";return false;}
+                    if (bytes > 0) received += static_cast<size_t>(bytes);
+                }
+            }
+            return true;
+#else
+            (void)send; (void)send_size; (void)receive; (void)receive_size;
+            return false;
+#endif
+        }
+        uint32_t ring::rank() const {
+            return position;
+        }
+        uint32_t ring::size() const {
+            return workers;
+        }
+        struct pipeline::stage_queues {
+            std::vector<std::unique_ptr<spsc_queue<std::vector<float>>>> forward, backward; // Queue s runs between stage s and stage s + 1
+        };
+        pipeline::pipeline(NeuralNetwork::network& neural_network, uint32_t stages, uint32_t micro_batch_size) : neural_network(neural_network), micro_batch(std::max(1u, micro_batch_size)) {
+            size_t layers = neural_network.layers.size();
+            stages = static_cast<uint32_t>(std::min<size_t>(std::max(1u, stages), std::max<size_t>(1, layers)));
+
+            // Stages are cut where the running weight count passes each stage's share, a layer's cost is about its weight count
+            auto cost = [&](size_t l) {
+                const NeuralNetwork::layer& layer = neural_network.layers[l];
+                if (layer.type == NeuralNetwork::layer_type::embedding) return static_cast<uint64_t>(layer.output_size); // A gather, not a product
+                return static_cast<uint64_t>(std::max<size_t>(1, layer.sparse_rows.empty() ? layer.weights.size() : layer.sparse_values.size()));
+            };
+            uint64_t total = 0, running = 0;
+            for (size_t l = 0; l < layers; l++) total += cost(l);
+            first_layers.push_back(0);
+            for (size_t l = 0; l + 1 < layers; l++) {
+                running += cost(l);
+                size_t cuts = stages - first_layers.size();
+                if (cuts > 0 && (running * stages >= total * first_layers.size() || layers - l - 1 == cuts)) first_layers.push_back(l + 1);
+            }
+            first_layers.push_back(layers);
+
+            // Each stage's thread waits for a task, runs its part of it and reports back, until the pipeline is destroyed
+            stages = static_cast<uint32_t>(first_layers.size() - 1);
+            queues = std::make_unique<stage_queues>();
+            for (size_t s = 0; s + 1 < stages; s++) {
+                queues->forward.push_back(std::make_unique<spsc_queue<std::vector<float>>>(4));
+                queues->backward.push_back(std::make_unique<spsc_queue<std::vector<float>>>(4));
+            }
+            for (size_t s = 0; s < stages; s++) {
+                threads.emplace_back([this, s, stages]() {
+                    if (numa_pinning && numa().node_cores.size() > 1) pin_thread(worker_core(s, stages));
+                    uint64_t seen = 0;
+                    while (true) {
+                        {
+                            std::unique_lock<std::mutex> lock(mutex);
+                            condition.wait(lock, [&]() {return stopping || generation != seen;});
+                            if (stopping) return;
+                            seen = generation;
+                        }
+                        task(s);
+                        std::lock_guard<std::mutex> lock(mutex);
+                        if (--pending == 0) condition.notify_all();
+                    }
+                });
+            }
+        }
+        pipeline::~pipeline() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+                condition.notify_all();
+            }
+            for (std::thread& thread : threads) thread.join();
+        }
+        void pipeline::start(std::function<void(size_t)> stage_task) {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = std::move(stage_task);
+            pending = threads.size();
+            generation++;
+            condition.notify_all();
+        }
+        void pipeline::wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [&]() {return pending == 0;});
+            task = nullptr;
+        }
+        std::vector<float> pipeline::forward(const std::vector<float>& inputs) {
+            if (neural_network.layers.empty()) {std::cerr << "pipeline: network has no layers\n";return {};}
+            size_t input_size = neural_network.layers[0].input_size, output_size = neural_network.layers.back().output_size;
+            if (inputs.size() % input_size != 0) {std::cerr << "pipeline: inputs do not match that of the provided neural network\n";return {};}
+            size_t rows = inputs.size() / input_size;
+            size_t micro_batches = (rows + micro_batch - 1) / micro_batch;
+            size_t stages = first_layers.size() - 1;
+            std::vector<float> outputs(rows * output_size);
+
+            // Stage s reads micro-batches from queue s - 1 and writes them to queue s
+            std::vector<std::unique_ptr<spsc_queue<std::vector<float>>>>& forward_queues = queues->forward;
+            start([&](size_t s) {
+                size_t begin = first_layers[s], end = first_layers[s + 1];
+                size_t stage_inputs = neural_network.layers[begin].input_size, stage_outputs = neural_network.layers[end - 1].output_size;
+                size_t width = 0;
+                for (size_t l = begin; l < end; l++) width += neural_network.layers[l].output_size;
+                std::vector<float> pre_activations(width), activations(width), received, sent;
+
+                for (size_t m = 0; m < micro_batches; m++) {
+                    size_t first = m * micro_batch, count = std::min(micro_batch, rows - first);
+                    const float* source = inputs.data() + first * input_size;
+                    if (s > 0) {
+                        forward_queues[s - 1]->pop(received);
+                        source = received.data();
+                    }
+                    float* destination = outputs.data() + first * output_size;
+                    if (s + 1 < stages) {
+                        sent.resize(count * stage_outputs);
+                        destination = sent.data();
+                    }
+                    for (size_t r = 0; r < count; r++) {
+                        forward_layers(neural_network, begin, end, source + r * stage_inputs, pre_activations.data(), activations.data());
+                        std::memcpy(destination + r * stage_outputs, activations.data() + width - stage_outputs, stage_outputs * sizeof(float));
+                    }
+                    if (s + 1 < stages) forward_queues[s]->push(sent);
+                }
+            });
+            wait();
+            return outputs;
+        }
+        float pipeline::train(const NeuralNetwork::dataset& data, uint32_t epochs, uint32_t batch_size) {
+            if (neural_network.layers.empty()) {std::cerr << "pipeline: network has no layers\n";return 0.0f;}
+            if (data.input_size != neural_network.layers[0].input_size || data.output_size != neural_network.layers.back().output_size) {std::cerr << "pipeline: dataset does not match the provided neural network\n";return 0.0f;}
+            if (data.input_size == 0 || data.inputs.size() % data.input_size != 0 || data.outputs.size() != data.inputs.size() / data.input_size * data.output_size) {std::cerr << "pipeline: dataset inputs and outputs have different amounts of rows\n";return 0.0f;}
+            size_t rows = data.inputs.size() / data.input_size;
+            if (rows == 0 || batch_size == 0) {std::cerr << "pipeline: dataset or batch size is empty\n";return 0.0f;}
+
+            // Packed copies are rebuilt once at the end, as in train_network
+            std::vector<std::pair<uint32_t, uint32_t>> packing(neural_network.layers.size(), {0, 0});
+            for (size_t l = 0; l < neural_network.layers.size(); l++) {
+                NeuralNetwork::layer& layer = neural_network.layers[l];
+                if (!layer.packed.empty()) {
+                    packing[l] = {layer.panel_width, layer.k_block};
+                    std::vector<float>().swap(layer.packed);
+                }
+            }
+
+            size_t stages = first_layers.size() - 1;
+            size_t batches = (rows + batch_size - 1) / batch_size;
+            std::vector<std::unique_ptr<spsc_queue<std::vector<float>>>>& forward_queues = queues->forward;
+            std::vector<std::unique_ptr<spsc_queue<std::vector<float>>>>& backward_queues = queues->backward;
+
+            // Stages work on a batch once it's released, and report back when their part of its backward pass is done
+            NeuralNetwork::backprop_averages gradients;
+            zero_gradients(neural_network, gradients);
+            double loss_sum = 0.0;
+            size_t released = 0, finished = 0;
+            std::mutex step_mutex;
+            std::condition_variable step_condition;
+
+            start([&](size_t s) {
+                size_t begin = first_layers[s], end = first_layers[s + 1];
+                size_t stage_inputs = neural_network.layers[begin].input_size, stage_outputs = neural_network.layers[end - 1].output_size;
+                size_t width = 0;
+                for (size_t l = begin; l < end; l++) width += neural_network.layers[l].output_size;
+                bool last_stage = s + 1 == stages;
+                std::vector<std::vector<float>> saved_inputs, saved_pre_activations, saved_activations;
+                std::vector<float> message, back;
+
+                for (size_t step = 0; step < static_cast<size_t>(epochs) * batches; step++) {
+                    {
+                        std::unique_lock<std::mutex> lock(step_mutex);
+                        step_condition.wait(lock, [&]() {return released > step;});
+                    }
+                    size_t first_row = (step % batches) * batch_size;
+                    size_t batch = std::min<size_t>(batch_size, rows - first_row);
+                    size_t micro_batches = (batch + micro_batch - 1) / micro_batch;
+                    saved_inputs.resize(micro_batches);
+                    saved_pre_activations.resize(micro_batches);
+                    saved_activations.resize(micro_batches);
+
+                    // Every micro-batch goes forward, keeping what the backward pass needs
+                    for (size_t m = 0; m < micro_batches; m++) {
+                        size_t first = first_row + m * micro_batch, count = std::min(micro_batch, first_row + batch - first);
+                        if (s == 0) saved_inputs[m].assign(data.inputs.begin() + first * data.input_size, data.inputs.begin() + (first + count) * data.input_size);
+                        else forward_queues[s - 1]->pop(saved_inputs[m]);
+                        saved_pre_activations[m].resize(count * width);
+                        saved_activations[m].resize(count * width);
+                        if (!last_stage) message.resize(count * stage_outputs);
+                        for (size_t r = 0; r < count; r++) {
+                            float* pre_activations = saved_pre_activations[m].data() + r * width;
+                            float* activations = saved_activations[m].data() + r * width;
+                            forward_layers(neural_network, begin, end, saved_inputs[m].data() + r * stage_inputs, pre_activations, activations);
+                            if (last_stage) loss_sum += loss_function(neural_network.layers.back().activation, pre_activations + width - stage_outputs, activations + width - stage_outputs, &data.outputs[(first + r) * data.output_size], stage_outputs);
+                            else std::memcpy(message.data() + r * stage_outputs, activations + width - stage_outputs, stage_outputs * sizeof(float));
+                        }
+                        if (!last_stage) forward_queues[s]->push(message);
+                    }
+
+                    // Then every micro-batch comes back in the same order, so gradients are summed in the same order as train_network
+                    for (size_t m = 0; m < micro_batches; m++) {
+                        size_t first = first_row + m * micro_batch, count = std::min(micro_batch, first_row + batch - first);
+                        std::vector<float> incoming;
+                        if (!last_stage) backward_queues[s]->pop(incoming);
+                        if (s > 0) message.resize(count * stage_inputs);
+                        for (size_t r = 0; r < count; r++) {
+                            const float* activations = saved_activations[m].data() + r * width;
+                            if (last_stage) {
+                                back.resize(stage_outputs);
+                                const float* expected = &data.outputs[(first + r) * data.output_size];
+                                for (size_t j = 0; j < stage_outputs; j++) back[j] = activations[width - stage_outputs + j] - expected[j];
+                            } else {
+                                back.assign(incoming.begin() + r * stage_outputs, incoming.begin() + (r + 1) * stage_outputs);
+                            }
+                            backward_layers(neural_network, begin, end, saved_inputs[m].data() + r * stage_inputs, saved_pre_activations[m].data() + r * width, activations, back, gradients, nullptr);
+                            if (s > 0) std::memcpy(message.data() + r * stage_inputs, back.data(), stage_inputs * sizeof(float));
+                        }
+                        if (s > 0) backward_queues[s - 1]->push(message);
+                    }
+
+                    std::lock_guard<std::mutex> lock(step_mutex);
+                    finished++;
+                    step_condition.notify_all();
+                }
+            });
+
+            // The caller applies each batch's gradients between batches, exactly as train_network does
+            float epoch_loss = 0.0f;
+            for (size_t step = 0; step < static_cast<size_t>(epochs) * batches; step++) {
+                size_t first_row = (step % batches) * batch_size;
+                size_t batch = std::min<size_t>(batch_size, rows - first_row);
+                {
+                    std::unique_lock<std::mutex> lock(step_mutex);
+                    released++;
+                    step_condition.notify_all();
+                    step_condition.wait(lock, [&]() {return finished == stages;});
+                    finished = 0;
+                }
+                scale_gradients(neural_network, gradients, 1.0f / static_cast<float>(batch));
+                apply_gradients(neural_network, gradients);
+                zero_gradients(neural_network, gradients);
+                if ((step + 1) % batches == 0) {
+                    epoch_loss = static_cast<float>(loss_sum / rows);
+                    loss_sum = 0.0;
+                }
+            }
+            wait();
+
+            for (size_t l = 0; l < neural_network.layers.size(); l++) {
+                if (packing[l].first != 0) pack_layer(neural_network.layers[l], packing[l].first, packing[l].second);
+            }
+            return epoch_loss;
+        }
+        uint32_t pipeline::stage_count() const {
+            return static_cast<uint32_t>(first_layers.size() - 1);
+        }
+        const std::vector<size_t>& pipeline::boundaries() const {
+            return first_layers;
+        }
+        numa_replicas::numa_replicas(const NeuralNetwork::network& neural_network) : replicas(numa().node_cores.size()) {
+            // Each copy is made by a thread running on its node, so the node's memory is where its pages are first touched
+            std::vector<std::thread> threads;
+            for (size_t node = 0; node < replicas.size(); node++) {
+                threads.emplace_back([&, node]() {
+                    pin_thread(numa().node_cores[node][0]);
+                    replicas[node] = neural_network;
+                });
+            }
+            for (std::thread& thread : threads) thread.join();
+        }
+        const NeuralNetwork::network& numa_replicas::local() const {
+            return replicas[std::min<size_t>(current_node(), replicas.size() - 1)];
+        }
+        const NeuralNetwork::network& numa_replicas::replica(uint32_t node) const {
+            return replicas[std::min<size_t>(node, replicas.size() - 1)];
+        }
+        uint32_t numa_replicas::nodes() const {
+            return static_cast<uint32_t>(replicas.size());
+        }
+        std::vector<float> numa_replicas::forward(const std::vector<float>& inputs) const {
+            const NeuralNetwork::network& first = replicas[0];
+            if (first.layers.empty()) {std::cerr << "numa_replicas: network has no layers\n";return {};}
+            size_t input_size = first.layers[0].input_size, output_size = first.layers.back().output_size;
+            if (inputs.size() % input_size != 0) {std::cerr << "numa_replicas: inputs do not match that of the provided neural network\n";return {};}
+            size_t rows = inputs.size() / input_size;
+            size_t width = 0;
+            for (const NeuralNetwork::layer& layer : first.layers) width += layer.output_size;
+
+            // parallel_for's threads are pinned by node, each one reads the weights of the node it's on
+            std::vector<float> outputs(rows * output_size);
+            parallel_for(rows, 16, [&](size_t begin, size_t end) {
+                const NeuralNetwork::network& neural_network = local();
+                std::vector<float> pre_activations(width), activations(width);
+                for (size_t row = begin; row < end; row++) {
+                    forward_layers(neural_network, 0, neural_network.layers.size(), &inputs[row * input_size], pre_activations.data(), activations.data());
+                    std::memcpy(&outputs[row * output_size], activations.data() + width - output_size, output_size * sizeof(float));
+                }
+            });
+            return outputs;
+        }
         void insert_bytes(char* location, std::fstream& file, std::streampos position, size_t old_data_size, const char* data, size_t data_size) {
             if (!file.is_open()) {
                 std::cerr << "insert_bytes: file not open\n";
@@ -99,17 +2610,31 @@
             }
 
             // Calculate tail size
-            size_t tail_size = file_size - (static_cast<size_t>(position) + old_data_size);
-
-            // Read tail if there is any
-            std::vector<char> tail;
-            if (tail_size > 0) {
-                tail.resize(tail_size);
-                file.seekg(position + static_cast<std::streamoff>(old_data_size), std::ios::beg);
-                file.read(tail.data(), static_cast<std::streamsize>(tail_size));
-                if (!file) {
-                    std::cerr << "insert_bytes: read tail failed\n";
-                    return;
+            size_t tail_start = static_cast<size_t>(position) + old_data_size;
+            size_t tail_size = file_size - tail_start;
+
+            // Shift the tail in chunks so it never has to fit in memory, back to front when it moves up so nothing is overwritten before it's read
+            if (tail_size > 0 && data_size != old_data_size) {
+                const size_t chunk = size_t(4) << 20;
+                std::vector<char> buffer(std::min(chunk, tail_size));
+                bool growing = data_size > old_data_size;
+                for (size_t moved = 0; moved < tail_size;) {
+                    size_t size = std::min(chunk, tail_size - moved);
+                    size_t from = growing ? tail_start + tail_size - moved - size : tail_start + moved;
+                    size_t to = from - old_data_size + data_size;
+                    file.seekg(static_cast<std::streamoff>(from), std::ios::beg);
+                    file.read(buffer.data(), static_cast<std::streamsize>(size));
+                    if (!file) {
+                        std::cerr << "insert_bytes: read tail failed\n";
+                        return;
+                    }
+                    file.seekp(static_cast<std::streamoff>(to), std::ios::beg);
+                    file.write(buffer.data(), static_cast<std::streamsize>(size));
+                    if (!file) {
+                        std::cerr << "insert_bytes: write tail failed\n";
+                        return;
+                    }
+                    moved += size;
                 }
             }
 
@@ -123,15 +2648,6 @@
                 }
             }
 
-            // Write tail
-            if (tail_size > 0) {
-                file.write(tail.data(), static_cast<std::streamsize>(tail_size));
-                if (!file) {
-                    std::cerr << "insert_bytes: write tail failed\n";
-                    return;
-                }
-            }
-
             // Resize file if new file is smaller or larger
             size_t new_file_size = file_size - old_data_size + data_size;
             if (new_file_size != file_size) {
@@ -177,12 +2693,27 @@
             file.read(reinterpret_cast<char*>(config_data.data()), config_size * sizeof(uint32_t));
             if (!file) {std::cerr << "read_metadata: error getting config_data metadata.\n";return NeuralNetwork::file_metadata{};}
 
-            return NeuralNetwork::file_metadata{version, blocks, block_sizes, config_size, config_data};
+            NeuralNetwork::file_metadata metadata;
+            metadata.version = version;
+            metadata.blocks = blocks;
+            metadata.block_sizes = block_sizes;
+            metadata.config_size = config_size;
+            metadata.config_data = config_data;
+            metadata.end = block_offset(metadata, blocks);
+
+            // Append-only files keep their current blocks and config data in the newest index instead of the header
+            uint64_t header_size = block_offset(metadata, 0);
+            if (version == 3 && !find_log_index(file, header_size, metadata)) {std::cerr << "read_metadata: append-only file has no valid index.\n";return NeuralNetwork::file_metadata{};}
+
+            file.clear();
+            file.seekg(static_cast<std::streamoff>(header_size), std::ios::beg);
+            return metadata;
         }
         void write_config(char* location, std::fstream& file, std::vector<uint32_t> config_data) {
             if (!file.is_open()) {std::cerr << "write_config: failed to open provided file.\n";return;}
 
             NeuralNetwork::file_metadata metadata = read_metadata(file);
+            if (metadata.version == 3) {std::cerr << "write_config: \"" << location << "\" is append-only, compact it first\n";return;}
             size_t sum = sizeof(uint32_t) * (2 + metadata.blocks); // Size of metadata minus config_size and config_data in bytes
 
             // Change config_size
@@ -195,37 +2726,50 @@
 
             file.seekg(0, std::ios::beg);
         }
+        std::vector<uint32_t> read_config_record(const std::vector<uint32_t>& config_data, uint32_t tag) {
+            // Records start after the input size and are laid out as: tag, length, values
+            size_t i = 1;
+            while (i + 2 <= config_data.size()) {
+                size_t length = config_data[i + 1];
+                if (i + 2 + length > config_data.size()) {std::cerr << "read_config_record: record " << config_data[i] << " runs past the end of the config data\n";return {};}
+                if (config_data[i] == tag) {
+                    return std::vector<uint32_t>(config_data.begin() + i + 2, config_data.begin() + i + 2 + length);
+                }
+                i += 2 + length;
+            }
+            return {};
+        }
+        void write_config_record(std::vector<uint32_t>& config_data, uint32_t tag, const std::vector<uint32_t>& values) {
+            if (config_data.empty()) {std::cerr << "write_config_record: config data has no input size\n";return;}
+
+            // Replace the old record with this tag in place, or drop it if there are no values
+            size_t i = 1;
+            bool replaced = false;
+            while (i + 2 <= config_data.size()) {
+                size_t length = std::min<size_t>(config_data[i + 1], config_data.size() - i - 2);
+                if (config_data[i] == tag && !replaced && !values.empty()) {
+                    config_data[i + 1] = static_cast<uint32_t>(values.size());
+                    config_data.erase(config_data.begin() + i + 2, config_data.begin() + i + 2 + length);
+                    config_data.insert(config_data.begin() + i + 2, values.begin(), values.end());
+                    replaced = true;
+                    i += 2 + values.size();
+                } else if (config_data[i] == tag) {
+                    config_data.erase(config_data.begin() + i, config_data.begin() + i + 2 + length);
+                } else {
+                    i += 2 + length;
+                }
+            }
+
+            if (values.empty() || replaced) return;
+            config_data.push_back(tag);
+            config_data.push_back(static_cast<uint32_t>(values.size()));
+            config_data.insert(config_data.end(), values.begin(), values.end());
+        }
         std::vector<float> read_block(char* location, uint32_t block) {
             // Open file
             std::fstream file(location, std::ios::in | std::ios::binary);
             if (!file.is_open()) {std::cerr << "read_block: failed to open \"" << location << "\".\n";return {};}
-                
-            NeuralNetwork::file_metadata file_metadata = read_metadata(file);
-            uint32_t version = file_metadata.version;
-            uint32_t blocks = file_metadata.blocks;
-            std::vector<uint32_t> block_sizes = file_metadata.block_sizes;
-            uint32_t config_size = file_metadata.config_size;
-
-            // Find the block the user wants
-                if (block >= blocks) {std::cerr << "Block # requested is invalid.\n";return {};}
-
-                // Sum the size of all blocks before the one the user wants
-                size_t sum = sizeof(uint32_t) * (3 + blocks + config_size); // Size of metadata
-                for (size_t i = 0; i < block; i++) { sum += block_sizes[i]; }
-
-                // Read the block
-                size_t bytes = static_cast<size_t>(block_sizes[block]);
-                if (bytes % sizeof(float) != 0) {std::cerr << "read_block: block size not aligned with type\n";return {};}
-
-                std::vector<float> wanted_block(bytes / sizeof(float));
-
-                file.seekg(sum, std::ios::beg);
-                if (!file) {std::cerr << "read_block: seekg failed for block " << block << "\n";return {};}
-
-                file.read(reinterpret_cast<char*>(wanted_block.data()), bytes);
-                if (!file) {std::cerr << "read_block: error reading block " << block << "\n";return {};}
-
-            return wanted_block;
+            return ::read_block(file, read_metadata(file), block);
         }
         void write_block(char* location, uint32_t block, std::vector<float> values) {
             // Open file
@@ -237,6 +2781,7 @@
             uint32_t blocks = file_metadata.blocks;
             std::vector<uint32_t> block_sizes = file_metadata.block_sizes;
             uint32_t config_size = file_metadata.config_size;
+            if (version == 3) {std::cerr << "write_block: \"" << location << "\" is append-only, compact it first\n";return;}
 
             // Find the block the user wants
                 size_t sum = sizeof(uint32_t) * (3 + blocks + config_size); // Size of metadata
@@ -288,7 +2833,7 @@
             if (!file.is_open()) {std::cerr << "new_bin: failed to reopen \"" << location << "\"\n";return;}
 
             // version
-            uint32_t version = 1;
+            uint32_t version = 2;
             file.write(reinterpret_cast<char*>(&version), sizeof(version));
             if (!file) {std::cerr << "new_bin: error writing version\n";return;}
 
@@ -307,187 +2852,1346 @@
 
 
 
-        network create_network(std::vector<uint32_t> layers) {
+        void set_thread_count(uint32_t threads) {
+            worker_threads = std::max(1u, threads);
+        }
+        uint32_t thread_count() {
+            return worker_threads;
+        }
+        void set_numa_pinning(bool enabled) {
+            numa_pinning = enabled;
+        }
+        uint32_t numa_node_count() {
+            return static_cast<uint32_t>(numa().node_cores.size());
+        }
+        network create_network(std::vector<uint32_t> layers, std::vector<activation_type> activations) {
+            std::random_device device;
+            return create_network(layers, activations, (static_cast<uint64_t>(device()) << 32) | device());
+        }
+        network create_network(std::vector<uint32_t> layers, std::vector<activation_type> activations, uint64_t seed) {
             size_t length = layers.size();
             if (length < 2) {std::cerr << "create_network: provided network is too small\n";return NeuralNetwork::network{};}
+            if (activations.size() > length - 1) {std::cerr << "create_network: more activations were given than there are layers\n";return NeuralNetwork::network{};}
 
-            std::mt19937 gen(std::random_device{}());
             NeuralNetwork::network new_network;
-            new_network.config_data[0] = layers[0]; // Set input size
+            new_network.config_data.push_back(layers[0]); // Set input size
 
             std::vector<NeuralNetwork::layer> new_layers;
             
-            if (layers[1] == 0) {std::cerr << "create_network: layer 0 has zero neurons\n";return NeuralNetwork::network{};}
-            for (size_t i = 1; i < length - 1; i++) {
+            if (layers[0] == 0) {std::cerr << "create_network: input size is zero\n";return NeuralNetwork::network{};}
+            for (size_t i = 0; i < length - 1; i++) {
                 size_t i_plus_one = i + 1;
-                if (layers[i_plus_one] == 0) {std::cerr << "create_network: layer " << i_plus_one << " has zero neurons\n";return NeuralNetwork::network{};}
+                if (layers[i_plus_one] == 0) {std::cerr << "create_network: layer " << i << " has zero neurons\n";return NeuralNetwork::network{};}
                 NeuralNetwork::layer hidden_layer;
                 hidden_layer.input_size = layers[i];
                 hidden_layer.output_size = layers[i_plus_one];
-                size_t weights = (size_t)layers[i] * (size_t)layers[i_plus_one];
-                hidden_layer.weights.resize(weights);
-
-                for (size_t v = 0; v < weights; v++) {
-                    hidden_layer.weights[v] = initialize_weight(layers[i], gen);
-                }
+                hidden_layer.weights = initialized_weights(layers[i_plus_one], layers[i], static_cast<uint32_t>(i), seed);
                 hidden_layer.biases.resize(layers[i_plus_one], 0.01f);
+                if (i < activations.size()) hidden_layer.activation = activations[i];
+                if (hidden_layer.activation == NeuralNetwork::activation_type::softmax && i_plus_one != length - 1) {std::cerr << "create_network: softmax is only supported on the last layer\n";return NeuralNetwork::network{};}
                 new_layers.push_back(hidden_layer);
             }
 
             new_network.layers = new_layers;
+
+            // Record each layer's activation
+            std::vector<uint32_t> layer_activations;
+            for (const NeuralNetwork::layer& layer : new_network.layers) layer_activations.push_back(static_cast<uint32_t>(layer.activation));
+            write_config_record(new_network.config_data, config_activations, layer_activations);
+            write_config_record(new_network.config_data, config_seed, {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)});
+            return new_network;
+
+        }
+        network create_network(std::vector<NeuralNetwork::convolution> convolutions, std::vector<uint32_t> layers, std::vector<activation_type> activations, uint64_t seed) {
+            if (convolutions.empty()) {std::cerr << "create_network: no convolutions were given\n";return NeuralNetwork::network{};}
+            if (activations.size() > convolutions.size() + layers.size()) {std::cerr << "create_network: more activations were given than there are layers\n";return NeuralNetwork::network{};}
+
+            NeuralNetwork::network new_network;
+            uint64_t input_size = (uint64_t)convolutions[0].channels * convolutions[0].height * convolutions[0].width;
+            if (input_size == 0 || input_size > UINT32_MAX) {std::cerr << "create_network: input size is invalid\n";return NeuralNetwork::network{};}
+            new_network.config_data.push_back(static_cast<uint32_t>(input_size));
+
+            for (size_t i = 0; i < convolutions.size(); i++) {
+                NeuralNetwork::layer convolution_layer;
+                convolution_layer.shape = convolutions[i];
+                convolution_layer.type = (convolutions[i].height == 1 && convolutions[i].kernel_height == 1) ? NeuralNetwork::layer_type::conv1d : NeuralNetwork::layer_type::conv2d;
+                if (!valid_convolution(convolution_layer.shape, convolution_layer.type)) {std::cerr << "create_network: convolution " << i << "'s shape is invalid\n";return NeuralNetwork::network{};}
+                uint64_t inputs = (uint64_t)convolutions[i].channels * convolutions[i].height * convolutions[i].width;
+                uint64_t outputs = (uint64_t)convolutions[i].filters * convolution_height(convolutions[i], convolution_layer.type) * convolution_width(convolutions[i]);
+                if (inputs != input_size) {std::cerr << "create_network: convolution " << i << "'s input shape does not match the previous layer's outputs\n";return NeuralNetwork::network{};}
+                if (outputs > UINT32_MAX) {std::cerr << "create_network: convolution " << i << " has too many outputs\n";return NeuralNetwork::network{};}
+                convolution_layer.input_size = static_cast<uint32_t>(inputs);
+                convolution_layer.output_size = static_cast<uint32_t>(outputs);
+                convolution_layer.weights = initialized_weights(gemm_rows(convolution_layer), gemm_depth(convolution_layer), static_cast<uint32_t>(i), seed);
+                convolution_layer.biases.resize(convolutions[i].filters, 0.01f);
+                new_network.layers.push_back(convolution_layer);
+                input_size = outputs;
+            }
+            for (size_t i = 0; i < layers.size(); i++) {
+                if (layers[i] == 0) {std::cerr << "create_network: layer " << convolutions.size() + i << " has zero neurons\n";return NeuralNetwork::network{};}
+                NeuralNetwork::layer hidden_layer;
+                hidden_layer.input_size = static_cast<uint32_t>(input_size);
+                hidden_layer.output_size = layers[i];
+                hidden_layer.weights = initialized_weights(layers[i], input_size, static_cast<uint32_t>(convolutions.size() + i), seed);
+                hidden_layer.biases.resize(layers[i], 0.01f);
+                new_network.layers.push_back(hidden_layer);
+                input_size = layers[i];
+            }
+            for (size_t l = 0; l < activations.size(); l++) new_network.layers[l].activation = activations[l];
+            for (size_t l = 0; l + 1 < new_network.layers.size(); l++) {
+                if (new_network.layers[l].activation == NeuralNetwork::activation_type::softmax) {std::cerr << "create_network: softmax is only supported on the last layer\n";return NeuralNetwork::network{};}
+            }
+
+            // Record each layer's activation, the convolution shapes are recorded when the network is saved
+            std::vector<uint32_t> layer_activations;
+            for (const NeuralNetwork::layer& layer : new_network.layers) layer_activations.push_back(static_cast<uint32_t>(layer.activation));
+            write_config_record(new_network.config_data, config_activations, layer_activations);
+            write_config_record(new_network.config_data, config_seed, {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)});
+            return new_network;
+        }
+        network create_network(NeuralNetwork::embedding lookup, std::vector<uint32_t> layers, std::vector<activation_type> activations, uint64_t seed) {
+            if (lookup.categories == 0 || lookup.categories > embedding_categories || lookup.dimensions == 0 || lookup.fields + lookup.features == 0) {std::cerr << "create_network: embedding shape is invalid\n";return NeuralNetwork::network{};}
+            if (activations.size() > layers.size()) {std::cerr << "create_network: more activations were given than there are dense layers\n";return NeuralNetwork::network{};}
+            uint64_t outputs = (uint64_t)lookup.fields * lookup.dimensions + lookup.features;
+            if ((uint64_t)lookup.fields + lookup.features > UINT32_MAX || outputs > UINT32_MAX) {std::cerr << "create_network: embedding has too many inputs or outputs\n";return NeuralNetwork::network{};}
+
+            NeuralNetwork::network new_network;
+            new_network.config_data.push_back(lookup.fields + lookup.features);
+            NeuralNetwork::layer embedding_layer;
+            embedding_layer.type = NeuralNetwork::layer_type::embedding;
+            embedding_layer.lookup = lookup;
+            embedding_layer.input_size = lookup.fields + lookup.features;
+            embedding_layer.output_size = static_cast<uint32_t>(outputs);
+            embedding_layer.weights = initialized_weights(lookup.categories, lookup.dimensions, 0, seed);
+            embedding_layer.biases.resize(lookup.dimensions, 0.0f);
+            new_network.layers.push_back(embedding_layer);
+
+            uint32_t input_size = static_cast<uint32_t>(outputs);
+            for (size_t i = 0; i < layers.size(); i++) {
+                if (layers[i] == 0) {std::cerr << "create_network: layer " << i + 1 << " has zero neurons\n";return NeuralNetwork::network{};}
+                NeuralNetwork::layer hidden_layer;
+                hidden_layer.input_size = input_size;
+                hidden_layer.output_size = layers[i];
+                hidden_layer.weights = initialized_weights(layers[i], input_size, static_cast<uint32_t>(i + 1), seed);
+                hidden_layer.biases.resize(layers[i], 0.01f);
+                if (i < activations.size()) hidden_layer.activation = activations[i];
+                if (hidden_layer.activation == NeuralNetwork::activation_type::softmax && i + 1 != layers.size()) {std::cerr << "create_network: softmax is only supported on the last layer\n";return NeuralNetwork::network{};}
+                new_network.layers.push_back(hidden_layer);
+                input_size = layers[i];
+            }
+
+            // Record each layer's activation, the embedding's shape is recorded when the network is saved
+            std::vector<uint32_t> layer_activations;
+            for (const NeuralNetwork::layer& layer : new_network.layers) layer_activations.push_back(static_cast<uint32_t>(layer.activation));
+            write_config_record(new_network.config_data, config_activations, layer_activations);
+            write_config_record(new_network.config_data, config_seed, {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)});
             return new_network;
+        }
+        void reseed_network(NeuralNetwork::network& neural_network, uint64_t seed) {
+            // Layer l draws from counter stream l in every create_network, so reseeding with a network's own seed gives back its initial weights
+            for (size_t l = 0; l < neural_network.layers.size(); l++) {
+                NeuralNetwork::layer& layer = neural_network.layers[l];
+                std::vector<float> weights = initialized_weights(gemm_rows(layer), gemm_depth(layer), static_cast<uint32_t>(l), seed);
+                std::fill(layer.biases.begin(), layer.biases.end(), layer.type == NeuralNetwork::layer_type::embedding ? 0.0f : 0.01f);
+                if (!layer.sparse_rows.empty()) {
+                    // Pruned layers keep their pattern, each kept weight gets the value drawn for its position
+                    for (size_t j = 0; j < layer.output_size; j++) {
+                        for (size_t p = layer.sparse_rows[j]; p < layer.sparse_rows[j + 1]; p++) layer.sparse_values[p] = weights[j * layer.input_size + layer.sparse_columns[p]];
+                    }
+                    continue;
+                }
+                layer.weights = std::move(weights);
+                if (!layer.packed.empty()) pack_layer(layer, layer.panel_width, layer.k_block);
+            }
 
+            NeuralNetwork::optimizer& optimizer = neural_network.optimizer;
+            optimizer.step = 0;
+            optimizer.weight_moments.clear();
+            optimizer.bias_moments.clear();
+            optimizer.weight_variances.clear();
+            optimizer.bias_variances.clear();
+            if (neural_network.config_data.empty() && !neural_network.layers.empty()) neural_network.config_data.push_back(neural_network.layers[0].input_size);
+            write_config_record(neural_network.config_data, config_seed, {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)});
+        }
+        block_summary summarize_block(char* location, uint32_t block, uint32_t bins) {
+            std::fstream file(location, std::ios::in | std::ios::binary);
+            if (!file.is_open()) {std::cerr << "summarize_block: failed to open \"" << location << "\".\n";return {};}
+            NeuralNetwork::file_metadata metadata = read_metadata(file);
+            if (block >= metadata.blocks) {std::cerr << "summarize_block: block # requested is invalid.\n";return {};}
+            return ::summarize_block(file, metadata, block, bins);
         }
-        void output_network(NeuralNetwork::network neural_network) {
-            for (int i = 0; i < neural_network.layers.size(); i++) {
-                int digits = (i == 0) ? 1 : (int)std::log10(abs(i)) + 1; std::cout << i; for (int i = 0; i < 4 - digits; ++i) std::cout << ' ';
+        void output_network(char* location, std::ostream& out, bool summary) {
+            std::fstream file(location, std::ios::in | std::ios::binary);
+            if (!file.is_open()) {std::cerr << "output_network: failed to open \"" << location << "\".\n";return;}
+            NeuralNetwork::file_metadata metadata = read_metadata(file);
+            if (metadata.config_size == 0) {std::cerr << "output_network: \"" << location << "\" has no input size in its config data\n";return;}
+
+            // Name every block, extra blocks are named by the record that points at them
+            std::vector<uint32_t> layer_activations = read_config_record(metadata.config_data, config_activations);
+            size_t layers = layer_activations.empty() ? metadata.blocks / 2 : layer_activations.size();
+            std::vector<std::string> labels(metadata.blocks, "    extra:");
+            std::vector<bool> indices(metadata.blocks, false);
+            auto label = [&](uint32_t block, size_t layer, const char* name) {
+                if (block >= metadata.blocks) return;
+                labels[block] = std::to_string(layer);
+                labels[block].resize(4, ' ');
+                labels[block] += name;
+            };
+            for (size_t i = 0; i < layers && i * 2 + 1 < metadata.blocks; i++) {
+                label(static_cast<uint32_t>(i * 2), i, "biases:");
+                labels[i * 2 + 1] = "    weights:";
+            }
+            std::vector<uint32_t> packed = read_config_record(metadata.config_data, config_packed);
+            for (size_t i = 0; i + 2 < packed.size(); i += 3) label(packed[i], i / 3, "packed:");
+            std::vector<uint32_t> sparse = read_config_record(metadata.config_data, config_sparse);
+            for (size_t i = 0; i + 1 < sparse.size(); i += 2) {
+                label(sparse[i], i / 2, "rows:");
+                label(sparse[i + 1], i / 2, "columns:");
+                if (sparse[i] < metadata.blocks) indices[sparse[i]] = true;
+                if (sparse[i + 1] < metadata.blocks) indices[sparse[i + 1]] = true;
+            }
+
+            // Values are formatted with to_chars into one large buffer that is written out in chunks
+            std::string buffer;
+            buffer.reserve(1 << 20);
+            char number[64];
+            auto flush = [&]() {
+                out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                buffer.clear();
+            };
+            auto append = [&](auto value) {
+                std::to_chars_result result = std::to_chars(number, number + sizeof(number), value);
+                buffer.append(number, result.ptr);
+            };
+
+            buffer += "version ";
+            append(metadata.version);
+            buffer += ", input size ";
+            append(metadata.config_data[0]);
+            buffer += ", ";
+            append(metadata.blocks);
+            buffer += " blocks\n\n";
 
-                std::cout << "weights:    ";
-                for (size_t v = 0; v < neural_network.layers[i].weights.size(); v++) {
-                    std::cout << neural_network.layers[i].weights[v] << "  ";
+            for (uint32_t block = 0; block < metadata.blocks; block++) {
+                size_t start = buffer.size();
+                buffer += labels[block];
+                buffer.resize(start + std::max<size_t>(16, labels[block].size() + 1), ' ');
+
+                if (summary) {
+                    NeuralNetwork::block_summary block_summary = ::summarize_block(file, metadata, block, 10);
+                    append(block_summary.count);
+                    buffer += " values";
+                    if (block_summary.count > 0 && !indices[block]) {
+                        buffer += "  min ";
+                        append(block_summary.min);
+                        buffer += "  max ";
+                        append(block_summary.max);
+                        buffer += "  mean ";
+                        append(static_cast<float>(block_summary.mean));
+                        buffer += "  std ";
+                        append(static_cast<float>(block_summary.stddev));
+                        buffer += '\n';
+
+                        // One bar per bin, scaled to the fullest bin
+                        if (block_summary.max > block_summary.min) {
+                            uint64_t fullest = *std::max_element(block_summary.histogram.begin(), block_summary.histogram.end());
+                            float width = (block_summary.max - block_summary.min) / block_summary.histogram.size();
+                            for (size_t bin = 0; bin < block_summary.histogram.size(); bin++) {
+                                buffer.append(16, ' ');
+                                size_t column = buffer.size();
+                                append(block_summary.min + width * bin);
+                                buffer.resize(std::max(buffer.size(), column + 14), ' ');
+                                size_t bar = (fullest > 0) ? static_cast<size_t>(40 * block_summary.histogram[bin] / fullest) : 0;
+                                buffer.append(bar, '#');
+                                buffer += ' ';
+                                append(block_summary.histogram[bin]);
+                                buffer += '\n';
+                            }
+                        }
+                    } else {
+                        buffer += '\n';
+                    }
+                } else {
+                    stream_block(file, block_offset(metadata, block), metadata.block_sizes[block] / sizeof(float), [&](const float* values, size_t size) {
+                        for (size_t i = 0; i < size; i++) {
+                            if (indices[block]) {
+                                uint32_t index;
+                                std::memcpy(&index, &values[i], sizeof(index));
+                                append(index);
+                            } else {
+                                append(values[i]);
+                            }
+                            buffer += "  ";
+                            if (buffer.size() > (1 << 20)) flush();
+                        }
+                    }, 1 << 18);
+                    buffer += '\n';
                 }
-                std::cout << std::endl;
-                std::cout << "    biases:     ";
-                for (size_t v = 0; v < neural_network.layers[i].biases.size(); v++) {
-                    std::cout << neural_network.layers[i].biases[v] << "  ";
+                if (block % 2 == 1 || block >= layers * 2) buffer += '\n';
+            }
+            flush();
+            out.flush();
+        }
+        void save_network(char* location, const NeuralNetwork::network& neural_network) {
+            std::vector<uint32_t> config_data;
+            std::vector<const std::vector<float>*> blocks;
+            std::vector<std::vector<float>> index_blocks;
+            if (!collect_blocks(neural_network, config_data, blocks, index_blocks, "save_network")) return;
+            std::vector<uint32_t> block_sizes;
+            for (const std::vector<float>* block : blocks) block_sizes.push_back(static_cast<uint32_t>(block->size() * sizeof(float)));
+
+            // The whole file is written in one pass to a temporary file, which then replaces the old file in one rename
+            temporary_file temporary(location);
+            {
+                std::ofstream file(temporary.path, std::ios::binary | std::ios::trunc);
+                if (!file.is_open()) {std::cerr << "save_network: cannot create \"" << temporary.path << "\"\n";return;}
+
+                uint32_t version = 2;
+                uint32_t block_count = static_cast<uint32_t>(blocks.size());
+                uint32_t config_size = static_cast<uint32_t>(config_data.size());
+                file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+                file.write(reinterpret_cast<const char*>(&block_count), sizeof(block_count));
+                file.write(reinterpret_cast<const char*>(block_sizes.data()), static_cast<std::streamsize>(block_sizes.size() * sizeof(uint32_t)));
+                file.write(reinterpret_cast<const char*>(&config_size), sizeof(config_size));
+                file.write(reinterpret_cast<const char*>(config_data.data()), static_cast<std::streamsize>(config_data.size() * sizeof(uint32_t)));
+                for (const std::vector<float>* block : blocks) {
+                    file.write(reinterpret_cast<const char*>(block->data()), static_cast<std::streamsize>(block->size() * sizeof(float)));
                 }
-                std::cout << std::endl << std::endl;
+                file.flush();
+                if (!file) {std::cerr << "save_network: error writing \"" << temporary.path << "\"\n";return;}
             }
+            temporary.replace(location, "save_network");
         }
-        void save_network(char* location, NeuralNetwork::network neural_network) {
-            if (neural_network.layers.size() < 2) {std::cerr << "save_network: provided network is too small\n";return;}
-            new_bin(location);
-            size_t block = 0;
-            for (size_t i = 0; i < neural_network.layers.size(); i++) {
-                if (neural_network.layers[i].biases.size() == 0) {std::cerr << "save_network: layer " << i << "'s # of weights is 0\n";return;}
-                write_block(location, block, neural_network.layers[i].weights);
-                block++;
-                if (neural_network.layers[i].weights.size() == 0) {std::cerr << "save_network: layer " << i << "'s # of biases is 0\n";return;}
-                write_block(location, block, neural_network.layers[i].biases);
-                block++;
+        void append_network(char* location, const NeuralNetwork::network& neural_network) {
+            std::vector<uint32_t> config_data;
+            std::vector<const std::vector<float>*> blocks;
+            std::vector<std::vector<float>> index_blocks;
+            if (!collect_blocks(neural_network, config_data, blocks, index_blocks, "append_network")) return;
+
+            // Nothing to append to yet
+            std::error_code ec;
+            if (!std::filesystem::exists(location, ec)) {
+                save_network(location, neural_network);
+                return;
+            }
+            std::fstream file(location, std::ios::in | std::ios::out | std::ios::binary);
+            if (!file.is_open()) {std::cerr << "append_network: failed to open \"" << location << "\".\n";return;}
+            NeuralNetwork::file_metadata metadata = read_metadata(file);
+            if (metadata.version < 2) {
+                file.close();
+                save_network(location, neural_network);
+                return;
+            }
+
+            std::vector<uint64_t> hashes(blocks.size());
+            parallel_for(blocks.size(), 1, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) hashes[i] = hash_bytes(hash_seed, reinterpret_cast<const char*>(blocks[i]->data()), blocks[i]->size() * sizeof(float));
+            });
+
+            // v2 files don't store hashes, so the first append hashes the old blocks it could reuse straight from the file
+            std::vector<uint64_t> old_hashes = metadata.block_hashes;
+            if (old_hashes.empty()) {
+                old_hashes.resize(metadata.blocks);
+                for (uint32_t i = 0; i < metadata.blocks && i < blocks.size(); i++) {
+                    if (metadata.block_sizes[i] != blocks[i]->size() * sizeof(float)) continue;
+                    uint64_t hash = hash_seed;
+                    bool read = stream_block(file, block_offset(metadata, i), metadata.block_sizes[i] / sizeof(float), [&](const float* values, size_t size) {
+                        hash = hash_bytes(hash, reinterpret_cast<const char*>(values), size * sizeof(float));
+                    }, 1 << 16);
+                    if (!read) return;
+                    old_hashes[i] = hash;
+                }
+            }
+
+            // Anything past the live data is an unfinished append, it gets overwritten
+            uint64_t end = metadata.end;
+            if (std::filesystem::file_size(location, ec) > end) {
+                std::filesystem::resize_file(location, end, ec);
+                if (ec) {std::cerr << "append_network: resize_file failed: " << ec.message() << "\n";return;}
+            }
+
+            // Unchanged blocks keep pointing at their old copy, changed ones are written after the live data
+            std::vector<uint32_t> block_sizes(blocks.size());
+            std::vector<uint64_t> block_offsets(blocks.size());
+            file.clear();
+            file.seekp(static_cast<std::streamoff>(end), std::ios::beg);
+            for (size_t i = 0; i < blocks.size(); i++) {
+                block_sizes[i] = static_cast<uint32_t>(blocks[i]->size() * sizeof(float));
+                if (i < metadata.blocks && metadata.block_sizes[i] == block_sizes[i] && old_hashes[i] == hashes[i]) {
+                    block_offsets[i] = block_offset(metadata, static_cast<uint32_t>(i));
+                } else {
+                    block_offsets[i] = end;
+                    file.write(reinterpret_cast<const char*>(blocks[i]->data()), block_sizes[i]);
+                    end += block_sizes[i];
+                }
+            }
+
+            // New index, then the trailer pointing at it
+            std::vector<char> index;
+            auto put = [&index](const void* data, size_t bytes) {index.insert(index.end(), static_cast<const char*>(data), static_cast<const char*>(data) + bytes);};
+            uint32_t block_count = static_cast<uint32_t>(blocks.size());
+            uint32_t config_size = static_cast<uint32_t>(config_data.size());
+            put(&block_count, sizeof(block_count));
+            put(block_sizes.data(), block_sizes.size() * sizeof(uint32_t));
+            put(&config_size, sizeof(config_size));
+            put(config_data.data(), config_data.size() * sizeof(uint32_t));
+            put(block_offsets.data(), block_offsets.size() * sizeof(uint64_t));
+            put(hashes.data(), hashes.size() * sizeof(uint64_t));
+            uint64_t trailer[3] = {end, index.size(), hash_bytes(hash_seed, index.data(), index.size())};
+            file.write(index.data(), static_cast<std::streamsize>(index.size()));
+            file.write(reinterpret_cast<const char*>(trailer), sizeof(trailer));
+            file.write(reinterpret_cast<const char*>(&log_magic), sizeof(log_magic));
+            file.flush();
+            if (!file) {std::cerr << "append_network: error writing \"" << location << "\"\n";return;}
+            if (!sync_file(location)) {std::cerr << "append_network: failed to flush \"" << location << "\" to disk\n";return;}
+
+            // A v2 file only turns append-only once its first segment is on disk, so a crash before this leaves the old file readable
+            if (metadata.version == 2) {
+                uint32_t version = 3;
+                file.seekp(0, std::ios::beg);
+                file.write(reinterpret_cast<const char*>(&version), sizeof(version));
+                file.flush();
+                if (!file || !sync_file(location)) {std::cerr << "append_network: error marking \"" << location << "\" append-only\n";return;}
+            }
+        }
+        void compact_network(char* location) {
+            temporary_file temporary(location);
+            {
+                std::fstream file(location, std::ios::in | std::ios::binary);
+                if (!file.is_open()) {std::cerr << "compact_network: failed to open \"" << location << "\".\n";return;}
+                NeuralNetwork::file_metadata metadata = read_metadata(file);
+                if (metadata.version != 3) return; // Already compact
+
+                std::ofstream compacted(temporary.path, std::ios::binary | std::ios::trunc);
+                if (!compacted.is_open()) {std::cerr << "compact_network: cannot create \"" << temporary.path << "\"\n";return;}
+                uint32_t version = 2;
+                compacted.write(reinterpret_cast<const char*>(&version), sizeof(version));
+                compacted.write(reinterpret_cast<const char*>(&metadata.blocks), sizeof(metadata.blocks));
+                compacted.write(reinterpret_cast<const char*>(metadata.block_sizes.data()), static_cast<std::streamsize>(metadata.block_sizes.size() * sizeof(uint32_t)));
+                compacted.write(reinterpret_cast<const char*>(&metadata.config_size), sizeof(metadata.config_size));
+                compacted.write(reinterpret_cast<const char*>(metadata.config_data.data()), static_cast<std::streamsize>(metadata.config_data.size() * sizeof(uint32_t)));
+
+                // Live blocks are copied across in chunks, stale ones are left behind
+                for (uint32_t block = 0; block < metadata.blocks; block++) {
+                    bool read = stream_block(file, block_offset(metadata, block), metadata.block_sizes[block] / sizeof(float), [&](const float* values, size_t size) {
+                        compacted.write(reinterpret_cast<const char*>(values), static_cast<std::streamsize>(size * sizeof(float)));
+                    }, 1 << 16);
+                    if (!read) return;
+                }
+                compacted.flush();
+                if (!compacted) {std::cerr << "compact_network: error writing \"" << temporary.path << "\"\n";return;}
+            }
+            temporary.replace(location, "compact_network");
+        }
+        void diff_network(char* old_location, char* new_location, char* delta_location) {
+            std::fstream old_file(old_location, std::ios::in | std::ios::binary);
+            if (!old_file.is_open()) {std::cerr << "diff_network: failed to open \"" << old_location << "\".\n";return;}
+            std::fstream new_file(new_location, std::ios::in | std::ios::binary);
+            if (!new_file.is_open()) {std::cerr << "diff_network: failed to open \"" << new_location << "\".\n";return;}
+            NeuralNetwork::file_metadata old_metadata = read_metadata(old_file);
+            NeuralNetwork::file_metadata new_metadata = read_metadata(new_file);
+            old_file.close();
+            new_file.close();
+            if (old_metadata.version == 0 || new_metadata.version == 0) {std::cerr << "diff_network: couldn't read the files' metadata\n";return;}
+            for (uint32_t size : new_metadata.block_sizes) {
+                if (size % sizeof(uint32_t) != 0) {std::cerr << "diff_network: block size not aligned with type\n";return;}
+            }
+
+            // Each block is diffed against the old block with the same number, every thread reads through its own streams
+            std::vector<uint32_t> modes(new_metadata.blocks, delta_full);
+            std::vector<uint64_t> base_hashes(new_metadata.blocks, 0);
+            std::vector<std::vector<uint8_t>> payloads(new_metadata.blocks);
+            std::atomic<bool> failed{false};
+            parallel_for(new_metadata.blocks, 1, [&](size_t begin, size_t end) {
+                std::fstream old_blocks(old_location, std::ios::in | std::ios::binary);
+                std::fstream new_blocks(new_location, std::ios::in | std::ios::binary);
+                std::vector<uint32_t> old_words, new_words;
+                for (size_t i = begin; i < end && !failed; i++) {
+                    uint32_t block = static_cast<uint32_t>(i);
+                    if (!read_words(new_blocks, new_metadata, block, new_words)) {failed = true;break;}
+                    if (block >= old_metadata.blocks || old_metadata.block_sizes[block] != new_metadata.block_sizes[block]) {
+                        payloads[i] = encode_delta(nullptr, new_words.data(), new_words.size());
+                        continue;
+                    }
+                    if (!read_words(old_blocks, old_metadata, block, old_words)) {failed = true;break;}
+                    base_hashes[i] = hash_bytes(hash_seed, reinterpret_cast<const char*>(old_words.data()), old_words.size() * sizeof(uint32_t));
+                    if (old_words == new_words) {
+                        modes[i] = delta_unchanged;
+                    } else {
+                        modes[i] = delta_xor;
+                        payloads[i] = encode_delta(old_words.data(), new_words.data(), new_words.size());
+                    }
+                }
+            });
+            if (failed) {std::cerr << "diff_network: error reading block data\n";return;}
+
+            // Header, new metadata, one entry per block (mode, base hash, payload size), then the payloads back to back
+            temporary_file temporary(delta_location);
+            {
+                std::ofstream delta(temporary.path, std::ios::binary | std::ios::trunc);
+                if (!delta.is_open()) {std::cerr << "diff_network: cannot create \"" << temporary.path << "\"\n";return;}
+                uint32_t header[2] = {delta_magic, 1};
+                delta.write(reinterpret_cast<const char*>(header), sizeof(header));
+                delta.write(reinterpret_cast<const char*>(&new_metadata.blocks), sizeof(new_metadata.blocks));
+                delta.write(reinterpret_cast<const char*>(new_metadata.block_sizes.data()), static_cast<std::streamsize>(new_metadata.block_sizes.size() * sizeof(uint32_t)));
+                delta.write(reinterpret_cast<const char*>(&new_metadata.config_size), sizeof(new_metadata.config_size));
+                delta.write(reinterpret_cast<const char*>(new_metadata.config_data.data()), static_cast<std::streamsize>(new_metadata.config_data.size() * sizeof(uint32_t)));
+                for (uint32_t block = 0; block < new_metadata.blocks; block++) {
+                    uint64_t payload_size = payloads[block].size();
+                    delta.write(reinterpret_cast<const char*>(&modes[block]), sizeof(uint32_t));
+                    delta.write(reinterpret_cast<const char*>(&base_hashes[block]), sizeof(uint64_t));
+                    delta.write(reinterpret_cast<const char*>(&payload_size), sizeof(payload_size));
+                }
+                for (const std::vector<uint8_t>& payload : payloads) delta.write(reinterpret_cast<const char*>(payload.data()), static_cast<std::streamsize>(payload.size()));
+                delta.flush();
+                if (!delta) {std::cerr << "diff_network: error writing \"" << temporary.path << "\"\n";return;}
+            }
+            temporary.replace(delta_location, "diff_network");
+        }
+        void patch_network(char* location, char* delta_location, char* out_location) {
+            std::fstream delta(delta_location, std::ios::in | std::ios::binary);
+            if (!delta.is_open()) {std::cerr << "patch_network: failed to open \"" << delta_location << "\".\n";return;}
+            uint32_t header[2];
+            delta.read(reinterpret_cast<char*>(header), sizeof(header));
+            if (!delta || header[0] != delta_magic || header[1] != 1) {std::cerr << "patch_network: \"" << delta_location << "\" isn't a delta file\n";return;}
+
+            // The new file's metadata
+            NeuralNetwork::file_metadata metadata;
+            metadata.version = 2;
+            delta.read(reinterpret_cast<char*>(&metadata.blocks), sizeof(metadata.blocks));
+            if (!delta) {std::cerr << "patch_network: error reading the delta's metadata\n";return;}
+            metadata.block_sizes.resize(metadata.blocks);
+            delta.read(reinterpret_cast<char*>(metadata.block_sizes.data()), static_cast<std::streamsize>(metadata.blocks * sizeof(uint32_t)));
+            delta.read(reinterpret_cast<char*>(&metadata.config_size), sizeof(metadata.config_size));
+            if (!delta) {std::cerr << "patch_network: error reading the delta's metadata\n";return;}
+            metadata.config_data.resize(metadata.config_size);
+            delta.read(reinterpret_cast<char*>(metadata.config_data.data()), static_cast<std::streamsize>(metadata.config_size * sizeof(uint32_t)));
+
+            std::vector<uint32_t> modes(metadata.blocks);
+            std::vector<uint64_t> base_hashes(metadata.blocks), payload_offsets(metadata.blocks), payload_sizes(metadata.blocks);
+            for (uint32_t block = 0; block < metadata.blocks; block++) {
+                delta.read(reinterpret_cast<char*>(&modes[block]), sizeof(uint32_t));
+                delta.read(reinterpret_cast<char*>(&base_hashes[block]), sizeof(uint64_t));
+                delta.read(reinterpret_cast<char*>(&payload_sizes[block]), sizeof(uint64_t));
+            }
+            if (!delta) {std::cerr << "patch_network: error reading the delta's block table\n";return;}
+            uint64_t offset = static_cast<uint64_t>(delta.tellg());
+            for (uint32_t block = 0; block < metadata.blocks; block++) {
+                payload_offsets[block] = offset;
+                offset += payload_sizes[block];
+            }
+            delta.close();
+
+            std::fstream old_file(location, std::ios::in | std::ios::binary);
+            if (!old_file.is_open()) {std::cerr << "patch_network: failed to open \"" << location << "\".\n";return;}
+            NeuralNetwork::file_metadata old_metadata = read_metadata(old_file);
+            old_file.close();
+            if (old_metadata.version == 0) {std::cerr << "patch_network: couldn't read \"" << location << "\"'s metadata\n";return;}
+            for (uint32_t block = 0; block < metadata.blocks; block++) {
+                if (modes[block] > delta_full || metadata.block_sizes[block] % sizeof(uint32_t) != 0) {std::cerr << "patch_network: block " << block << " of the delta is invalid\n";return;}
+                if (modes[block] != delta_full && (block >= old_metadata.blocks || old_metadata.block_sizes[block] != metadata.block_sizes[block])) {std::cerr << "patch_network: \"" << location << "\" isn't the file the delta was made from\n";return;}
             }
+
+            // Blocks are rebuilt in parallel, each base block's hash has to match the one the delta was made against
+            std::vector<std::vector<uint32_t>> blocks(metadata.blocks);
+            std::atomic<bool> failed{false}, mismatched{false};
+            parallel_for(metadata.blocks, 1, [&](size_t begin, size_t end) {
+                std::fstream old_blocks(location, std::ios::in | std::ios::binary);
+                std::fstream payloads(delta_location, std::ios::in | std::ios::binary);
+                std::vector<uint32_t> old_words;
+                std::vector<uint8_t> payload;
+                for (size_t i = begin; i < end && !failed && !mismatched; i++) {
+                    uint32_t block = static_cast<uint32_t>(i);
+                    if (modes[i] != delta_full) {
+                        if (!read_words(old_blocks, old_metadata, block, old_words)) {failed = true;break;}
+                        if (hash_bytes(hash_seed, reinterpret_cast<const char*>(old_words.data()), old_words.size() * sizeof(uint32_t)) != base_hashes[i]) {mismatched = true;break;}
+                    }
+                    if (modes[i] == delta_unchanged) {
+                        blocks[i] = std::move(old_words);
+                        old_words.clear();
+                        continue;
+                    }
+                    payload.resize(payload_sizes[i]);
+                    payloads.clear();
+                    payloads.seekg(static_cast<std::streamoff>(payload_offsets[i]), std::ios::beg);
+                    payloads.read(reinterpret_cast<char*>(payload.data()), static_cast<std::streamsize>(payload.size()));
+                    blocks[i].resize(metadata.block_sizes[i] / sizeof(uint32_t));
+                    if (!payloads || !decode_delta(payload.data(), payload.size(), (modes[i] == delta_xor) ? old_words.data() : nullptr, blocks[i].data(), blocks[i].size())) {failed = true;break;}
+                }
+            });
+            if (mismatched) {std::cerr << "patch_network: \"" << location << "\" isn't the file the delta was made from\n";return;}
+            if (failed) {std::cerr << "patch_network: error rebuilding blocks from \"" << delta_location << "\"\n";return;}
+
+            // The patched file is always a plain v2 file
+            temporary_file temporary(out_location);
+            {
+                std::ofstream file(temporary.path, std::ios::binary | std::ios::trunc);
+                if (!file.is_open()) {std::cerr << "patch_network: cannot create \"" << temporary.path << "\"\n";return;}
+                file.write(reinterpret_cast<const char*>(&metadata.version), sizeof(metadata.version));
+                file.write(reinterpret_cast<const char*>(&metadata.blocks), sizeof(metadata.blocks));
+                file.write(reinterpret_cast<const char*>(metadata.block_sizes.data()), static_cast<std::streamsize>(metadata.block_sizes.size() * sizeof(uint32_t)));
+                file.write(reinterpret_cast<const char*>(&metadata.config_size), sizeof(metadata.config_size));
+                file.write(reinterpret_cast<const char*>(metadata.config_data.data()), static_cast<std::streamsize>(metadata.config_data.size() * sizeof(uint32_t)));
+                for (const std::vector<uint32_t>& block : blocks) file.write(reinterpret_cast<const char*>(block.data()), static_cast<std::streamsize>(block.size() * sizeof(uint32_t)));
+                file.flush();
+                if (!file) {std::cerr << "patch_network: error writing \"" << temporary.path << "\"\n";return;}
+            }
+            temporary.replace(out_location, "patch_network");
         }
-        network load_network(char* location) {
+        network load_network(char* location, bool prepack) {
             std::fstream file(location, std::ios::in | std::ios::binary);
+            if (!file.is_open()) {std::cerr << "load_network: failed to open \"" << location << "\".\n";return NeuralNetwork::network{};}
+            // Every block is read against this one index, so an append racing the load can't mix blocks from two versions
             NeuralNetwork::file_metadata file_metadata = read_metadata(file);
+            if (file_metadata.config_size == 0) {std::cerr << "load_network: \"" << location << "\" has no input size in its config data\n";return NeuralNetwork::network{};}
+
             NeuralNetwork::network new_network;
+            new_network.config_data = file_metadata.config_data;
+
+            // v1 files only hold layer blocks, later files may hold extra blocks after them
+            std::vector<uint32_t> layer_activations = read_config_record(new_network.config_data, config_activations);
+            new_network.layers.resize(layer_activations.empty() ? file_metadata.blocks / 2 : layer_activations.size());
+            if (new_network.layers.size() * 2 > file_metadata.blocks) {std::cerr << "load_network: activations record does not match the amount of layers\n";return NeuralNetwork::network{};}
+            std::vector<uint32_t> packed = read_config_record(new_network.config_data, config_packed);
+            if (!packed.empty() && packed.size() != new_network.layers.size() * 3) {std::cerr << "load_network: packed record does not match the amount of layers\n";return NeuralNetwork::network{};}
+            std::vector<uint32_t> sparse = read_config_record(new_network.config_data, config_sparse);
+            if (!sparse.empty() && sparse.size() != new_network.layers.size() * 2) {std::cerr << "load_network: sparse record does not match the amount of layers\n";return NeuralNetwork::network{};}
+            std::vector<uint32_t> convolutions = read_config_record(new_network.config_data, config_convolution);
+            if (!convolutions.empty() && convolutions.size() != new_network.layers.size() * 9) {std::cerr << "load_network: convolution record does not match the amount of layers\n";return NeuralNetwork::network{};}
+            std::vector<uint32_t> embeddings = read_config_record(new_network.config_data, config_embedding);
+            if (!embeddings.empty() && embeddings.size() != new_network.layers.size() * 4) {std::cerr << "load_network: embedding record does not match the amount of layers\n";return NeuralNetwork::network{};}
 
             size_t pointer = 0;
+            uint32_t input_size = file_metadata.config_data[0];
             // Loop through layers
-            for (size_t layer = 0; layer < (file_metadata.blocks/2); layer++) {
-                new_network.layers[layer].biases = read_block(location, pointer);
+            for (size_t layer = 0; layer < new_network.layers.size(); layer++) {
+                new_network.layers[layer].biases = ::read_block(file, file_metadata, pointer);
                 pointer++;
-                new_network.layers[layer].weights = read_block(location, pointer);
+                new_network.layers[layer].weights = ::read_block(file, file_metadata, pointer);
                 pointer++;
+
+                // Each layer takes the previous layer's outputs as its inputs
+                new_network.layers[layer].input_size = input_size;
+                new_network.layers[layer].output_size = static_cast<uint32_t>(new_network.layers[layer].biases.size());
+                if (!convolutions.empty() && convolutions[layer * 9] != 0) {
+                    NeuralNetwork::layer& current = new_network.layers[layer];
+                    const uint32_t* record = &convolutions[layer * 9];
+                    if (record[0] > static_cast<uint32_t>(NeuralNetwork::layer_type::conv2d)) {std::cerr << "load_network: layer " << layer << " has an unknown type\n";return NeuralNetwork::network{};}
+                    current.type = static_cast<NeuralNetwork::layer_type>(record[0]);
+                    current.shape = {record[1], record[2], record[3], record[4], record[5], record[6], record[7], record[8]};
+
+                    // Validate the shape against the previous layer and the blocks so convolutions never index out of bounds
+                    bool valid = valid_convolution(current.shape, current.type) && (uint64_t)current.shape.channels * current.shape.height * current.shape.width == input_size;
+                    valid = valid && current.biases.size() == current.shape.filters && (sparse.empty() || sparse[layer * 2] == UINT32_MAX);
+                    uint64_t outputs = valid ? (uint64_t)current.shape.filters * convolution_height(current.shape, current.type) * convolution_width(current.shape) : 0;
+                    if (!valid || outputs > UINT32_MAX || current.weights.size() != gemm_rows(current) * gemm_depth(current)) {std::cerr << "load_network: layer " << layer << "'s convolution shape is invalid\n";return NeuralNetwork::network{};}
+                    current.output_size = static_cast<uint32_t>(outputs);
+                }
+                if (!embeddings.empty() && embeddings[layer * 4] != 0) {
+                    NeuralNetwork::layer& current = new_network.layers[layer];
+                    const uint32_t* record = &embeddings[layer * 4];
+                    current.type = NeuralNetwork::layer_type::embedding;
+                    current.lookup = {record[0], record[1], record[2], record[3]};
+
+                    // Ids are raw inputs, so an embedding can only be the first layer
+                    uint64_t outputs = (uint64_t)record[2] * record[1] + record[3];
+                    bool valid = layer == 0 && record[0] <= embedding_categories && record[1] > 0 && (uint64_t)record[2] + record[3] == input_size && outputs <= UINT32_MAX && current.biases.size() == record[1];
+                    if (!valid || current.weights.size() != (size_t)record[0] * record[1] || (!sparse.empty() && sparse[layer * 2] != UINT32_MAX)) {std::cerr << "load_network: layer " << layer << "'s embedding shape is invalid\n";return NeuralNetwork::network{};}
+                    current.output_size = static_cast<uint32_t>(outputs);
+                }
+                if (!layer_activations.empty()) {
+                    if (layer_activations[layer] > static_cast<uint32_t>(NeuralNetwork::activation_type::softmax)) {std::cerr << "load_network: layer " << layer << " has an unknown activation\n";return NeuralNetwork::network{};}
+                    new_network.layers[layer].activation = static_cast<NeuralNetwork::activation_type>(layer_activations[layer]);
+                }
+                if (!sparse.empty() && sparse[layer * 2] != UINT32_MAX) {
+                    NeuralNetwork::layer& current = new_network.layers[layer];
+                    current.sparse_values = std::move(current.weights);
+                    current.weights.clear();
+                    current.sparse_rows = index_block(::read_block(file, file_metadata, sparse[layer * 2]));
+                    current.sparse_columns = index_block(::read_block(file, file_metadata, sparse[layer * 2 + 1]));
+
+                    // Validate the rows and columns so forward passes never index out of bounds
+                    bool valid = current.sparse_rows.size() == (size_t)current.output_size + 1 && current.sparse_rows[0] == 0 && current.sparse_rows.back() == current.sparse_values.size() && current.sparse_columns.size() == current.sparse_values.size();
+                    for (size_t j = 0; valid && j < current.output_size; j++) valid = current.sparse_rows[j] <= current.sparse_rows[j + 1];
+                    for (size_t p = 0; valid && p < current.sparse_columns.size(); p++) valid = current.sparse_columns[p] < input_size;
+                    if (!valid) {std::cerr << "load_network: layer " << layer << "'s sparse rows are invalid\n";return NeuralNetwork::network{};}
+                } else if (new_network.layers[layer].weights.size() != gemm_rows(new_network.layers[layer]) * gemm_depth(new_network.layers[layer])) {
+                    std::cerr << "load_network: layer " << layer << "'s weights do not match its input and output sizes\n";
+                    return NeuralNetwork::network{};
+                }
+                input_size = new_network.layers[layer].output_size;
+
+                // Use the cached packed layout if there is one
+                if (!packed.empty() && packed[layer * 3] != UINT32_MAX) {
+                    NeuralNetwork::layer& current = new_network.layers[layer];
+                    size_t panel_width = packed[layer * 3 + 1];
+                    size_t packed_size = (gemm_rows(current) + panel_width - 1) / panel_width * panel_width * gemm_depth(current);
+                    std::vector<float> cached = ::read_block(file, file_metadata, packed[layer * 3]);
+                    if ((panel_width == 4 || panel_width == 8 || panel_width == 16) && packed[layer * 3 + 2] > 0 && cached.size() == packed_size) {
+                        current.packed = std::move(cached);
+                        current.panel_width = packed[layer * 3 + 1];
+                        current.k_block = packed[layer * 3 + 2];
+                    } else {
+                        std::cerr << "load_network: layer " << layer << "'s cached packed layout is invalid, ignoring it\n";
+                    }
+                }
+            }
+
+            // Restore the optimizer exactly as it was saved
+            std::vector<uint32_t> optimizer_record = read_config_record(new_network.config_data, config_optimizer);
+            if (!optimizer_record.empty()) {
+                if (optimizer_record.size() != 8 + new_network.layers.size() * 4 || optimizer_record[0] > static_cast<uint32_t>(NeuralNetwork::optimizer_type::adamw)) {std::cerr << "load_network: optimizer record is invalid\n";return NeuralNetwork::network{};}
+                NeuralNetwork::optimizer& optimizer = new_network.optimizer;
+                optimizer.type = static_cast<NeuralNetwork::optimizer_type>(optimizer_record[0]);
+                optimizer.step = optimizer_record[1] | (static_cast<uint64_t>(optimizer_record[2]) << 32);
+                float* hyperparameters[] = {&optimizer.learning_rate, &optimizer.momentum, &optimizer.beta2, &optimizer.epsilon, &optimizer.weight_decay};
+                for (size_t i = 0; i < 5; i++) std::memcpy(hyperparameters[i], &optimizer_record[3 + i], sizeof(float));
+
+                std::vector<std::vector<float>>* moments[] = {&optimizer.weight_moments, &optimizer.bias_moments, &optimizer.weight_variances, &optimizer.bias_variances};
+                for (size_t m = 0; m < 4; m++) {
+                    bool any = false;
+                    for (size_t l = 0; l < new_network.layers.size(); l++) any = any || optimizer_record[8 + l * 4 + m] != UINT32_MAX;
+                    if (!any) continue;
+                    moments[m]->assign(new_network.layers.size(), {});
+                    for (size_t l = 0; l < new_network.layers.size(); l++) {
+                        uint32_t moment_block = optimizer_record[8 + l * 4 + m];
+                        if (moment_block == UINT32_MAX) continue;
+                        const NeuralNetwork::layer& layer = new_network.layers[l];
+                        size_t expected_size = (m % 2 == 1) ? layer.biases.size() : (layer.sparse_rows.empty() ? layer.weights.size() : layer.sparse_values.size());
+                        (*moments[m])[l] = ::read_block(file, file_metadata, moment_block);
+                        if ((*moments[m])[l].size() != expected_size) {std::cerr << "load_network: layer " << l << "'s optimizer moments do not match its weights\n";return NeuralNetwork::network{};}
+                    }
+                }
+            }
+
+            // Apply a tuning plan, layers that still have a cached packed layout keep it
+            std::vector<uint32_t> tuning = read_config_record(new_network.config_data, config_tuning);
+            if (!tuning.empty() && tuning.size() != new_network.layers.size() * 3) {
+                std::cerr << "load_network: tuning record does not match the amount of layers, ignoring it\n";
+            } else {
+                for (size_t l = 0; l < tuning.size() / 3; l++) {
+                    NeuralNetwork::layer& layer = new_network.layers[l];
+                    uint32_t panel_width = tuning[l * 3], k_block = tuning[l * 3 + 1];
+                    layer.threads = std::max<uint32_t>(tuning[l * 3 + 2], 1);
+                    if (panel_width == 0 || !layer.packed.empty() || !layer.sparse_rows.empty() || layer.type == NeuralNetwork::layer_type::embedding) continue;
+                    if ((panel_width != 4 && panel_width != 8 && panel_width != 16) || k_block == 0) {std::cerr << "load_network: layer " << l << "'s tuning plan is invalid, ignoring it\n";continue;}
+                    pack_layer(layer, panel_width, k_block);
+                }
             }
+
+            // A plan already chose which layers are faster packed
+            if (prepack && tuning.empty()) prepack_network(new_network);
             return new_network;
         }
-        output forward_pass(NeuralNetwork::network neural_network, std::vector<float> inputs) {
-            if (neural_network.layers.empty()) {
-                std::cerr << "forward_pass: network has no layers\n";
-                return NeuralNetwork::output{};
+        void pack_layer(NeuralNetwork::layer& layer, uint32_t panel_width, uint32_t k_block) {
+            if (panel_width != 4 && panel_width != 8 && panel_width != 16) {std::cerr << "pack_layer: panel width must be 4, 8 or 16\n";return;}
+            if (k_block == 0) {std::cerr << "pack_layer: k block must be above zero\n";return;}
+            if (layer.type == NeuralNetwork::layer_type::embedding) {std::cerr << "pack_layer: embedding tables are gathered, not multiplied, so they aren't packed\n";return;}
+            size_t rows = gemm_rows(layer);
+            size_t depth = gemm_depth(layer);
+            if (layer.weights.size() != rows * depth) {std::cerr << "pack_layer: layer's weights do not match its sizes\n";return;}
+
+            // Layout: for each K block, for each panel of panel_width outputs, for each input in the block, panel_width weights
+            size_t panels = (rows + panel_width - 1) / panel_width;
+            layer.packed.assign(panels * panel_width * depth, 0.0f); // Rows past the last output stay zero
+            size_t i = 0;
+            for (size_t k = 0; k < depth; k += k_block) {
+                size_t length = std::min<size_t>(k_block, depth - k);
+                for (size_t p = 0; p < panels; p++) {
+                    for (size_t kk = 0; kk < length; kk++) {
+                        for (size_t r = 0; r < panel_width; r++, i++) {
+                            size_t row = p * panel_width + r;
+                            if (row < rows) layer.packed[i] = layer.weights[row * depth + k + kk];
+                        }
+                    }
+                }
             }
-            if (inputs.size() != neural_network.layers[0].input_size) {
-                std::cerr << "forward_pass: inputs do not match that of the provided neural network\n";
-                return NeuralNetwork::output{};
+            layer.panel_width = panel_width;
+            layer.k_block = k_block;
+        }
+        void prepack_network(NeuralNetwork::network& neural_network) {
+            // Size each panel's K block to fill half of L1, leaving the rest for the inputs and outputs
+            const uint32_t panel_width = 8;
+            size_t k_block = cache_size(1) / (2 * panel_width * sizeof(float));
+            k_block = std::max<size_t>(64, k_block - k_block % 8);
+            for (NeuralNetwork::layer& layer : neural_network.layers) {
+                if (layer.packed.empty() && layer.sparse_rows.empty() && layer.type != NeuralNetwork::layer_type::embedding) pack_layer(layer, panel_width, static_cast<uint32_t>(k_block));
             }
+        }
+        std::vector<NeuralNetwork::layer_plan> tune_network(NeuralNetwork::network& neural_network, double seconds_per_candidate) {
+            std::vector<NeuralNetwork::layer_plan> plans(neural_network.layers.size());
+            std::vector<uint32_t> record;
+            double seconds = std::max(seconds_per_candidate, 1e-4) / 3;
+            uint32_t max_threads = thread_count();
 
-            // Initialize the forward pass's outputs
-            NeuralNetwork::output fp_output;
+            for (size_t l = 0; l < neural_network.layers.size(); l++) {
+                NeuralNetwork::layer& layer = neural_network.layers[l];
+                NeuralNetwork::layer_plan& plan = plans[l];
 
-            // Starting activations are just the inputs
-            fp_output.outputs = inputs;
+                // Embeddings are gathered and sparse layers have their own kernel, they keep their defaults
+                bool tunable = layer.type != NeuralNetwork::layer_type::embedding && layer.sparse_rows.empty() && layer.weights.size() == gemm_rows(layer) * gemm_depth(layer);
+                if (!tunable) {
+                    plan.panel_width = layer.panel_width;
+                    plan.k_block = layer.k_block;
+                    plan.threads = layer.threads;
+                    record.insert(record.end(), {plan.panel_width, plan.k_block, plan.threads});
+                    continue;
+                }
 
-            // Loop through the layers
-            for (size_t i = 0; i < neural_network.layers.size(); i++) {
-                NeuralNetwork::layer layer = neural_network.layers[i];
+                // Forward passes multiply one sample's inputs, convolutions one im2col row per output position
+                size_t depth = gemm_depth(layer);
+                size_t count = layer.type == NeuralNetwork::layer_type::dense ? 1 : layer.output_size / layer.shape.filters;
+                std::vector<float> inputs(count * depth), outputs(count * gemm_rows(layer));
+                for (size_t i = 0; i < inputs.size(); i++) inputs[i] = static_cast<float>(i % 17) / 8.0f - 1.0f;
+                plan.baseline = time_gemm(layer, inputs.data(), count, outputs.data(), seconds);
 
-                // Allocate space for output activations of this layer
-                std::vector<float> next_activations(layer.output_size, 0.0f);
+                // Tiles first, on one thread
+                std::vector<uint32_t> k_blocks;
+                for (size_t k_block : {size_t(64), size_t(128), size_t(256), size_t(512), size_t(1024), cache_size(1) / (2 * 8 * sizeof(float)), depth}) {
+                    if (k_block > 0 && k_block <= depth && std::find(k_blocks.begin(), k_blocks.end(), k_block) == k_blocks.end()) k_blocks.push_back(static_cast<uint32_t>(k_block));
+                }
+                layer.threads = 1;
+                std::vector<float>().swap(layer.packed);
+                layer.panel_width = 0;
+                layer.k_block = 0;
+                plan.panel_width = 0;
+                plan.k_block = 0;
+                plan.seconds = time_gemm(layer, inputs.data(), count, outputs.data(), seconds);
+                for (uint32_t panel_width : {4u, 8u, 16u}) {
+                    for (uint32_t k_block : k_blocks) {
+                        pack_layer(layer, panel_width, k_block);
+                        double taken = time_gemm(layer, inputs.data(), count, outputs.data(), seconds);
+                        if (taken < plan.seconds) {
+                            plan.seconds = taken;
+                            plan.panel_width = panel_width;
+                            plan.k_block = k_block;
+                        }
+                    }
+                }
+                if (plan.panel_width == 0) {
+                    std::vector<float>().swap(layer.packed);
+                    layer.panel_width = 0;
+                    layer.k_block = 0;
+                } else {
+                    pack_layer(layer, plan.panel_width, plan.k_block);
+                }
 
-                // Loop through the neurons
-                for (size_t j = 0; j < layer.output_size; j++) {
+                // Then threads, each one has to win back what starting it costs
+                for (uint32_t threads = 2; threads <= max_threads; threads = (threads * 2 > max_threads && threads < max_threads) ? max_threads : threads * 2) {
+                    layer.threads = threads;
+                    double taken = time_gemm(layer, inputs.data(), count, outputs.data(), seconds);
+                    if (taken < plan.seconds) {
+                        plan.seconds = taken;
+                        plan.threads = threads;
+                    }
+                }
+                layer.threads = plan.threads;
+                record.insert(record.end(), {plan.panel_width, plan.k_block, plan.threads});
+            }
 
-                    // Start the sum with the bias
-                    float sum = layer.biases[j];
+            if (neural_network.config_data.empty() && !neural_network.layers.empty()) neural_network.config_data.push_back(neural_network.layers[0].input_size);
+            write_config_record(neural_network.config_data, config_tuning, record);
+            return plans;
+        }
+        void sparsify_layer(NeuralNetwork::layer& layer) {
+            if (!layer.sparse_rows.empty()) return;
+            if (layer.type != NeuralNetwork::layer_type::dense) {std::cerr << "sparsify_layer: only dense layers can be sparse\n";return;}
+            if (layer.weights.size() != (size_t)layer.input_size * layer.output_size) {std::cerr << "sparsify_layer: layer's weights do not match its sizes\n";return;}
 
-                    // Add each input * their respective weight
-                    for (size_t k = 0; k < layer.input_size; k++) {
-                        sum += fp_output.outputs[k] * layer.weights[j * layer.input_size + k]; // Flat array
+            layer.sparse_rows.assign(1, 0);
+            layer.sparse_rows.reserve(layer.output_size + 1);
+            for (size_t j = 0; j < layer.output_size; j++) {
+                for (size_t k = 0; k < layer.input_size; k++) {
+                    float weight = layer.weights[j * layer.input_size + k];
+                    if (weight != 0.0f) {
+                        layer.sparse_values.push_back(weight);
+                        layer.sparse_columns.push_back(static_cast<uint32_t>(k));
                     }
-                    
-                    // Save pre-activation sum
-                    fp_output.pre_activations.push_back(sum);
+                }
+                layer.sparse_rows.push_back(static_cast<uint32_t>(layer.sparse_values.size()));
+            }
+
+            // The sparse rows replace the dense and packed weights
+            std::vector<float>().swap(layer.weights);
+            std::vector<float>().swap(layer.packed);
+            layer.panel_width = 0;
+            layer.k_block = 0;
+        }
+        void densify_layer(NeuralNetwork::layer& layer) {
+            if (layer.sparse_rows.empty()) return;
+
+            layer.weights.assign((size_t)layer.input_size * layer.output_size, 0.0f);
+            for (size_t j = 0; j < layer.output_size; j++) {
+                for (size_t p = layer.sparse_rows[j]; p < layer.sparse_rows[j + 1]; p++) {
+                    layer.weights[j * layer.input_size + layer.sparse_columns[p]] = layer.sparse_values[p];
+                }
+            }
+            std::vector<float>().swap(layer.sparse_values);
+            std::vector<uint32_t>().swap(layer.sparse_columns);
+            std::vector<uint32_t>().swap(layer.sparse_rows);
+        }
+        void prune_network(NeuralNetwork::network& neural_network, float sparsity) {
+            if (!(sparsity >= 0.0f && sparsity <= 1.0f)) {std::cerr << "prune_network: sparsity must be between 0 and 1\n";return;}
 
-                    // Activation function
-                    next_activations[j] = activation_function(sum);
+            for (NeuralNetwork::layer& layer : neural_network.layers) {
+                densify_layer(layer);
+                size_t size = layer.weights.size();
+                size_t prune = static_cast<size_t>(sparsity * static_cast<float>(size));
+                if (size == 0) continue;
 
-                    // Save activation
-                    fp_output.activations.push_back(next_activations[j]);
+                // The prune-th smallest magnitude is the threshold, ties at the threshold are pruned until the count is reached
+                if (prune > 0) {
+                    std::vector<float> magnitudes(size);
+                    for (size_t i = 0; i < size; i++) magnitudes[i] = std::fabs(layer.weights[i]);
+                    std::nth_element(magnitudes.begin(), magnitudes.begin() + (prune - 1), magnitudes.end());
+                    float threshold = magnitudes[prune - 1];
+                    size_t below = 0;
+                    for (size_t i = 0; i < size; i++) {
+                        if (std::fabs(layer.weights[i]) < threshold) {layer.weights[i] = 0.0f;below++;}
+                    }
+                    for (size_t i = 0; i < size && below < prune; i++) {
+                        if (layer.weights[i] != 0.0f && std::fabs(layer.weights[i]) == threshold) {layer.weights[i] = 0.0f;below++;}
+                    }
                 }
 
-                // These outputs become inputs for the next layer
-                fp_output.outputs = std::move(next_activations);
+                // Convolution kernels keep their zeros in place, only dense layers switch to compressed sparse rows
+                size_t non_zero = static_cast<size_t>(std::count_if(layer.weights.begin(), layer.weights.end(), [](float weight) {return weight != 0.0f;}));
+                if (layer.type == NeuralNetwork::layer_type::dense && static_cast<float>(non_zero) <= sparse_density * static_cast<float>(size)) {
+                    sparsify_layer(layer);
+                } else if (!layer.packed.empty()) {
+                    pack_layer(layer, layer.panel_width, layer.k_block); // Keep the packed copy in sync
+                }
             }
-            
-            return fp_output;
         }
-        backprop_averages backpropagate(NeuralNetwork::network neural_network, NeuralNetwork::output forward_activations, NeuralNetwork::y answers) {
-            if (neural_network.layers.empty()) {
-                std::cerr << "backpropagate: network has no layers\n";
-                return NeuralNetwork::backprop_averages{};
+        void compile_network(char* location, const NeuralNetwork::network& neural_network, const char* name) {
+            if (neural_network.layers.empty()) {std::cerr << "compile_network: network has no layers\n";return;}
+
+            // Namespace name must be a valid identifier
+            std::string identifier;
+            for (const char* c = name; *c; c++) {
+                identifier += std::isalnum(static_cast<unsigned char>(*c)) ? *c : '_';
+            }
+            if (identifier.empty() || std::isdigit(static_cast<unsigned char>(identifier[0]))) identifier.insert(0, "model_");
+
+            // Every layer is checked before anything is written, so a rejected network leaves an existing header untouched
+            std::vector<NeuralNetwork::layer> dense_layers(neural_network.layers.size());
+            for (size_t i = 0; i < neural_network.layers.size(); i++) {
+                if (!neural_network.layers[i].sparse_rows.empty()) {
+                    dense_layers[i] = neural_network.layers[i];
+                    densify_layer(dense_layers[i]);
+                }
+                const NeuralNetwork::layer& layer = neural_network.layers[i].sparse_rows.empty() ? neural_network.layers[i] : dense_layers[i];
+                if (layer.type != NeuralNetwork::layer_type::dense) {std::cerr << "compile_network: layer " << i << " isn't a dense layer, only dense layers can be compiled\n";return;}
+                if (layer.weights.size() != (size_t)layer.input_size * layer.output_size || layer.biases.size() != layer.output_size) {
+                    std::cerr << "compile_network: layer " << i << "'s weights and biases do not match its sizes\n";
+                    return;
+                }
+                const std::vector<float>& weights = layer.packed.empty() ? layer.weights : layer.packed;
+                auto finite = [](float value) {return std::isfinite(value);};
+                if (!std::all_of(weights.begin(), weights.end(), finite) || !std::all_of(layer.biases.begin(), layer.biases.end(), finite)) {
+                    std::cerr << "compile_network: layer " << i << " holds a non-finite value\n";
+                    return;
+                }
             }
 
-            NeuralNetwork::backprop_averages averages;
+            // The header is written beside the target and renamed over it, so readers never see a partial file
+            temporary_file temporary(location);
+            std::ofstream file(temporary.path, std::ios::binary | std::ios::trunc);
+            if (!file.is_open()) {std::cerr << "compile_network: cannot create \"" << temporary.path << "\"\n";return;}
 
-            // Loop through layers
-            for (size_t l = neural_network.layers.size(); l-- > 0; l--) {
-                float delta;
-                if (l == neural_network.layers.size()) {
-                    delta = 0.0f;
+            // Everything is formatted into one buffer which is flushed in large chunks
+            std::string buffer;
+            buffer.reserve(1 << 20);
+            auto flush = [&]() {
+                file.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+                buffer.clear();
+            };
+
+            // Floats are written as hex literals so the compiled weights are bit-exact
+            auto write_array = [&](const char* kind, size_t layer, const std::vector<float>& values) {
+                buffer += "    alignas(64) static constexpr float layer_" + std::to_string(layer) + "_" + kind + "[" + std::to_string(values.size()) + "] = {";
+                char number[64];
+                for (size_t i = 0; i < values.size(); i++) {
+                    if (i % 8 == 0) buffer += "\n        ";
+                    float value = values[i];
+                    if (std::signbit(value)) {buffer += '-';value = -value;}
+                    std::to_chars_result result = std::to_chars(number, number + sizeof(number), value, std::chars_format::hex);
+                    buffer += "0x";
+                    buffer.append(number, result.ptr);
+                    buffer += "f, ";
+                    if (buffer.size() > (1 << 20)) flush();
+                }
+                buffer += "\n    };\n";
+            };
+
+            const NeuralNetwork::layer& last = neural_network.layers.back();
+            buffer += "/*\n        Generated by eznet, do not edit.\n\n        Description:    A compiled neural network with its weights and layer sizes baked in\n*/\n\n";
+            buffer += "#pragma once\n\n#include <algorithm>\n#include <cmath>\n#include <cstddef>\n#include <cstdint>\n#include <cstring>\n\nnamespace " + identifier + " {\n";
+            buffer += "    constexpr std::size_t input_size = " + std::to_string(neural_network.layers[0].input_size) + ";\n";
+            buffer += "    constexpr std::size_t output_size = " + std::to_string(last.output_size) + ";\n\n";
+
+            for (size_t i = 0; i < neural_network.layers.size(); i++) {
+                const NeuralNetwork::layer& layer = neural_network.layers[i].sparse_rows.empty() ? neural_network.layers[i] : dense_layers[i];
+                write_array("biases", i, layer.biases);
+                // Packed layers keep their panel-major weights so the header sums in packed_gemm's order
+                if (layer.packed.empty()) write_array("weights", i, layer.weights);
+                else write_array("packed", i, layer.packed);
+                buffer += "\n";
+            }
+
+            // Kernels mirror the library's, dense and packed layers sum in forward_pass's order so their outputs match it bit for bit
+            // Sparse layers are compiled dense, their zeros shift which lane each product lands in so they can differ in the last bits
+            buffer += "    namespace detail {\n";
+            buffer += "        inline float dot(const float* a, const float* b, std::size_t size) {\n";
+            buffer += "            float lanes[8] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f};\n";
+            buffer += "            std::size_t k = 0;\n";
+            buffer += "            for (; k + 8 <= size; k += 8) {\n";
+            buffer += "                for (std::size_t l = 0; l < 8; l++) lanes[l] += a[k + l] * b[k + l];\n";
+            buffer += "            }\n";
+            buffer += "            for (std::size_t l = 0; k + l < size; l++) lanes[l] += a[k + l] * b[k + l];\n";
+            buffer += "            return ((lanes[0] + lanes[4]) + (lanes[1] + lanes[5])) + ((lanes[2] + lanes[6]) + (lanes[3] + lanes[7]));\n";
+            buffer += "        }\n";
+            buffer += "        template <std::size_t NR>\n";
+            buffer += "        inline void packed(const float* weights, const float* biases, std::size_t rows, std::size_t depth, std::size_t k_block, const float* inputs, float* outputs) {\n";
+            buffer += "            std::size_t panels = (rows + NR - 1) / NR;\n";
+            buffer += "            for (std::size_t j = 0; j < rows; j++) outputs[j] = biases[j];\n";
+            buffer += "            const float* block = weights;\n";
+            buffer += "            for (std::size_t k = 0; k < depth; k += k_block) {\n";
+            buffer += "                std::size_t length = std::min(k_block, depth - k);\n";
+            buffer += "                for (std::size_t p = 0; p < panels; p++) {\n";
+            buffer += "                    const float* panel = block + p * length * NR;\n";
+            buffer += "                    float acc[NR] = {};\n";
+            buffer += "                    for (std::size_t i = 0; i < length; i++) {\n";
+            buffer += "                        float x = inputs[k + i];\n";
+            buffer += "                        for (std::size_t r = 0; r < NR; r++) acc[r] += x * panel[i * NR + r];\n";
+            buffer += "                    }\n";
+            buffer += "                    for (std::size_t r = 0; r < NR && p * NR + r < rows; r++) outputs[p * NR + r] += acc[r];\n";
+            buffer += "                }\n";
+            buffer += "                block += panels * length * NR;\n";
+            buffer += "            }\n";
+            buffer += "        }\n";
+            buffer += "        inline float exp(float x) {\n";
+            buffer += "            x = std::min(std::max(x, -87.3f), 88.3f);\n";
+            buffer += "            float n = std::floor(x * 1.44269504f + 0.5f);\n";
+            buffer += "            float r = x - n * 0.693359375f + n * 2.12194440e-4f;\n";
+            buffer += "            float y = ((((((1.9875691500e-4f * r + 1.3981999507e-3f) * r + 8.3334519073e-3f) * r + 4.1665795894e-2f) * r + 1.6666665459e-1f) * r + 5.0000001201e-1f) * r * r) + r + 1.0f;\n";
+            buffer += "            std::int32_t bits = (static_cast<std::int32_t>(n) + 127) << 23;\n";
+            buffer += "            float scale;\n";
+            buffer += "            std::memcpy(&scale, &bits, sizeof(scale));\n";
+            buffer += "            return y * scale;\n";
+            buffer += "        }\n";
+            buffer += "        inline float sigmoid(float x) { return 1.0f / (1.0f + exp(-x)); }\n";
+            buffer += "        inline float tanh(float x) { return 2.0f * sigmoid(2.0f * x) - 1.0f; }\n";
+            buffer += "    }\n\n";
+
+            // The forward pass is fully unrolled over layers, so every loop bound is a constant
+            buffer += "    // Passes inputs[input_size] through the network and writes outputs[output_size].\n";
+            buffer += "    inline void forward(const float* inputs, float* outputs) {\n";
+            for (size_t i = 0; i < neural_network.layers.size(); i++) {
+                const NeuralNetwork::layer& layer = neural_network.layers[i];
+                std::string l = std::to_string(i);
+                std::string size = std::to_string(layer.output_size);
+                std::string in = (i == 0) ? "inputs" : "layer_" + std::to_string(i - 1);
+                std::string out = (i + 1 == neural_network.layers.size()) ? "outputs" : "layer_" + l;
+                if (out != "outputs") buffer += "        alignas(64) float " + out + "[" + size + "];\n";
+                if (!layer.packed.empty()) {
+                    buffer += "        detail::packed<" + std::to_string(layer.panel_width) + ">(layer_" + l + "_packed, layer_" + l + "_biases, " + size + ", " + std::to_string(layer.input_size) + ", " + std::to_string(layer.k_block) + ", " + in + ", " + out + ");\n";
                 } else {
+                    buffer += "        for (std::size_t j = 0; j < " + size + "; j++) {\n";
+                    buffer += "            " + out + "[j] = layer_" + l + "_biases[j] + detail::dot(" + in + ", &layer_" + l + "_weights[j * " + std::to_string(layer.input_size) + "], " + std::to_string(layer.input_size) + ");\n";
+                    buffer += "        }\n";
+                }
+                buffer += "        for (std::size_t j = 0; j < " + size + "; j++) {\n";
+                switch (layer.activation) {
+                    case NeuralNetwork::activation_type::relu:
+                        buffer += "            " + out + "[j] = std::max(0.0f, " + out + "[j]);\n";
+                        break;
+                    case NeuralNetwork::activation_type::leaky_relu:
+                        buffer += "            " + out + "[j] = (" + out + "[j] > 0.0f) ? " + out + "[j] : 0.01f * " + out + "[j];\n";
+                        break;
+                    case NeuralNetwork::activation_type::sigmoid:
+                        buffer += "            " + out + "[j] = detail::sigmoid(" + out + "[j]);\n";
+                        break;
+                    case NeuralNetwork::activation_type::tanh:
+                        buffer += "            " + out + "[j] = detail::tanh(" + out + "[j]);\n";
+                        break;
+                    case NeuralNetwork::activation_type::gelu:
+                        buffer += "            float x = " + out + "[j];\n";
+                        buffer += "            " + out + "[j] = 0.5f * x * (1.0f + detail::tanh(0.7978845608f * (x + 0.044715f * x * x * x)));\n";
+                        break;
+                    case NeuralNetwork::activation_type::softmax:
+                        buffer += "        }\n";
+                        buffer += "        {\n";
+                        buffer += "            float max = " + out + "[0];\n";
+                        buffer += "            for (std::size_t j = 1; j < " + size + "; j++) max = std::max(max, " + out + "[j]);\n";
+                        buffer += "            float sum = 0.0f;\n";
+                        buffer += "            for (std::size_t j = 0; j < " + size + "; j++) {\n";
+                        buffer += "                " + out + "[j] = detail::exp(" + out + "[j] - max);\n";
+                        buffer += "                sum += " + out + "[j];\n";
+                        buffer += "            }\n";
+                        buffer += "            float inverse = 1.0f / sum;\n";
+                        buffer += "            for (std::size_t j = 0; j < " + size + "; j++) " + out + "[j] *= inverse;\n";
+                        break;
+                }
+                buffer += "        }\n";
+            }
+            buffer += "    }\n}\n";
+            flush();
+            file.close();
+
+            if (!file) {std::cerr << "compile_network: error writing \"" << temporary.path << "\"\n";return;}
+            temporary.replace(location, "compile_network");
+        }
+        output forward_pass(const NeuralNetwork::network& neural_network, const std::vector<float>& inputs) {
+            return forward_output(neural_network, inputs, NeuralNetwork::output{});
+        }
+        NeuralNetwork::pmr::output forward_pass(const NeuralNetwork::network& neural_network, const std::vector<float>& inputs, std::pmr::memory_resource* resource) {
+            using buffer = std::pmr::vector<float>;
+            return forward_output(neural_network, inputs, NeuralNetwork::pmr::output{buffer(resource), buffer(resource), buffer(resource)});
+        }
+        float loss(const NeuralNetwork::network& neural_network, const NeuralNetwork::output& forward_output, const std::vector<float>& expected) {
+            return output_loss(neural_network, forward_output, expected);
+        }
+        float loss(const NeuralNetwork::network& neural_network, const NeuralNetwork::pmr::output& forward_output, const std::vector<float>& expected) {
+            return output_loss(neural_network, forward_output, expected);
+        }
+        backprop_averages backpropagate(const NeuralNetwork::network& neural_network, const std::vector<float>& inputs, const NeuralNetwork::output& forward_output, const std::vector<float>& expected) {
+            NeuralNetwork::backprop_averages gradients;
+            if (!accumulate_gradients(neural_network, inputs, forward_output, expected, gradients)) return NeuralNetwork::backprop_averages{};
+            return gradients;
+        }
+        NeuralNetwork::pmr::backprop_averages backpropagate(const NeuralNetwork::network& neural_network, const std::vector<float>& inputs, const NeuralNetwork::pmr::output& forward_output, const std::vector<float>& expected, std::pmr::memory_resource* resource) {
+            // The nested buffers take their outer buffer's resource when they're created
+            using buffer = NeuralNetwork::pmr::backprop_averages::buffer<std::pmr::vector<float>>;
+            using index_buffer = NeuralNetwork::pmr::backprop_averages::buffer<std::pmr::vector<uint32_t>>;
+            NeuralNetwork::pmr::backprop_averages gradients{buffer(resource), buffer(resource), index_buffer(resource)};
+            if (!accumulate_gradients(neural_network, inputs, forward_output, expected, gradients)) {
+                gradients.weights.clear();
+                gradients.biases.clear();
+                gradients.rows.clear();
+            }
+            return gradients;
+        }
+        void apply_gradients(NeuralNetwork::network& neural_network, const NeuralNetwork::backprop_averages& gradients) {
+            optimizer_step(neural_network, gradients);
+        }
+        void apply_gradients(NeuralNetwork::network& neural_network, const NeuralNetwork::pmr::backprop_averages& gradients) {
+            optimizer_step(neural_network, gradients);
+        }
+        float train_network(NeuralNetwork::network& neural_network, const NeuralNetwork::dataset& data, uint32_t epochs, uint32_t batch_size) {
+            return train_network(neural_network, data, epochs, batch_size, nullptr, 0.0);
+        }
+        float train_network(NeuralNetwork::network& neural_network, const NeuralNetwork::dataset& data, uint32_t epochs, uint32_t batch_size, const char* checkpoint_location, double checkpoint_seconds) {
+            if (neural_network.layers.empty()) {std::cerr << "train_network: network has no layers\n";return 0.0f;}
+            if (data.input_size != neural_network.layers[0].input_size || data.output_size != neural_network.layers.back().output_size) {std::cerr << "train_network: dataset does not match the provided neural network\n";return 0.0f;}
+            if (data.input_size == 0 || data.inputs.size() % data.input_size != 0 || data.outputs.size() != data.inputs.size() / data.input_size * data.output_size) {std::cerr << "train_network: dataset inputs and outputs have different amounts of rows\n";return 0.0f;}
+            size_t rows = data.inputs.size() / data.input_size;
+            if (rows == 0 || batch_size == 0) {std::cerr << "train_network: dataset or batch size is empty\n";return 0.0f;}
+
+            // Packed copies are rebuilt once at the end instead of after every step
+            std::vector<std::pair<uint32_t, uint32_t>> packing(neural_network.layers.size(), {0, 0});
+            for (size_t l = 0; l < neural_network.layers.size(); l++) {
+                NeuralNetwork::layer& layer = neural_network.layers[l];
+                if (!layer.packed.empty()) {
+                    packing[l] = {layer.panel_width, layer.k_block};
+                    std::vector<float>().swap(layer.packed);
+                }
+            }
 
+            // Checkpoints are written by a background thread while training continues
+            std::unique_ptr<NeuralNetwork::checkpointer> checkpoints;
+            if (checkpoint_location) checkpoints = std::make_unique<NeuralNetwork::checkpointer>();
+            auto last_checkpoint = std::chrono::steady_clock::now();
+
+            float epoch_loss = 0.0f;
+            NeuralNetwork::backprop_averages gradients;
+            std::vector<float> inputs(data.input_size), expected(data.output_size);
+            // Every row's forward pass reuses the same pooled buffers instead of going back to malloc
+            std::pmr::unsynchronized_pool_resource pool;
+            for (uint32_t epoch = 0; epoch < epochs; epoch++) {
+                double loss_sum = 0.0;
+                for (size_t first = 0; first < rows; first += batch_size) {
+                    size_t batch = std::min<size_t>(batch_size, rows - first);
+                    zero_gradients(neural_network, gradients);
+                    for (size_t row = first; row < first + batch; row++) {
+                        inputs.assign(data.inputs.begin() + row * data.input_size, data.inputs.begin() + (row + 1) * data.input_size);
+                        expected.assign(data.outputs.begin() + row * data.output_size, data.outputs.begin() + (row + 1) * data.output_size);
+                        NeuralNetwork::pmr::output fp_output = forward_pass(neural_network, inputs, &pool);
+                        loss_sum += loss(neural_network, fp_output, expected);
+                        accumulate_gradients(neural_network, inputs, fp_output, expected, gradients);
+                    }
+                    scale_gradients(neural_network, gradients, 1.0f / static_cast<float>(batch));
+                    apply_gradients(neural_network, gradients);
+
+                    if (checkpoints && std::chrono::duration<double>(std::chrono::steady_clock::now() - last_checkpoint).count() >= checkpoint_seconds) {
+                        checkpoints->save(checkpoint_location, neural_network);
+                        last_checkpoint = std::chrono::steady_clock::now();
+                    }
                 }
+                epoch_loss = static_cast<float>(loss_sum / rows);
             }
 
-            return averages;
+            for (size_t l = 0; l < neural_network.layers.size(); l++) {
+                if (packing[l].first != 0) pack_layer(neural_network.layers[l], packing[l].first, packing[l].second);
+            }
+            if (checkpoints) {
+                checkpoints->save(checkpoint_location, neural_network);
+                checkpoints->wait();
+            }
+            return epoch_loss;
         }
+        std::vector<float> train_networks(std::vector<NeuralNetwork::network>& networks, const NeuralNetwork::dataset& data, uint32_t epochs, uint32_t batch_size) {
+            // The networks share nothing but the read-only dataset, so each thread trains its own range of them
+            std::vector<float> losses(networks.size(), 0.0f);
+            parallel_for(networks.size(), 1, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) losses[i] = train_network(networks[i], data, epochs, batch_size);
+            });
+            return losses;
+        }
+        float train_network(NeuralNetwork::network& neural_network, const NeuralNetwork::dataset& data, uint32_t epochs, uint32_t batch_size, NeuralNetwork::ring& workers) {
+            if (neural_network.layers.empty()) {std::cerr << "train_network: network has no layers\n";return 0.0f;}
+            if (data.input_size != neural_network.layers[0].input_size || data.output_size != neural_network.layers.back().output_size) {std::cerr << "train_network: dataset does not match the provided neural network\n";return 0.0f;}
+            if (data.input_size == 0 || data.inputs.size() % data.input_size != 0 || data.outputs.size() != data.inputs.size() / data.input_size * data.output_size) {std::cerr << "train_network: dataset inputs and outputs have different amounts of rows\n";return 0.0f;}
+
+            // Every worker trains on its own share of the rows, the first total % workers shares hold one extra row. Every worker takes as many
+            // steps as the largest share needs, a worker whose share has run out still joins the all-reduces with zero gradients
+            size_t total = data.inputs.size() / data.input_size;
+            if (total == 0 || batch_size == 0) {std::cerr << "train_network: dataset or batch size is empty\n";return 0.0f;}
+            size_t share = total / workers.size(), extra = total % workers.size();
+            auto share_rows = [&](size_t rank) {return share + (rank < extra ? 1 : 0);};
+            auto step_rows = [&](size_t rank, size_t step) {return std::min<size_t>(batch_size, share_rows(rank) - std::min<size_t>(share_rows(rank), step * batch_size));};
+            size_t first_row = share * workers.rank() + std::min<size_t>(workers.rank(), extra);
+            size_t steps = (share_rows(0) + batch_size - 1) / batch_size;
 
-        /*backprop_averages backpropagate(NeuralNetwork::network neural_network, NeuralNetwork::output forward_activations, NeuralNetwork::y answers) {
-            if (neural_network.layers.empty()) {
-                std::cerr << "backpropagate: network has no layers\n";
-                return NeuralNetwork::backprop_averages{};
+            // Packed copies are rebuilt on every way out, including a failed all-reduce
+            std::vector<std::pair<uint32_t, uint32_t>> packing(neural_network.layers.size(), {0, 0});
+            for (size_t l = 0; l < neural_network.layers.size(); l++) {
+                NeuralNetwork::layer& layer = neural_network.layers[l];
+                if (!layer.packed.empty()) {
+                    packing[l] = {layer.panel_width, layer.k_block};
+                    std::vector<float>().swap(layer.packed);
+                }
             }
+            auto repack = [&]() {
+                for (size_t l = 0; l < neural_network.layers.size(); l++) {
+                    if (packing[l].first != 0) pack_layer(neural_network.layers[l], packing[l].first, packing[l].second);
+                }
+            };
+
+            // A layer's gradients are final once the batch's last sample has gone back through it, they're sent while earlier layers are still working
+            // Embedding tables only send which rows this worker looked up, the rows themselves follow once every worker knows the union
+            bucket_reducer reducer(workers);
+            NeuralNetwork::backprop_averages gradients;
+            std::vector<std::vector<float>> looked_up(neural_network.layers.size()), gathered(neural_network.layers.size());
+            const std::function<void(size_t)> layer_done = [&](size_t l) {
+                if (neural_network.layers[l].type == NeuralNetwork::layer_type::embedding) {
+                    looked_up[l].assign(neural_network.layers[l].lookup.categories, 0.0f);
+                    for (uint32_t row : gradients.rows[l]) looked_up[l][row] = 1.0f;
+                    reducer.reduce(looked_up[l].data(), looked_up[l].size());
+                } else {
+                    reducer.reduce(gradients.weights[l].data(), gradients.weights[l].size());
+                }
+                reducer.reduce(gradients.biases[l].data(), gradients.biases[l].size());
+            }, still_summing;
 
-            NeuralNetwork::backprop_averages averages;
+            float epoch_loss = 0.0f;
+            std::vector<float> inputs(data.input_size), expected(data.output_size);
+            std::pmr::unsynchronized_pool_resource pool;
+            for (uint32_t epoch = 0; epoch < epochs; epoch++) {
+                double loss_sum = 0.0;
+                for (size_t step = 0; step < steps; step++) {
+                    size_t first = first_row + step * batch_size;
+                    size_t batch = step_rows(workers.rank(), step), global_batch = 0;
+                    for (size_t rank = 0; rank < workers.size(); rank++) global_batch += step_rows(rank, step);
+                    zero_gradients(neural_network, gradients);
+                    for (size_t row = first; row < first + batch; row++) {
+                        inputs.assign(data.inputs.begin() + row * data.input_size, data.inputs.begin() + (row + 1) * data.input_size);
+                        expected.assign(data.outputs.begin() + row * data.output_size, data.outputs.begin() + (row + 1) * data.output_size);
+                        NeuralNetwork::pmr::output fp_output = forward_pass(neural_network, inputs, &pool);
+                        loss_sum += loss(neural_network, fp_output, expected);
+                        accumulate_gradients(neural_network, inputs, fp_output, expected, gradients, (row + 1 == first + batch) ? layer_done : still_summing);
+                    }
+                    if (batch == 0) {
+                        for (size_t l = neural_network.layers.size(); l-- > 0;) layer_done(l);
+                    }
+                    if (!reducer.wait()) {std::cerr << "train_network: gradient all-reduce failed\n";repack();return 0.0f;}
 
-            // Loop through layers
-            for (size_t l = neural_network.layers.size(); l-- > 0; l--) {
-
-                // Loop through neurons
-                for (size_t n = 0; n < neural_network.layers[l].biases.size(); n++) {
-                    float activation = forward_activations.activations[l * neural_network.layers[l].input_size + n];
-                    float loss = loss_function(activation, answers.layers[l][n]);
-                    float output_delta = activation - answers.layers[l][n];
-                    float output_weight_gradient = output_delta * activation;
-                    float output_bias_gradient = output_delta;
-
-                    // Loop through previous weights
-                    for (size_t j = 0; j < neural_network.layers[l - 1].weights.size(); j++) {
-                        float hidden_activation = forward_activations.activations[l * neural_network.layers[l - 1].input_size + j];
-                        float hidden_pre_activation = forward_activations.pre_activations[l * neural_network.layers[l - 1].input_size + j];
-                        float hidden_delta = output_delta * output_weight_gradient * activation_function_derivative(hidden_pre_activation);
-
-                        float hidden_weight_gradient = hidden_delta * hidden_activation;
-                        float hidden_bias_gradient = hidden_delta;
-                        
-                        averages.weights[l][n].push_back(hidden_weight_gradient);
-                        averages.biases[l][n].push_back(hidden_bias_gradient);
+                    // Rows looked up by any worker are gathered in order, summed and scattered back. The optimizer then steps exactly
+                    // the rows one process would have on the global batch, a row this worker never looked up still holds zeros to add
+                    bool embeddings = false;
+                    for (size_t l = 0; l < neural_network.layers.size(); l++) {
+                        if (neural_network.layers[l].type != NeuralNetwork::layer_type::embedding) continue;
+                        size_t dimensions = neural_network.layers[l].lookup.dimensions;
+                        gradients.rows[l].clear();
+                        for (uint32_t row = 0; row < looked_up[l].size(); row++) {
+                            if (looked_up[l][row] != 0.0f) gradients.rows[l].push_back(row);
+                        }
+                        gathered[l].resize(gradients.rows[l].size() * dimensions);
+                        for (size_t i = 0; i < gradients.rows[l].size(); i++) std::copy_n(&gradients.weights[l][(size_t)gradients.rows[l][i] * dimensions], dimensions, &gathered[l][i * dimensions]);
+                        reducer.reduce(gathered[l].data(), gathered[l].size());
+                        embeddings = true;
                     }
+                    if (embeddings) {
+                        if (!reducer.wait()) {std::cerr << "train_network: gradient all-reduce failed\n";repack();return 0.0f;}
+                        for (size_t l = 0; l < neural_network.layers.size(); l++) {
+                            if (neural_network.layers[l].type != NeuralNetwork::layer_type::embedding) continue;
+                            size_t dimensions = neural_network.layers[l].lookup.dimensions;
+                            for (size_t i = 0; i < gradients.rows[l].size(); i++) std::copy_n(&gathered[l][i * dimensions], dimensions, &gradients.weights[l][(size_t)gradients.rows[l][i] * dimensions]);
+                        }
+                    }
+                    scale_gradients(neural_network, gradients, 1.0f / static_cast<float>(global_batch));
+                    apply_gradients(neural_network, gradients);
                 }
+                float worker_loss = static_cast<float>(loss_sum);
+                if (!workers.all_reduce(&worker_loss, 1)) {std::cerr << "train_network: loss all-reduce failed\n";repack();return 0.0f;}
+                epoch_loss = worker_loss / static_cast<float>(total);
             }
 
-            return averages;
-        }*/
+            repack();
+            return epoch_loss;
+        }
+        dataset load_dataset(char* location, uint32_t input_size) {
+            dataset_reader reader(location, input_size, "load_dataset");
+            NeuralNetwork::dataset data;
+            if (!reader.next(data, SIZE_MAX)) return NeuralNetwork::dataset{};
+            return data;
+        }
+        evaluation evaluate_network(const NeuralNetwork::network& neural_network, const NeuralNetwork::dataset& data) {
+            if (neural_network.layers.empty()) {std::cerr << "evaluate_network: network has no layers\n";return NeuralNetwork::evaluation{};}
+            if (data.input_size != neural_network.layers[0].input_size || data.output_size != neural_network.layers.back().output_size) {std::cerr << "evaluate_network: dataset does not match the provided neural network\n";return NeuralNetwork::evaluation{};}
+            if (data.input_size == 0 || data.inputs.size() % data.input_size != 0 || data.outputs.size() != data.inputs.size() / data.input_size * data.output_size) {std::cerr << "evaluate_network: dataset inputs and outputs have different amounts of rows\n";return NeuralNetwork::evaluation{};}
+
+            auto start = std::chrono::steady_clock::now();
+            uint32_t classes = std::max(2u, data.output_size);
+            evaluation_sums sums;
+            sums.confusion.assign((size_t)classes * classes, 0);
+            score_chunk(neural_network, data, classes, sums);
+            return finish_evaluation(sums, classes, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+        evaluation evaluate_network(const NeuralNetwork::network& neural_network, char* location) {
+            if (neural_network.layers.empty()) {std::cerr << "evaluate_network: network has no layers\n";return NeuralNetwork::evaluation{};}
+            auto start = std::chrono::steady_clock::now();
+            const size_t chunk_rows = 1 << 14;
+            uint32_t output_size = neural_network.layers.back().output_size;
+            uint32_t classes = std::max(2u, output_size);
+            evaluation_sums sums;
+            sums.confusion.assign((size_t)classes * classes, 0);
+
+            // The next chunk is parsed on its own thread while the current one is scored
+            dataset_reader reader(location, neural_network.layers[0].input_size, "evaluate_network");
+            NeuralNetwork::dataset current, next;
+            bool more = reader.next(current, chunk_rows);
+            if (more && current.output_size != output_size) {std::cerr << "evaluate_network: dataset does not match the provided neural network\n";return NeuralNetwork::evaluation{};}
+            while (more) {
+                bool next_more = false;
+                std::thread reading([&]() {next_more = reader.next(next, chunk_rows);});
+                score_chunk(neural_network, current, classes, sums);
+                reading.join();
+                std::swap(current, next);
+                more = next_more;
+            }
+            if (!reader.ok()) return NeuralNetwork::evaluation{};
+            return finish_evaluation(sums, classes, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
     }
     
\ No newline at end of file
@@ -19,6 +19,8 @@
 #include <filesystem>
 #include <iostream>
 #include <vector>
+#include <sstream>
+#include <cmath>
 #include "../tests/binary.h"
 #include "../include/eznet.h"
  
@@ -296,6 +298,25 @@ bool write_config() {
     return true;
 }
 
+bool summarize_block() {
+    /* Expected summary of block 1 (4.0f, 2.0f, 1.4142135f) with 2 bins:
+    count: 3, min: 1.4142135, max: 4, mean: 2.4714045
+    histogram: {2, 1}, the max always lands in the last bin
+    */
+    NeuralNetwork::block_summary summary = NeuralNetwork::summarize_block(testfilename, 1, 2);
+    if (summary.count != 3) {std::cerr << "\033[31m[ ERROR ]\033[0m binary: summarize_block: count isn't as expected.\n";return false;}
+    if (summary.min != 1.4142135f || summary.max != 4.0f) {std::cerr << "\033[31m[ ERROR ]\033[0m binary: summarize_block: min or max isn't as expected.\n";return false;}
+    if (std::fabs(summary.mean - 2.4714045) > 1e-6) {std::cerr << "\033[31m[ ERROR ]\033[0m binary: summarize_block: mean isn't as expected.\n";return false;}
+    if (summary.histogram != std::vector<uint64_t>{2, 1}) {std::cerr << "\033[31m[ ERROR ]\033[0m binary: summarize_block: histogram isn't as expected.\n";return false;}
+
+    // Full output streams every value of every block
+    std::ostringstream out;
+    NeuralNetwork::output_network(testfilename, out);
+    if (out.str().find("999  ") == std::string::npos || out.str().find("4  2  1.4142135  ") == std::string::npos) {std::cerr << "\033[31m[ ERROR ]\033[0m binary: summarize_block: output_network didn't print every value.\n";return false;}
+
+    return true;
+}
+
 bool binary() {
     bool success = true;
     // insert_bytes
@@ -344,6 +365,14 @@ bool binary() {
                         success = false;
                     } else {
                         std::cout << "\033[32m[ PASSED ]\033[0m binary: write_config()\n";
+
+                        // summarize_block
+                        if (!summarize_block()) {
+                            std::cout << "\033[31m[ FAILED ]\033[0m binary: summarize_block()\n";
+                            success = false;
+                        } else {
+                            std::cout << "\033[32m[ PASSED ]\033[0m binary: summarize_block()\n";
+                        }
                     }
                 }
             }
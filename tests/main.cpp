@@ -19,8 +19,9 @@
 #include "../tests/main.h"
 #include "../tests/binary.h"
 #include "../tests/network.h"
+#include "../tests/stress.h"
 
-const int total_tests = 2;
+const int total_tests = 3;
 int tests_passed = 0;
 int tests_done = 0;
 
@@ -32,6 +33,10 @@ void all_tests() {
     tests_done++;
     std::cout << "\033[1mtest manager: (" << tests_done << "/" << total_tests << ") running network tests\033[0m" << std::endl;
     if (network()) {tests_passed++;}
+
+    tests_done++;
+    std::cout << "\033[1mtest manager: (" << tests_done << "/" << total_tests << ") running stress tests\033[0m" << std::endl;
+    if (stress(64)) {tests_passed++;}
     
 
     if (tests_passed == total_tests) {
@@ -39,4 +44,12 @@ void all_tests() {
     } else {
         std::cout << std::endl << "\033[1mtest manager:\033[0m some tests finished with errors." << std::endl << std::endl;
     }
+}
+void stress_tests(uint64_t megabytes) {
+    std::cout << "\033[1mtest manager: running stress tests at " << megabytes << " MiB\033[0m" << std::endl;
+    if (stress(megabytes)) {
+        std::cout << std::endl << "\033[1mtest manager:\033[0m all tests passed!" << std::endl << std::endl;
+    } else {
+        std::cout << std::endl << "\033[1mtest manager:\033[0m some tests finished with errors." << std::endl << std::endl;
+    }
 }
\ No newline at end of file
@@ -1,3 +1,6 @@
 #pragma once
 
-void all_tests();
\ No newline at end of file
+#include <cstdint>
+
+void all_tests();
+void stress_tests(uint64_t megabytes);
\ No newline at end of file
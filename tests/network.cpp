@@ -2,17 +2,28 @@
 #include <filesystem>
 #include <iostream>
 #include <vector>
+#include <cmath>
+#include <algorithm>
+#include <iterator>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <memory_resource>
 #include "../tests/network.h"
 #include "../include/eznet.h"
 
-//char "network_test_file.binary"[] = "network_test_file.binary";
+namespace fs = std::filesystem;
+char networktestfilename[] = "network_test_file.binary";
 
 bool create_network() {
     std::vector<uint32_t> layers = {2, 3, 2};
     NeuralNetwork::network new_network = NeuralNetwork::create_network(layers);
 
     /* Expected data:
-    config data[0] = {2} (config version 1 says there is only one config uint32_t, and it is responsible for input size)
+    config data starts with the input size, followed by an activations record for 2 ReLU layers and a 2 value seed record
     layers should have 2 NeuralNetwork::layer instances (layers[0] is simply for input size, not actually a layer), each with filled out input and output sizes, and proper amounts of weights and biases.
 
     layer 0:
@@ -28,8 +39,8 @@ bool create_network() {
     output size: 2
     */
 
-    if (new_network.config_data.size() != 1) {std::cerr << "\033[31m[ ERROR ]\033[0m network: create_network: config metadata size isn't as expected.\n";return false;}
-    if (new_network.config_data[0] != 2) {std::cerr << "\033[31m[ ERROR ]\033[0m network: create_network: config metadata isn't as expected.\n";return false;}
+    if (new_network.config_data.size() != 9) {std::cerr << "\033[31m[ ERROR ]\033[0m network: create_network: config metadata size isn't as expected.\n";return false;}
+    if (new_network.config_data[0] != 2 || NeuralNetwork::read_config_record(new_network.config_data, NeuralNetwork::config_activations) != std::vector<uint32_t>{0, 0} || NeuralNetwork::read_config_record(new_network.config_data, NeuralNetwork::config_seed).size() != 2) {std::cerr << "\033[31m[ ERROR ]\033[0m network: create_network: config metadata isn't as expected.\n";return false;}
     if (new_network.layers.size() != 2) {std::cerr << "\033[31m[ ERROR ]\033[0m network: create_network: amount of layers isn't as expected.\n";return false;}
 
     if (new_network.layers[0].weights.size() != 6) {std::cerr << "\033[31m[ ERROR ]\033[0m network: create_network: amount of weights isn't as expected.\n";return false;}
@@ -45,31 +56,1362 @@ bool create_network() {
     return true;
 }
 
+bool seeded_network() {
+    std::vector<uint32_t> layers = {300, 257, 3};
+    uint32_t threads = NeuralNetwork::thread_count();
+
+    /* Expected data:
+    the same seed gives bit-identical weights with 1 thread and with 7 threads
+    a different seed gives different weights
+    weights are normal with mean 0 and standard deviation sqrt(2 / fan in)
+    */
+    NeuralNetwork::set_thread_count(1);
+    NeuralNetwork::network single_thread = NeuralNetwork::create_network(layers, {}, 1234);
+    NeuralNetwork::set_thread_count(7);
+    NeuralNetwork::network multi_thread = NeuralNetwork::create_network(layers, {}, 1234);
+    NeuralNetwork::network other_seed = NeuralNetwork::create_network(layers, {}, 1235);
+    NeuralNetwork::set_thread_count(threads);
+
+    for (size_t i = 0; i < layers.size() - 1; i++) {
+        if (single_thread.layers[i].weights != multi_thread.layers[i].weights) {std::cerr << "\033[31m[ ERROR ]\033[0m network: seeded_network: layer " << i << "'s weights depend on the thread count.\n";return false;}
+        if (single_thread.layers[i].weights == other_seed.layers[i].weights) {std::cerr << "\033[31m[ ERROR ]\033[0m network: seeded_network: layer " << i << "'s weights don't depend on the seed.\n";return false;}
+    }
+    if (NeuralNetwork::read_config_record(single_thread.config_data, NeuralNetwork::config_seed) != std::vector<uint32_t>{1234, 0}) {std::cerr << "\033[31m[ ERROR ]\033[0m network: seeded_network: seed record isn't as expected.\n";return false;}
+
+    double sum = 0.0, squares = 0.0;
+    const std::vector<float>& weights = single_thread.layers[0].weights;
+    for (float weight : weights) {sum += weight;squares += (double)weight * weight;}
+    double mean = sum / weights.size();
+    double stddev = std::sqrt(squares / weights.size() - mean * mean);
+    if (std::fabs(mean) > 0.002 || std::fabs(stddev - std::sqrt(2.0 / 300)) > 0.002) {std::cerr << "\033[31m[ ERROR ]\033[0m network: seeded_network: weights aren't distributed as expected.\n";return false;}
+
+    return true;
+}
+
+bool forward_pass() {
+    using activation = NeuralNetwork::activation_type;
+    std::vector<uint32_t> layers = {4, 8, 3};
+    NeuralNetwork::network new_network = NeuralNetwork::create_network(layers, {activation::tanh, activation::softmax});
+
+    std::vector<float> inputs = {0.5f, -1.0f, 2.0f, 0.25f};
+    NeuralNetwork::output fp_output = NeuralNetwork::forward_pass(new_network, inputs);
+
+    /* Expected data:
+    pre_activations and activations: 8 + 3 values
+    outputs: 3 softmax probabilities that sum to 1
+    loss: cross-entropy, -log(outputs[1]) when the answer is class 1
+    */
+    if (fp_output.pre_activations.size() != 11 || fp_output.activations.size() != 11) {std::cerr << "\033[31m[ ERROR ]\033[0m network: forward_pass: amount of activations isn't as expected.\n";return false;}
+    if (fp_output.outputs.size() != 3) {std::cerr << "\033[31m[ ERROR ]\033[0m network: forward_pass: amount of outputs isn't as expected.\n";return false;}
+    for (size_t i = 0; i < 8; i++) {
+        if (std::fabs(fp_output.activations[i] - std::tanh(fp_output.pre_activations[i])) > 1e-5f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: forward_pass: tanh activation isn't as expected.\n";return false;}
+    }
+
+    float sum = fp_output.outputs[0] + fp_output.outputs[1] + fp_output.outputs[2];
+    if (std::fabs(sum - 1.0f) > 1e-5f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: forward_pass: softmax outputs do not sum to 1.\n";return false;}
+
+    float loss = NeuralNetwork::loss(new_network, fp_output, {0.0f, 1.0f, 0.0f});
+    if (std::fabs(loss + std::log(fp_output.outputs[1])) > 1e-4f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: forward_pass: cross-entropy loss isn't as expected.\n";return false;}
+
+    // Huge logits must not overflow
+    new_network.layers[1].biases = {1000.0f, -1000.0f, 0.0f};
+    fp_output = NeuralNetwork::forward_pass(new_network, inputs);
+    loss = NeuralNetwork::loss(new_network, fp_output, {0.0f, 0.0f, 1.0f});
+    if (!std::isfinite(loss) || !std::isfinite(fp_output.outputs[0])) {std::cerr << "\033[31m[ ERROR ]\033[0m network: forward_pass: softmax cross-entropy isn't numerically stable.\n";return false;}
+
+    return true;
+}
+
+bool prepack_network() {
+    std::vector<uint32_t> layers = {37, 29, 5};
+    NeuralNetwork::network new_network = NeuralNetwork::create_network(layers, {NeuralNetwork::activation_type::leaky_relu, NeuralNetwork::activation_type::sigmoid});
+
+    std::vector<float> inputs(37);
+    for (size_t i = 0; i < inputs.size(); i++) inputs[i] = std::sin(static_cast<float>(i));
+    NeuralNetwork::output expected = NeuralNetwork::forward_pass(new_network, inputs);
+
+    // Every panel width, with K blocks that do and don't divide the input size
+    for (uint32_t panel_width : {4u, 8u, 16u}) {
+        for (uint32_t k_block : {8u, 13u, 64u}) {
+            NeuralNetwork::network packed_network = new_network;
+            for (NeuralNetwork::layer& layer : packed_network.layers) NeuralNetwork::pack_layer(layer, panel_width, k_block);
+            NeuralNetwork::output packed_output = NeuralNetwork::forward_pass(packed_network, inputs);
+            for (size_t i = 0; i < expected.outputs.size(); i++) {
+                if (std::fabs(packed_output.outputs[i] - expected.outputs[i]) > 1e-5f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: prepack_network: packed outputs (panel width " << panel_width << ", k block " << k_block << ") don't match unpacked outputs.\n";return false;}
+            }
+        }
+    }
+
+    // Packed layouts are cached in the file
+    NeuralNetwork::prepack_network(new_network);
+    NeuralNetwork::save_network(networktestfilename, new_network);
+    NeuralNetwork::network loaded_network = NeuralNetwork::load_network(networktestfilename);
+    for (size_t i = 0; i < new_network.layers.size(); i++) {
+        if (loaded_network.layers[i].packed != new_network.layers[i].packed) {std::cerr << "\033[31m[ ERROR ]\033[0m network: prepack_network: layer " << i << "'s cached packed layout isn't as expected.\n";return false;}
+        if (loaded_network.layers[i].k_block != new_network.layers[i].k_block) {std::cerr << "\033[31m[ ERROR ]\033[0m network: prepack_network: layer " << i << "'s k block isn't as expected.\n";return false;}
+    }
+
+    return true;
+}
+
+bool prune_network() {
+    std::vector<uint32_t> layers = {40, 30, 6};
+    NeuralNetwork::network new_network = NeuralNetwork::create_network(layers, {NeuralNetwork::activation_type::relu, NeuralNetwork::activation_type::tanh});
+
+    std::vector<float> inputs(40);
+    for (size_t i = 0; i < inputs.size(); i++) inputs[i] = std::cos(static_cast<float>(i));
+
+    /* Expected data after pruning to 90%:
+    both layers are stored as compressed sparse rows, with no dense weights left
+    layer 0: 120 non-zero weights (10% of 1200)
+    layer 1: 18 non-zero weights (10% of 180)
+    the sparse forward pass matches a dense forward pass of the same pruned weights
+    */
+    NeuralNetwork::prune_network(new_network, 0.9f);
+    if (new_network.layers[0].sparse_rows.size() != 31 || !new_network.layers[0].weights.empty()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: prune_network: layer 0 wasn't stored sparse.\n";return false;}
+    if (new_network.layers[0].sparse_values.size() != 120) {std::cerr << "\033[31m[ ERROR ]\033[0m network: prune_network: layer 0's amount of non-zero weights isn't as expected.\n";return false;}
+    if (new_network.layers[1].sparse_values.size() != 18) {std::cerr << "\033[31m[ ERROR ]\033[0m network: prune_network: layer 1's amount of non-zero weights isn't as expected.\n";return false;}
+
+    NeuralNetwork::network dense_network = new_network;
+    for (NeuralNetwork::layer& layer : dense_network.layers) NeuralNetwork::densify_layer(layer);
+    NeuralNetwork::output sparse_output = NeuralNetwork::forward_pass(new_network, inputs);
+    NeuralNetwork::output dense_output = NeuralNetwork::forward_pass(dense_network, inputs);
+    for (size_t i = 0; i < dense_output.outputs.size(); i++) {
+        if (std::fabs(sparse_output.outputs[i] - dense_output.outputs[i]) > 1e-5f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: prune_network: sparse outputs don't match dense outputs.\n";return false;}
+    }
+
+    // Sparse layers round trip through the file
+    NeuralNetwork::save_network(networktestfilename, new_network);
+    NeuralNetwork::network loaded_network = NeuralNetwork::load_network(networktestfilename);
+    for (size_t i = 0; i < new_network.layers.size(); i++) {
+        if (loaded_network.layers[i].sparse_values != new_network.layers[i].sparse_values || loaded_network.layers[i].sparse_columns != new_network.layers[i].sparse_columns || loaded_network.layers[i].sparse_rows != new_network.layers[i].sparse_rows) {std::cerr << "\033[31m[ ERROR ]\033[0m network: prune_network: layer " << i << "'s sparse rows didn't survive saving and loading.\n";return false;}
+    }
+
+    // Light pruning keeps layers dense
+    NeuralNetwork::network light_network = NeuralNetwork::create_network(layers);
+    NeuralNetwork::prune_network(light_network, 0.5f);
+    if (!light_network.layers[0].sparse_rows.empty()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: prune_network: a 50% sparse layer shouldn't be stored sparse.\n";return false;}
+    if (std::count(light_network.layers[0].weights.begin(), light_network.layers[0].weights.end(), 0.0f) != 600) {std::cerr << "\033[31m[ ERROR ]\033[0m network: prune_network: amount of pruned weights isn't as expected.\n";return false;}
+
+    return true;
+}
+
+bool train_network() {
+    using activation = NeuralNetwork::activation_type;
+
+    // XOR as a 2 class problem
+    NeuralNetwork::dataset data;
+    data.input_size = 2;
+    data.output_size = 2;
+    data.inputs = {0, 0, 0, 1, 1, 0, 1, 1};
+    data.outputs = {1, 0, 0, 1, 0, 1, 1, 0};
+
+    /* Expected results:
+    backpropagate matches finite differences of the loss
+    every optimizer brings XOR's loss down, adam close to zero
+    saving and loading mid-training resumes bit for bit: training 2 + 2 epochs across a save equals training 4 epochs straight
+    training with background checkpoints leaves a checkpoint equal to the trained network, a waiting snapshot is replaced instead of queued
+    training several networks at once gives the same networks and losses as training them one after another
+    */
+    NeuralNetwork::network checked = NeuralNetwork::create_network({2, 5, 2}, {activation::tanh, activation::softmax}, 42);
+    std::vector<float> inputs = {0.3f, -0.7f}, expected = {0.0f, 1.0f};
+    NeuralNetwork::backprop_averages gradients = NeuralNetwork::backpropagate(checked, inputs, NeuralNetwork::forward_pass(checked, inputs), expected);
+    for (size_t l = 0; l < 2; l++) {
+        for (size_t i = 0; i < checked.layers[l].weights.size(); i++) {
+            NeuralNetwork::network nudged = checked;
+            nudged.layers[l].weights[i] += 1e-2f;
+            float up = NeuralNetwork::loss(nudged, NeuralNetwork::forward_pass(nudged, inputs), expected);
+            nudged.layers[l].weights[i] -= 2e-2f;
+            float down = NeuralNetwork::loss(nudged, NeuralNetwork::forward_pass(nudged, inputs), expected);
+            if (std::fabs((up - down) / 2e-2f - gradients.weights[l][i]) > 2e-3f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: train_network: layer " << l << "'s weight " << i << " gradient doesn't match finite differences.\n";return false;}
+        }
+    }
+
+    for (NeuralNetwork::optimizer_type type : {NeuralNetwork::optimizer_type::sgd, NeuralNetwork::optimizer_type::momentum, NeuralNetwork::optimizer_type::adam, NeuralNetwork::optimizer_type::adamw}) {
+        NeuralNetwork::network new_network = NeuralNetwork::create_network({2, 8, 2}, {activation::tanh, activation::softmax}, 7);
+        new_network.optimizer.type = type;
+        new_network.optimizer.learning_rate = (type == NeuralNetwork::optimizer_type::sgd) ? 0.5f : 0.05f;
+        float first = NeuralNetwork::train_network(new_network, data, 1, 4);
+        float last = NeuralNetwork::train_network(new_network, data, 300, 4);
+        if (!(last < first * 0.5f)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: train_network: optimizer " << static_cast<uint32_t>(type) << " didn't reduce the loss (" << first << " to " << last << ").\n";return false;}
+    }
+
+    NeuralNetwork::network straight = NeuralNetwork::create_network({2, 8, 2}, {activation::gelu, activation::softmax}, 9);
+    straight.optimizer.type = NeuralNetwork::optimizer_type::adamw;
+    straight.optimizer.weight_decay = 0.01f;
+    NeuralNetwork::network resumed = straight;
+    NeuralNetwork::train_network(straight, data, 4, 2);
+    NeuralNetwork::train_network(resumed, data, 2, 2);
+    NeuralNetwork::save_network(networktestfilename, resumed);
+    resumed = NeuralNetwork::load_network(networktestfilename);
+    if (resumed.optimizer.step != 4 || resumed.optimizer.weight_variances.size() != 2) {std::cerr << "\033[31m[ ERROR ]\033[0m network: train_network: optimizer state wasn't restored.\n";return false;}
+    NeuralNetwork::train_network(resumed, data, 2, 2);
+    for (size_t l = 0; l < 2; l++) {
+        if (resumed.layers[l].weights != straight.layers[l].weights || resumed.optimizer.weight_moments[l] != straight.optimizer.weight_moments[l]) {std::cerr << "\033[31m[ ERROR ]\033[0m network: train_network: resumed training doesn't match uninterrupted training.\n";return false;}
+    }
+
+    std::vector<NeuralNetwork::network> sweep, alone;
+    for (float learning_rate : {0.5f, 0.1f, 0.02f}) {
+        NeuralNetwork::network run = NeuralNetwork::create_network({2, 8, 2}, {activation::tanh, activation::softmax}, 13);
+        run.optimizer.learning_rate = learning_rate;
+        sweep.push_back(run);
+        alone.push_back(run);
+    }
+    std::vector<float> losses = NeuralNetwork::train_networks(sweep, data, 20, 2);
+    for (size_t i = 0; i < alone.size(); i++) {
+        float loss = NeuralNetwork::train_network(alone[i], data, 20, 2);
+        if (loss != losses[i] || alone[i].layers[0].weights != sweep[i].layers[0].weights) {std::cerr << "\033[31m[ ERROR ]\033[0m network: train_network: network " << i << " of a sweep doesn't match training it alone.\n";return false;}
+    }
+
+    NeuralNetwork::network checkpointed = NeuralNetwork::create_network({2, 8, 2}, {activation::tanh, activation::softmax}, 11);
+    NeuralNetwork::train_network(checkpointed, data, 20, 2, networktestfilename, 0.0);
+    NeuralNetwork::network checkpoint = NeuralNetwork::load_network(networktestfilename);
+    if (checkpoint.layers.size() != 2 || checkpoint.optimizer.step != 40) {std::cerr << "\033[31m[ ERROR ]\033[0m network: train_network: final checkpoint wasn't written.\n";return false;}
+    for (size_t l = 0; l < 2; l++) {
+        if (checkpoint.layers[l].weights != checkpointed.layers[l].weights || checkpoint.layers[l].biases != checkpointed.layers[l].biases) {std::cerr << "\033[31m[ ERROR ]\033[0m network: train_network: checkpoint doesn't match the trained network.\n";return false;}
+    }
+
+    {
+        NeuralNetwork::checkpointer checkpoints;
+        for (uint32_t i = 0; i < 50; i++) {
+            checkpointed.optimizer.step = i;
+            checkpoints.save(networktestfilename, checkpointed);
+        }
+        checkpoints.wait();
+        if (checkpoints.written() + checkpoints.replaced() != 50 || checkpoints.written() == 0) {std::cerr << "\033[31m[ ERROR ]\033[0m network: train_network: checkpointer lost snapshots.\n";return false;}
+    }
+    if (NeuralNetwork::load_network(networktestfilename).optimizer.step != 49) {std::cerr << "\033[31m[ ERROR ]\033[0m network: train_network: the newest snapshot wasn't the last one written.\n";return false;}
+
+    return true;
+}
+
 bool save_network() {
     std::vector<uint32_t> layers = {2, 3, 2};
     NeuralNetwork::network new_network = NeuralNetwork::create_network(layers);
 
-    std::fstream file("network_test_file.binary", std::ios::in | std::ios::out | std::ios::binary);
-    if (!file.is_open()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: failed to open \"" << "network_test_file.binary" << "\".\n";return false;}
+    NeuralNetwork::save_network(networktestfilename, new_network);
 
-     
+    std::fstream file(networktestfilename, std::ios::in | std::ios::out | std::ios::binary);
+    if (!file.is_open()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: failed to open \"" << networktestfilename << "\".\n";return false;}
 
+    /* Expected structure:
+    blocks: 4 (bias and weight blocks for each of the 2 layers)
+    block_sizes: 12, 24, 8, 24
+    config_data: the network's input size, activations and seed, plus an optimizer record
+    */
+    NeuralNetwork::file_metadata metadata = NeuralNetwork::read_metadata(file);
     file.close();
+
+    if (metadata.blocks != 4) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: blocks metadata isn't as expected.\n";return false;}
+    if (metadata.block_sizes != std::vector<uint32_t>{12, 24, 8, 24}) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: block_sizes metadata isn't as expected.\n";return false;}
+    if (metadata.config_data[0] != 2 || NeuralNetwork::read_config_record(metadata.config_data, NeuralNetwork::config_seed) != NeuralNetwork::read_config_record(new_network.config_data, NeuralNetwork::config_seed)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: config_data metadata isn't as expected.\n";return false;}
+    if (NeuralNetwork::read_config_record(metadata.config_data, NeuralNetwork::config_optimizer).size() != 16) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: optimizer record isn't as expected.\n";return false;}
+    if (NeuralNetwork::read_config_record(metadata.config_data, NeuralNetwork::config_activations).size() != 2) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: activations record isn't as expected.\n";return false;}
+    if (NeuralNetwork::read_block(networktestfilename, 0) != new_network.layers[0].biases) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: block 0 should hold layer 0's biases.\n";return false;}
+    if (NeuralNetwork::read_block(networktestfilename, 3) != new_network.layers[1].weights) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: block 3 should hold layer 1's weights.\n";return false;}
+
+    /* Expected results:
+    concurrent saves to one location each write their own temporary file, and the file they leave behind loads
+    a save that can't replace its target fails without leaving its temporary file behind
+    */
+    std::vector<std::thread> savers;
+    for (int t = 0; t < 4; t++) savers.emplace_back([&]() {NeuralNetwork::save_network(networktestfilename, new_network);});
+    for (std::thread& saver : savers) saver.join();
+    if (NeuralNetwork::load_network(networktestfilename).layers.size() != 2) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: concurrent saves left a file that doesn't load.\n";return false;}
+    char blockedfilename[] = "network_test_file_blocked.binary";
+    fs::create_directory(blockedfilename);
+    NeuralNetwork::save_network(blockedfilename, new_network);
+    fs::remove(blockedfilename);
+    for (const fs::directory_entry& entry : fs::directory_iterator(".")) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind("network_test_file", 0) == 0 && name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {std::cerr << "\033[31m[ ERROR ]\033[0m network: save_network: \"" << name << "\" was left behind.\n";return false;}
+    }
+
+    return true;
+}
+
+bool load_network() {
+    std::vector<uint32_t> layers = {2, 3, 2};
+    NeuralNetwork::network new_network = NeuralNetwork::create_network(layers, {NeuralNetwork::activation_type::gelu, NeuralNetwork::activation_type::sigmoid});
+    NeuralNetwork::save_network(networktestfilename, new_network);
+
+    NeuralNetwork::network loaded_network = NeuralNetwork::load_network(networktestfilename);
+
+    if (loaded_network.config_data[0] != new_network.config_data[0]) {std::cerr << "\033[31m[ ERROR ]\033[0m network: load_network: config data isn't as expected.\n";return false;}
+    if (loaded_network.layers.size() != new_network.layers.size()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: load_network: amount of layers isn't as expected.\n";return false;}
+    for (size_t i = 0; i < new_network.layers.size(); i++) {
+        if (loaded_network.layers[i].weights != new_network.layers[i].weights) {std::cerr << "\033[31m[ ERROR ]\033[0m network: load_network: layer " << i << "'s weights aren't as expected.\n";return false;}
+        if (loaded_network.layers[i].biases != new_network.layers[i].biases) {std::cerr << "\033[31m[ ERROR ]\033[0m network: load_network: layer " << i << "'s biases aren't as expected.\n";return false;}
+        if (loaded_network.layers[i].input_size != new_network.layers[i].input_size) {std::cerr << "\033[31m[ ERROR ]\033[0m network: load_network: layer " << i << "'s input size isn't as expected.\n";return false;}
+        if (loaded_network.layers[i].output_size != new_network.layers[i].output_size) {std::cerr << "\033[31m[ ERROR ]\033[0m network: load_network: layer " << i << "'s output size isn't as expected.\n";return false;}
+        if (loaded_network.layers[i].activation != new_network.layers[i].activation) {std::cerr << "\033[31m[ ERROR ]\033[0m network: load_network: layer " << i << "'s activation isn't as expected.\n";return false;}
+    }
+
+    return true;
+}
+
+bool append_network() {
+    using activation = NeuralNetwork::activation_type;
+    NeuralNetwork::network new_network = NeuralNetwork::create_network({4, 16, 3}, {activation::tanh, activation::softmax}, 5);
+    NeuralNetwork::save_network(networktestfilename, new_network);
+    uintmax_t saved_size = fs::file_size(networktestfilename);
+
+    /* Expected results:
+    appending an unchanged network only adds an index and a trailer, and the file becomes append-only (v3)
+    appending after changing one bias block only adds that block, an index and a trailer
+    an unfinished append at the end of the file is skipped when reading, and overwritten by the next append
+    compacting gives back a v2 file the same size as a fresh save, every load matches the network
+    */
+    auto matches = [&](const NeuralNetwork::network& loaded) {
+        if (loaded.layers.size() != new_network.layers.size()) return false;
+        for (size_t l = 0; l < loaded.layers.size(); l++) {
+            if (loaded.layers[l].weights != new_network.layers[l].weights || loaded.layers[l].biases != new_network.layers[l].biases) return false;
+        }
+        return true;
+    };
+    auto index_size = [](const NeuralNetwork::file_metadata& metadata) {
+        return sizeof(uint32_t) * (2 + metadata.blocks + metadata.config_size) + 2 * sizeof(uint64_t) * metadata.blocks + 3 * sizeof(uint64_t) + sizeof(uint32_t);
+    };
+
+    NeuralNetwork::append_network(networktestfilename, new_network);
+    std::fstream file(networktestfilename, std::ios::in | std::ios::binary);
+    NeuralNetwork::file_metadata metadata = NeuralNetwork::read_metadata(file);
+    file.close();
+    if (metadata.version != 3) {std::cerr << "\033[31m[ ERROR ]\033[0m network: append_network: file isn't marked append-only.\n";return false;}
+    if (fs::file_size(networktestfilename) != saved_size + index_size(metadata)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: append_network: unchanged blocks were appended again.\n";return false;}
+    if (!matches(NeuralNetwork::load_network(networktestfilename))) {std::cerr << "\033[31m[ ERROR ]\033[0m network: append_network: loaded network doesn't match after an unchanged append.\n";return false;}
+
+    uintmax_t appended_size = fs::file_size(networktestfilename);
+    new_network.layers[1].biases[2] = 0.5f;
+    NeuralNetwork::append_network(networktestfilename, new_network);
+    if (fs::file_size(networktestfilename) != appended_size + new_network.layers[1].biases.size() * sizeof(float) + index_size(metadata)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: append_network: more than the changed block was appended.\n";return false;}
+    if (!matches(NeuralNetwork::load_network(networktestfilename))) {std::cerr << "\033[31m[ ERROR ]\033[0m network: append_network: loaded network doesn't match after a changed append.\n";return false;}
+
+    // Half a segment, as if the process died mid-append
+    appended_size = fs::file_size(networktestfilename);
+    {
+        std::ofstream torn(networktestfilename, std::ios::binary | std::ios::app);
+        std::vector<float> garbage(37, 1.0f);
+        torn.write(reinterpret_cast<const char*>(garbage.data()), garbage.size() * sizeof(float));
+    }
+    file.open(networktestfilename, std::ios::in | std::ios::binary);
+    metadata = NeuralNetwork::read_metadata(file);
+    file.close();
+    if (metadata.end != appended_size) {std::cerr << "\033[31m[ ERROR ]\033[0m network: append_network: unfinished append wasn't skipped.\n";return false;}
+    new_network.layers[0].weights[0] = -0.25f;
+    NeuralNetwork::append_network(networktestfilename, new_network);
+    if (!matches(NeuralNetwork::load_network(networktestfilename))) {std::cerr << "\033[31m[ ERROR ]\033[0m network: append_network: loaded network doesn't match after appending over an unfinished append.\n";return false;}
+
+    NeuralNetwork::compact_network(networktestfilename);
+    file.open(networktestfilename, std::ios::in | std::ios::binary);
+    metadata = NeuralNetwork::read_metadata(file);
+    file.close();
+    if (metadata.version != 2 || fs::file_size(networktestfilename) != saved_size) {std::cerr << "\033[31m[ ERROR ]\033[0m network: append_network: compacted file isn't a plain v2 file.\n";return false;}
+    if (!matches(NeuralNetwork::load_network(networktestfilename))) {std::cerr << "\033[31m[ ERROR ]\033[0m network: append_network: loaded network doesn't match after compacting.\n";return false;}
+
+    return true;
+}
+
+bool diff_network() {
+    using activation = NeuralNetwork::activation_type;
+    char newfilename[] = "network_test_file_new.binary";
+    char deltafilename[] = "network_test_file.delta";
+    char patchedfilename[] = "network_test_file_patched.binary";
+
+    NeuralNetwork::network old_network = NeuralNetwork::create_network({16, 32, 4}, {activation::tanh, activation::softmax}, 3);
+    NeuralNetwork::save_network(networktestfilename, old_network);
+
+    /* Expected results:
+    a delta for a fine-tuned network is smaller than the new file, a delta for one changed bias block is tiny
+    patching the old file with the delta gives back the new file byte for byte
+    patching a file the delta wasn't made from fails and writes nothing
+    */
+    auto read_file = [](const char* location) {
+        std::ifstream file(location, std::ios::binary);
+        return std::vector<char>((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    };
+    auto cleanup = [&]() {
+        for (const char* location : {newfilename, deltafilename, patchedfilename}) fs::remove(location);
+    };
+
+    NeuralNetwork::dataset data;
+    data.input_size = 16;
+    data.output_size = 4;
+    for (uint32_t i = 0; i < 8; i++) {
+        for (uint32_t j = 0; j < 16; j++) data.inputs.push_back(static_cast<float>((i * 7 + j * 3) % 5) * 0.2f);
+        for (uint32_t j = 0; j < 4; j++) data.outputs.push_back((i % 4 == j) ? 1.0f : 0.0f);
+    }
+    NeuralNetwork::network tuned_network = old_network;
+    tuned_network.optimizer.learning_rate = 1e-3f;
+    NeuralNetwork::train_network(tuned_network, data, 1, 8);
+    NeuralNetwork::save_network(newfilename, tuned_network);
+    NeuralNetwork::diff_network(networktestfilename, newfilename, deltafilename);
+    if (!fs::exists(deltafilename) || fs::file_size(deltafilename) >= fs::file_size(newfilename)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: diff_network: fine-tuned delta isn't smaller than the new file.\n";cleanup();return false;}
+    NeuralNetwork::patch_network(networktestfilename, deltafilename, patchedfilename);
+    if (read_file(patchedfilename) != read_file(newfilename)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: diff_network: patched file doesn't match the fine-tuned file.\n";cleanup();return false;}
+
+    NeuralNetwork::network changed_network = old_network;
+    changed_network.layers[1].biases[1] = 0.75f;
+    NeuralNetwork::save_network(newfilename, changed_network);
+    NeuralNetwork::diff_network(networktestfilename, newfilename, deltafilename);
+    if (fs::file_size(deltafilename) * 4 >= fs::file_size(newfilename)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: diff_network: delta of one changed bias isn't small.\n";cleanup();return false;}
+    NeuralNetwork::patch_network(networktestfilename, deltafilename, patchedfilename);
+    if (read_file(patchedfilename) != read_file(newfilename)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: diff_network: patched file doesn't match the changed file.\n";cleanup();return false;}
+
+    fs::remove(patchedfilename);
+    NeuralNetwork::patch_network(newfilename, deltafilename, patchedfilename);
+    if (fs::exists(patchedfilename)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: diff_network: a delta was applied to the wrong file.\n";cleanup();return false;}
+
+    cleanup();
+    return true;
+}
+
+bool model_handle() {
+    using activation = NeuralNetwork::activation_type;
+    NeuralNetwork::network first = NeuralNetwork::create_network({8, 16, 4}, {activation::tanh, activation::softmax}, 21);
+    NeuralNetwork::network second = NeuralNetwork::create_network({8, 16, 4}, {activation::tanh, activation::softmax}, 22);
+    std::vector<float> inputs = {0.1f, -0.2f, 0.3f, -0.4f, 0.5f, -0.6f, 0.7f, -0.8f};
+    std::vector<float> first_outputs = NeuralNetwork::forward_pass(first, inputs).outputs;
+    std::vector<float> second_outputs = NeuralNetwork::forward_pass(second, inputs).outputs;
+
+    /* Expected results:
+    a snapshot keeps its version alive after a newer one is published, and the version is freed once the snapshot is dropped
+    readers running while versions are swapped only ever see one of the published networks
+    */
+    NeuralNetwork::model_handle handle(first);
+    NeuralNetwork::model_handle::snapshot held = handle.acquire();
+    std::weak_ptr<const NeuralNetwork::network> watched = held;
+    handle.publish(second);
+    if (NeuralNetwork::forward_pass(*held, inputs).outputs != first_outputs) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_handle: held snapshot changed under its reader.\n";return false;}
+    if (NeuralNetwork::forward_pass(*handle.acquire(), inputs).outputs != second_outputs) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_handle: new version wasn't published.\n";return false;}
+    held.reset();
+    if (!watched.expired()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_handle: old version wasn't freed after its last snapshot.\n";return false;}
+
+    std::atomic<bool> running{true}, torn{false};
+    std::vector<std::thread> readers;
+    for (int r = 0; r < 4; r++) {
+        readers.emplace_back([&]() {
+            while (running) {
+                std::vector<float> outputs = NeuralNetwork::forward_pass(*handle.acquire(), inputs).outputs;
+                if (outputs != first_outputs && outputs != second_outputs) torn = true;
+            }
+        });
+    }
+    for (int i = 0; i < 200; i++) handle.publish((i % 2 == 0) ? first : second);
+    running = false;
+    for (std::thread& reader : readers) reader.join();
+    if (torn) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_handle: a reader saw a network that was never published.\n";return false;}
+    if (handle.version() != 202) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_handle: version count is wrong.\n";return false;}
+
+    return true;
+}
+
+bool model_registry() {
+    using activation = NeuralNetwork::activation_type;
+    char secondfilename[] = "network_test_file_second.binary";
+    char relativefilename[] = "./network_test_file.binary";
+    NeuralNetwork::network first = NeuralNetwork::create_network({8, 16, 4}, {activation::tanh, activation::softmax}, 31);
+    NeuralNetwork::network second = NeuralNetwork::create_network({8, 16, 4}, {activation::relu, activation::softmax}, 32);
+    NeuralNetwork::save_network(networktestfilename, first);
+    NeuralNetwork::save_network(secondfilename, second);
+
+    /* Expected results:
+    the first get is a miss, the next gets of the same file are hits, even through a different path to it
+    a budget of one model evicts the least recently used model, which its snapshots keep alive
+    a file replaced on disk is loaded again
+    */
+    NeuralNetwork::model_registry registry(UINT64_MAX);
+    NeuralNetwork::model_handle::snapshot loaded = registry.get(networktestfilename);
+    if (!loaded || loaded->layers[0].weights != first.layers[0].weights) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_registry: model wasn't loaded.\n";fs::remove(secondfilename);return false;}
+    if (registry.get(networktestfilename) != loaded || registry.get(relativefilename) != loaded) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_registry: the same file wasn't shared.\n";fs::remove(secondfilename);return false;}
+    NeuralNetwork::registry_counters counters = registry.counters();
+    if (counters.misses != 1 || counters.hits != 2 || counters.models != 1) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_registry: hit and miss counters are wrong.\n";fs::remove(secondfilename);return false;}
+
+    registry.set_budget(counters.bytes);
+    registry.get(secondfilename);
+    counters = registry.counters();
+    if (counters.evictions != 1 || counters.models != 1 || loaded->layers[0].weights != first.layers[0].weights) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_registry: least recently used model wasn't evicted.\n";fs::remove(secondfilename);return false;}
+    registry.get(secondfilename);
+    if (registry.counters().hits != 3) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_registry: most recently used model was evicted.\n";fs::remove(secondfilename);return false;}
+
+    NeuralNetwork::save_network(secondfilename, first);
+    NeuralNetwork::model_handle::snapshot replaced = registry.get(secondfilename);
+    if (!replaced || replaced->layers[0].weights != first.layers[0].weights) {std::cerr << "\033[31m[ ERROR ]\033[0m network: model_registry: a replaced file was served stale.\n";fs::remove(secondfilename);return false;}
+
+    fs::remove(secondfilename);
+    return true;
+}
+
+bool load_dataset() {
+    char datasetfilename[] = "network_test_file.csv";
+    {
+        std::ofstream file(datasetfilename);
+        file << "x1,x2,y1,y2\r\n0,1,1,0\r\n\r\n0.5, -2 ,0,1\r\n";
+    }
+
+    /* Expected data:
+    the header row and blank lines are skipped, 2 rows of 2 inputs and 2 outputs, carriage returns and spaces are ignored
+    a row with the wrong amount of values fails the whole load
+    */
+    NeuralNetwork::dataset data = NeuralNetwork::load_dataset(datasetfilename, 2);
+    if (data.input_size != 2 || data.output_size != 2 || data.inputs != std::vector<float>{0.0f, 1.0f, 0.5f, -2.0f} || data.outputs != std::vector<float>{1.0f, 0.0f, 0.0f, 1.0f}) {std::cerr << "\033[31m[ ERROR ]\033[0m network: load_dataset: rows weren't read as expected.\n";fs::remove(datasetfilename);return false;}
+
+    {
+        std::ofstream file(datasetfilename, std::ios::app);
+        file << "1,2,3\n";
+    }
+    if (!NeuralNetwork::load_dataset(datasetfilename, 2).inputs.empty()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: load_dataset: a short row was accepted.\n";fs::remove(datasetfilename);return false;}
+
+    fs::remove(datasetfilename);
+    return true;
+}
+
+bool ring_training() {
+    using activation = NeuralNetwork::activation_type;
+    const uint32_t workers = 3;
+    std::vector<std::string> hosts(workers, "127.0.0.1");
+    std::random_device device;
+    uint16_t base_port = static_cast<uint16_t>(20000 + device() % 30000);
+
+    /* Expected results:
+    all_reduce leaves every worker with the element-wise sum, bit for bit the same on every worker
+    3 workers training on a third of the rows each stay identical, and match one process training on the same global batches
+    with 14 rows the first two workers take the 2 left over rows, and still match one process training on the same global batches
+    an embedding network with Adam and weight decay matches one process too, and rows no worker looked up stay bit for bit the same
+    */
+    std::vector<std::vector<float>> reduced(workers);
+    std::vector<NeuralNetwork::network> trained(workers), uneven_trained(workers), embedded_trained(workers);
+    std::vector<float> losses(workers), uneven_losses(workers), embedded_losses(workers);
+    std::atomic<bool> connected{true};
+
+    NeuralNetwork::dataset data;
+    data.input_size = 2;
+    data.output_size = 2;
+    for (uint32_t i = 0; i < 12; i++) {
+        float a = static_cast<float>(i % 4) / 3.0f, b = static_cast<float>((i * 5) % 7) / 6.0f;
+        data.inputs.insert(data.inputs.end(), {a, b});
+        data.outputs.insert(data.outputs.end(), {(a > b) ? 1.0f : 0.0f, (a > b) ? 0.0f : 1.0f});
+    }
+    NeuralNetwork::network initial = NeuralNetwork::create_network({2, 6, 2}, {activation::tanh, activation::softmax}, 17);
+    initial.optimizer.type = NeuralNetwork::optimizer_type::adam;
+    initial.optimizer.learning_rate = 0.05f;
+    // Ids only come from [0, 20) of a 50 row table
+    NeuralNetwork::dataset lookups;
+    lookups.input_size = 3;
+    lookups.output_size = 2;
+    for (uint32_t i = 0; i < 12; i++) {
+        uint32_t id = (i * 7) % 20;
+        lookups.inputs.insert(lookups.inputs.end(), {static_cast<float>(id), static_cast<float>((i * 3) % 20), static_cast<float>(i % 3) / 2.0f});
+        lookups.outputs.insert(lookups.outputs.end(), {(id % 2 == 0) ? 1.0f : 0.0f, (id % 2 == 0) ? 0.0f : 1.0f});
+    }
+    NeuralNetwork::embedding lookup;
+    lookup.categories = 50; lookup.dimensions = 3; lookup.fields = 2; lookup.features = 1;
+    NeuralNetwork::network embedded = NeuralNetwork::create_network(lookup, {5, 2}, {activation::tanh, activation::softmax}, 17);
+    embedded.optimizer.type = NeuralNetwork::optimizer_type::adam;
+    embedded.optimizer.learning_rate = 0.05f;
+    embedded.optimizer.weight_decay = 0.01f;
+    NeuralNetwork::dataset uneven = data;
+    uneven.inputs.insert(uneven.inputs.end(), {0.25f, 0.75f, 0.5f, 0.125f});
+    uneven.outputs.insert(uneven.outputs.end(), {0.0f, 1.0f, 1.0f, 0.0f});
+
+    std::vector<std::thread> threads;
+    for (uint32_t rank = 0; rank < workers; rank++) {
+        threads.emplace_back([&, rank]() {
+            NeuralNetwork::ring ring;
+            if (!ring.connect(rank, hosts, base_port, 10.0)) {connected = false;return;}
+            reduced[rank].resize(1001);
+            for (size_t i = 0; i < reduced[rank].size(); i++) reduced[rank][i] = static_cast<float>((rank + 1) * i) * 0.5f;
+            if (!ring.all_reduce(reduced[rank].data(), reduced[rank].size())) {connected = false;return;}
+
+            trained[rank] = initial;
+            losses[rank] = NeuralNetwork::train_network(trained[rank], data, 10, 2, ring);
+            uneven_trained[rank] = initial;
+            uneven_losses[rank] = NeuralNetwork::train_network(uneven_trained[rank], uneven, 10, 2, ring);
+            embedded_trained[rank] = embedded;
+            embedded_losses[rank] = NeuralNetwork::train_network(embedded_trained[rank], lookups, 10, 2, ring);
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+    if (!connected) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: workers failed to connect over loopback.\n";return false;}
+
+    for (uint32_t rank = 0; rank < workers; rank++) {
+        for (size_t i = 0; i < reduced[rank].size(); i++) {
+            if (reduced[rank][i] != static_cast<float>(6 * i) * 0.5f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: worker " << rank << "'s sum " << i << " is wrong.\n";return false;}
+        }
+        if (trained[rank].layers[0].weights != trained[0].layers[0].weights || trained[rank].layers[1].biases != trained[0].layers[1].biases || losses[rank] != losses[0]) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: worker " << rank << " drifted from worker 0.\n";return false;}
+        if (uneven_trained[rank].layers[0].weights != uneven_trained[0].layers[0].weights || uneven_losses[rank] != uneven_losses[0]) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: worker " << rank << " drifted from worker 0 with uneven shares.\n";return false;}
+        if (embedded_trained[rank].layers[0].weights != embedded_trained[0].layers[0].weights || embedded_losses[rank] != embedded_losses[0]) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: worker " << rank << " drifted from worker 0 with an embedding.\n";return false;}
+    }
+
+    // The same global batches in one process: 2 rows from each worker's third of the rows per step
+    NeuralNetwork::dataset global = data;
+    global.inputs.clear();
+    global.outputs.clear();
+    for (uint32_t step = 0; step < 2; step++) {
+        for (uint32_t rank = 0; rank < workers; rank++) {
+            for (uint32_t row = rank * 4 + step * 2; row < rank * 4 + step * 2 + 2; row++) {
+                global.inputs.insert(global.inputs.end(), data.inputs.begin() + row * 2, data.inputs.begin() + row * 2 + 2);
+                global.outputs.insert(global.outputs.end(), data.outputs.begin() + row * 2, data.outputs.begin() + row * 2 + 2);
+            }
+        }
+    }
+    NeuralNetwork::network single = initial;
+    float single_loss = NeuralNetwork::train_network(single, global, 10, 6);
+    for (size_t l = 0; l < 2; l++) {
+        for (size_t i = 0; i < single.layers[l].weights.size(); i++) {
+            if (std::fabs(single.layers[l].weights[i] - trained[0].layers[l].weights[i]) > 1e-4f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: distributed training doesn't match single process training.\n";return false;}
+        }
+    }
+    if (std::fabs(single_loss - losses[0]) > 1e-4f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: distributed loss doesn't match single process loss.\n";return false;}
+
+    // Shares of 5, 5 and 4 rows take 3 steps, the last one has a row from each of the first two workers only
+    global.inputs.clear();
+    global.outputs.clear();
+    const uint32_t share_first[] = {0, 5, 10}, share_rows[] = {5, 5, 4};
+    for (uint32_t step = 0; step < 3; step++) {
+        for (uint32_t rank = 0; rank < workers; rank++) {
+            for (uint32_t row = share_first[rank] + step * 2; row < share_first[rank] + std::min(step * 2 + 2, share_rows[rank]); row++) {
+                global.inputs.insert(global.inputs.end(), uneven.inputs.begin() + row * 2, uneven.inputs.begin() + row * 2 + 2);
+                global.outputs.insert(global.outputs.end(), uneven.outputs.begin() + row * 2, uneven.outputs.begin() + row * 2 + 2);
+            }
+        }
+    }
+    single = initial;
+    single_loss = NeuralNetwork::train_network(single, global, 10, 6);
+    for (size_t l = 0; l < 2; l++) {
+        for (size_t i = 0; i < single.layers[l].weights.size(); i++) {
+            if (std::fabs(single.layers[l].weights[i] - uneven_trained[0].layers[l].weights[i]) > 1e-4f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: uneven distributed training doesn't match single process training.\n";return false;}
+        }
+    }
+    if (std::fabs(single_loss - uneven_losses[0]) > 1e-4f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: uneven distributed loss doesn't match single process loss.\n";return false;}
+
+    // The embedding network's global batches are laid out like the first case's
+    global = lookups;
+    global.inputs.clear();
+    global.outputs.clear();
+    for (uint32_t step = 0; step < 2; step++) {
+        for (uint32_t rank = 0; rank < workers; rank++) {
+            for (uint32_t row = rank * 4 + step * 2; row < rank * 4 + step * 2 + 2; row++) {
+                global.inputs.insert(global.inputs.end(), lookups.inputs.begin() + row * 3, lookups.inputs.begin() + row * 3 + 3);
+                global.outputs.insert(global.outputs.end(), lookups.outputs.begin() + row * 2, lookups.outputs.begin() + row * 2 + 2);
+            }
+        }
+    }
+    single = embedded;
+    single_loss = NeuralNetwork::train_network(single, global, 10, 6);
+    for (size_t l = 0; l < 3; l++) {
+        for (size_t i = 0; i < single.layers[l].weights.size(); i++) {
+            if (std::fabs(single.layers[l].weights[i] - embedded_trained[0].layers[l].weights[i]) > 1e-4f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: distributed embedding training doesn't match single process training.\n";return false;}
+        }
+    }
+    if (std::fabs(single_loss - embedded_losses[0]) > 1e-4f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: distributed embedding loss doesn't match single process loss.\n";return false;}
+    if (!std::equal(embedded_trained[0].layers[0].weights.begin() + 20 * 3, embedded_trained[0].layers[0].weights.end(), embedded.layers[0].weights.begin() + 20 * 3)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: ring_training: rows no worker looked up changed.\n";return false;}
+
+    return true;
+}
+
+bool pipeline_network() {
+    using activation = NeuralNetwork::activation_type;
+
+    /* Expected results:
+    a 6 layer network split into 3 stages gives the same outputs as forward_pass, row for row
+    training through the pipeline gives bit for bit the same weights and loss as train_network
+    the same stage threads and queues keep serving forward passes after training
+    */
+    NeuralNetwork::network initial = NeuralNetwork::create_network({3, 8, 8, 8, 8, 8, 2}, {activation::relu, activation::tanh, activation::relu, activation::tanh, activation::relu, activation::softmax}, 23);
+    initial.optimizer.type = NeuralNetwork::optimizer_type::momentum;
+    initial.optimizer.learning_rate = 0.05f;
+
+    NeuralNetwork::dataset data;
+    data.input_size = 3;
+    data.output_size = 2;
+    for (uint32_t i = 0; i < 13; i++) {
+        float a = static_cast<float>(i % 5) / 4.0f, b = static_cast<float>((i * 3) % 7) / 6.0f, c = static_cast<float>(i) / 12.0f;
+        data.inputs.insert(data.inputs.end(), {a, b, c});
+        data.outputs.insert(data.outputs.end(), {(a + c > b) ? 1.0f : 0.0f, (a + c > b) ? 0.0f : 1.0f});
+    }
+
+    NeuralNetwork::network piped = initial;
+    NeuralNetwork::pipeline stages(piped, 3, 2);
+    if (stages.stage_count() != 3 || stages.boundaries().front() != 0 || stages.boundaries().back() != 6) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pipeline_network: layers were not split into 3 stages.\n";return false;}
+
+    std::vector<float> outputs = stages.forward(data.inputs);
+    if (outputs.size() != 13 * 2) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pipeline_network: wrong amount of outputs.\n";return false;}
+    for (size_t row = 0; row < 13; row++) {
+        NeuralNetwork::output expected = NeuralNetwork::forward_pass(initial, std::vector<float>(data.inputs.begin() + row * 3, data.inputs.begin() + row * 3 + 3));
+        if (!std::equal(expected.activations.end() - 2, expected.activations.end(), outputs.begin() + row * 2)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pipeline_network: row " << row << "'s outputs don't match forward_pass.\n";return false;}
+    }
+
+    NeuralNetwork::network single = initial;
+    float single_loss = NeuralNetwork::train_network(single, data, 4, 5);
+    float piped_loss = stages.train(data, 4, 5);
+    for (size_t l = 0; l < single.layers.size(); l++) {
+        if (single.layers[l].weights != piped.layers[l].weights || single.layers[l].biases != piped.layers[l].biases) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pipeline_network: layer " << l << " doesn't match train_network.\n";return false;}
+    }
+    if (single_loss != piped_loss) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pipeline_network: loss doesn't match train_network.\n";return false;}
+
+    outputs = stages.forward(data.inputs);
+    for (size_t row = 0; row < 13; row++) {
+        NeuralNetwork::output expected = NeuralNetwork::forward_pass(single, std::vector<float>(data.inputs.begin() + row * 3, data.inputs.begin() + row * 3 + 3));
+        if (!std::equal(expected.activations.end() - 2, expected.activations.end(), outputs.begin() + row * 2)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pipeline_network: row " << row << "'s outputs don't match forward_pass after training.\n";return false;}
+    }
+
+    return true;
+}
+
+bool numa_replicas() {
+    using activation = NeuralNetwork::activation_type;
+
+    /* Expected results:
+    there is at least one NUMA node, and one replica per node
+    every replica holds the same weights as the network it was made from
+    replicated inference gives the same outputs as forward_pass, row for row
+    */
+    NeuralNetwork::network initial = NeuralNetwork::create_network({4, 16, 16, 3}, {activation::relu, activation::tanh, activation::softmax}, 29);
+    NeuralNetwork::numa_replicas replicas(initial);
+    if (NeuralNetwork::numa_node_count() == 0 || replicas.nodes() != NeuralNetwork::numa_node_count()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: numa_replicas: expected one replica per NUMA node.\n";return false;}
+    for (uint32_t node = 0; node < replicas.nodes(); node++) {
+        for (size_t l = 0; l < initial.layers.size(); l++) {
+            if (replicas.replica(node).layers[l].weights != initial.layers[l].weights) {std::cerr << "\033[31m[ ERROR ]\033[0m network: numa_replicas: node " << node << "'s replica differs.\n";return false;}
+        }
+    }
+    if (replicas.local().layers.size() != initial.layers.size()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: numa_replicas: local replica is wrong.\n";return false;}
+
+    std::vector<float> inputs;
+    for (uint32_t i = 0; i < 100 * 4; i++) inputs.push_back(static_cast<float>((i * 7) % 11) / 10.0f);
+    std::vector<float> outputs = replicas.forward(inputs);
+    if (outputs.size() != 100 * 3) {std::cerr << "\033[31m[ ERROR ]\033[0m network: numa_replicas: wrong amount of outputs.\n";return false;}
+    for (size_t row = 0; row < 100; row++) {
+        NeuralNetwork::output expected = NeuralNetwork::forward_pass(initial, std::vector<float>(inputs.begin() + row * 4, inputs.begin() + row * 4 + 4));
+        if (!std::equal(expected.activations.end() - 3, expected.activations.end(), outputs.begin() + row * 3)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: numa_replicas: row " << row << "'s outputs don't match forward_pass.\n";return false;}
+    }
+
+    return true;
+}
+
+bool convolution_network() {
+    using activation = NeuralNetwork::activation_type;
+    char convolutionfilename[] = "network_test_file_convolution.binary";
+
+    /* Expected results:
+    a 2 channel 5x5 input through 3 3x3 filters with stride 2 and padding 1 gives 3 3x3 outputs, matching a direct convolution
+    a width 8 Conv1D layer is recognized as Conv1D and padded along its width only
+    packed convolutions give the same outputs as unpacked ones
+    backpropagated gradients match finite differences, through two convolutions
+    saving and loading keeps every shape and output
+    */
+    NeuralNetwork::convolution first;
+    first.channels = 2; first.height = 5; first.width = 5;
+    first.filters = 3; first.kernel_height = 3; first.kernel_width = 3;
+    first.stride = 2; first.padding = 1;
+    NeuralNetwork::convolution second;
+    second.channels = 3; second.height = 3; second.width = 3;
+    second.filters = 2; second.kernel_height = 2; second.kernel_width = 2;
+    NeuralNetwork::network convolutional = NeuralNetwork::create_network({first, second}, {3}, {activation::tanh, activation::tanh, activation::softmax}, 31);
+    if (convolutional.layers.size() != 3 || convolutional.layers[0].type != NeuralNetwork::layer_type::conv2d || convolutional.layers[0].output_size != 27 || convolutional.layers[1].output_size != 8 || convolutional.layers[2].input_size != 8) {std::cerr << "\033[31m[ ERROR ]\033[0m network: convolution_network: layer shapes aren't as expected.\n";return false;}
+
+    std::vector<float> inputs(50);
+    for (size_t i = 0; i < inputs.size(); i++) inputs[i] = static_cast<float>((i * 13) % 17) / 8.0f - 1.0f;
+    NeuralNetwork::output output = NeuralNetwork::forward_pass(convolutional, inputs);
+    const NeuralNetwork::layer& layer = convolutional.layers[0];
+    for (size_t f = 0; f < 3; f++) {
+        for (size_t oy = 0; oy < 3; oy++) {
+            for (size_t ox = 0; ox < 3; ox++) {
+                float expected = layer.biases[f];
+                for (size_t c = 0; c < 2; c++) {
+                    for (size_t ky = 0; ky < 3; ky++) {
+                        for (size_t kx = 0; kx < 3; kx++) {
+                            long y = static_cast<long>(oy * 2 + ky) - 1, x = static_cast<long>(ox * 2 + kx) - 1;
+                            if (y < 0 || y >= 5 || x < 0 || x >= 5) continue;
+                            expected += layer.weights[((f * 2 + c) * 3 + ky) * 3 + kx] * inputs[c * 25 + y * 5 + x];
+                        }
+                    }
+                }
+                if (std::fabs(output.pre_activations[f * 9 + oy * 3 + ox] - expected) > 1e-5f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: convolution_network: outputs don't match a direct convolution.\n";return false;}
+            }
+        }
+    }
+
+    NeuralNetwork::convolution signal;
+    signal.width = 8; signal.filters = 2; signal.kernel_width = 3; signal.padding = 1;
+    NeuralNetwork::network one_dimensional = NeuralNetwork::create_network({signal}, {2}, {}, 7);
+    if (one_dimensional.layers[0].type != NeuralNetwork::layer_type::conv1d || one_dimensional.layers[0].output_size != 16) {std::cerr << "\033[31m[ ERROR ]\033[0m network: convolution_network: Conv1D layer isn't as expected.\n";return false;}
+
+    NeuralNetwork::network packed = convolutional;
+    NeuralNetwork::prepack_network(packed);
+    NeuralNetwork::output packed_output = NeuralNetwork::forward_pass(packed, inputs);
+    if (packed.layers[0].packed.empty()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: convolution_network: convolution wasn't packed.\n";return false;}
+    for (size_t i = 0; i < output.activations.size(); i++) {
+        if (std::fabs(packed_output.activations[i] - output.activations[i]) > 1e-5f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: convolution_network: packed outputs don't match.\n";return false;}
+    }
+
+    // Central differences of the loss, in double so the check is limited by the forward pass's own rounding
+    std::vector<float> expected = {0.0f, 1.0f, 0.0f};
+    NeuralNetwork::backprop_averages gradients = NeuralNetwork::backpropagate(convolutional, inputs, output, expected);
+    for (size_t l = 0; l < 2; l++) {
+        for (size_t i = 0; i < convolutional.layers[l].weights.size(); i += 5) {
+            NeuralNetwork::network nudged = convolutional;
+            float weight = nudged.layers[l].weights[i];
+            nudged.layers[l].weights[i] = weight + 1e-2f;
+            double above = NeuralNetwork::loss(nudged, NeuralNetwork::forward_pass(nudged, inputs), expected);
+            nudged.layers[l].weights[i] = weight - 1e-2f;
+            double below = NeuralNetwork::loss(nudged, NeuralNetwork::forward_pass(nudged, inputs), expected);
+            double numeric = (above - below) / 2e-2;
+            if (std::fabs(numeric - gradients.weights[l][i]) > 2e-3 + 2e-2 * std::fabs(numeric)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: convolution_network: layer " << l << "'s gradient " << i << " is " << gradients.weights[l][i] << " instead of " << numeric << ".\n";return false;}
+        }
+    }
+
+    NeuralNetwork::save_network(convolutionfilename, convolutional);
+    NeuralNetwork::network loaded = NeuralNetwork::load_network(convolutionfilename);
+    fs::remove(convolutionfilename);
+    if (loaded.layers.size() != 3 || loaded.layers[0].type != NeuralNetwork::layer_type::conv2d || loaded.layers[0].shape.stride != 2 || loaded.layers[1].shape.kernel_width != 2 || loaded.layers[0].output_size != 27) {std::cerr << "\033[31m[ ERROR ]\033[0m network: convolution_network: loaded shapes aren't as expected.\n";return false;}
+    if (NeuralNetwork::forward_pass(loaded, inputs).activations != output.activations) {std::cerr << "\033[31m[ ERROR ]\033[0m network: convolution_network: loaded outputs don't match.\n";return false;}
+
+    return true;
+}
+
+bool embedding_network() {
+    using activation = NeuralNetwork::activation_type;
+    char embeddingfilename[] = "network_test_file_embedding.binary";
+
+    /* Expected results:
+    the embedding's outputs are each id's row plus the biases, followed by the plain features
+    ids that aren't whole numbers inside the table only get the biases
+    training only changes the rows that were looked up, every other row stays bit for bit the same, and the loss goes down
+    reseeding keeps the embedding, gives back the first weights for the network's own seed and new ones for other seeds, and reseeded runs train together as they do alone
+    saving and loading keeps the shape and the outputs
+    */
+    NeuralNetwork::embedding lookup;
+    lookup.categories = 1000; lookup.dimensions = 4; lookup.fields = 2; lookup.features = 1;
+    NeuralNetwork::network embedded = NeuralNetwork::create_network(lookup, {8, 2}, {activation::tanh, activation::softmax}, 37);
+    embedded.optimizer.type = NeuralNetwork::optimizer_type::adam;
+    embedded.optimizer.learning_rate = 0.05f;
+    if (embedded.layers.size() != 3 || embedded.layers[0].type != NeuralNetwork::layer_type::embedding || embedded.layers[0].input_size != 3 || embedded.layers[0].output_size != 9) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: layer shapes aren't as expected.\n";return false;}
+
+    const NeuralNetwork::layer& table = embedded.layers[0];
+    NeuralNetwork::output output = NeuralNetwork::forward_pass(embedded, {17.0f, 999.0f, 0.25f});
+    for (size_t d = 0; d < 4; d++) {
+        if (output.activations[d] != table.weights[17 * 4 + d] + table.biases[d] || output.activations[4 + d] != table.weights[999 * 4 + d] + table.biases[d]) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: looked up rows are wrong.\n";return false;}
+    }
+    if (output.activations[8] != 0.25f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: features weren't passed through.\n";return false;}
+    output = NeuralNetwork::forward_pass(embedded, {1000.0f, 2.5f, 0.0f});
+    for (size_t d = 0; d < 8; d++) {
+        if (output.activations[d] != table.biases[d % 4]) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: unknown ids should only get the biases.\n";return false;}
+    }
+
+    // The class is whether the first id is even, ids only come from [0, 40)
+    NeuralNetwork::dataset data;
+    data.input_size = 3;
+    data.output_size = 2;
+    for (uint32_t i = 0; i < 64; i++) {
+        uint32_t id = (i * 7) % 40;
+        data.inputs.insert(data.inputs.end(), {static_cast<float>(id), static_cast<float>((i * 3) % 40), static_cast<float>(i % 5) / 4.0f});
+        data.outputs.insert(data.outputs.end(), {(id % 2 == 0) ? 1.0f : 0.0f, (id % 2 == 0) ? 0.0f : 1.0f});
+    }
+    NeuralNetwork::network trained = embedded;
+    float first_loss = NeuralNetwork::train_network(trained, data, 1, 8);
+    float last_loss = NeuralNetwork::train_network(trained, data, 30, 8);
+    if (!(last_loss < first_loss)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: loss didn't go down.\n";return false;}
+    if (!std::equal(trained.layers[0].weights.begin() + 40 * 4, trained.layers[0].weights.end(), embedded.layers[0].weights.begin() + 40 * 4)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: rows that were never looked up changed.\n";return false;}
+    if (std::equal(trained.layers[0].weights.begin(), trained.layers[0].weights.begin() + 40 * 4, embedded.layers[0].weights.begin())) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: looked up rows didn't change.\n";return false;}
+
+    // Seeded sweep runs redraw the weights but keep the embedding, and reseeding with the network's own seed gives back its first weights
+    NeuralNetwork::network redrawn = trained;
+    NeuralNetwork::reseed_network(redrawn, 37);
+    if (redrawn.layers[0].weights != embedded.layers[0].weights || redrawn.layers[1].weights != embedded.layers[1].weights || redrawn.optimizer.type != NeuralNetwork::optimizer_type::adam || redrawn.optimizer.step != 0) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: reseeding with the network's seed didn't give back its weights.\n";return false;}
+    std::vector<NeuralNetwork::network> sweep, alone;
+    for (uint64_t seed : {2, 3}) {
+        NeuralNetwork::network run = embedded;
+        NeuralNetwork::reseed_network(run, seed);
+        if (run.layers.size() != 3 || run.layers[0].type != NeuralNetwork::layer_type::embedding || run.layers[0].lookup.categories != 1000 || run.layers[0].output_size != 9) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: reseeding changed the layers.\n";return false;}
+        if (run.layers[0].weights == embedded.layers[0].weights || (!sweep.empty() && run.layers[0].weights == sweep[0].layers[0].weights)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: seeds didn't give different weights.\n";return false;}
+        sweep.push_back(run);
+        alone.push_back(run);
+    }
+    std::vector<float> sweep_losses = NeuralNetwork::train_networks(sweep, data, 5, 8);
+    for (size_t r = 0; r < sweep.size(); r++) {
+        float loss = NeuralNetwork::train_network(alone[r], data, 5, 8);
+        if (sweep_losses.size() != sweep.size() || !(sweep_losses[r] == loss) || sweep[r].layers[0].weights != alone[r].layers[0].weights) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: reseeded runs trained together don't match training alone.\n";return false;}
+    }
+
+    NeuralNetwork::save_network(embeddingfilename, trained);
+    NeuralNetwork::network loaded = NeuralNetwork::load_network(embeddingfilename);
+    fs::remove(embeddingfilename);
+    if (loaded.layers.size() != 3 || loaded.layers[0].type != NeuralNetwork::layer_type::embedding || loaded.layers[0].lookup.categories != 1000 || loaded.layers[0].lookup.features != 1 || loaded.layers[0].output_size != 9) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: loaded shape isn't as expected.\n";return false;}
+    std::vector<float> inputs(data.inputs.begin(), data.inputs.begin() + 3);
+    if (NeuralNetwork::forward_pass(loaded, inputs).activations != NeuralNetwork::forward_pass(trained, inputs).activations) {std::cerr << "\033[31m[ ERROR ]\033[0m network: embedding_network: loaded outputs don't match.\n";return false;}
+
+    return true;
+}
+
+bool evaluate_network() {
+    using activation = NeuralNetwork::activation_type;
+    char evaluationfilename[] = "network_test_file_evaluation.csv";
+
+    /* Expected results:
+    accuracy and the confusion matrix match forward_pass row by row, and the loss matches the average of loss
+    the results are the same with one thread, and when streamed from a .csv file spanning more than one chunk
+    */
+    NeuralNetwork::network classifier = NeuralNetwork::create_network({2, 6, 3}, {activation::tanh, activation::softmax}, 41);
+    NeuralNetwork::dataset data;
+    data.input_size = 2;
+    data.output_size = 3;
+    for (uint32_t i = 0; i < 20000; i++) {
+        float a = static_cast<float>(i % 97) / 48.0f - 1.0f, b = static_cast<float>((i * 31) % 89) / 44.0f - 1.0f;
+        uint32_t label = (a > b) ? 0 : (a + b > 0.0f ? 1 : 2);
+        data.inputs.insert(data.inputs.end(), {a, b});
+        data.outputs.insert(data.outputs.end(), {label == 0 ? 1.0f : 0.0f, label == 1 ? 1.0f : 0.0f, label == 2 ? 1.0f : 0.0f});
+    }
+
+    std::vector<uint64_t> confusion(9, 0);
+    double loss_sum = 0.0;
+    uint64_t correct = 0;
+    for (size_t row = 0; row < 20000; row++) {
+        std::vector<float> expected(data.outputs.begin() + row * 3, data.outputs.begin() + row * 3 + 3);
+        NeuralNetwork::output output = NeuralNetwork::forward_pass(classifier, std::vector<float>(data.inputs.begin() + row * 2, data.inputs.begin() + row * 2 + 2));
+        loss_sum += NeuralNetwork::loss(classifier, output, expected);
+        size_t predicted = std::max_element(output.activations.end() - 3, output.activations.end()) - (output.activations.end() - 3);
+        size_t label = std::max_element(expected.begin(), expected.end()) - expected.begin();
+        confusion[label * 3 + predicted]++;
+        correct += label == predicted;
+    }
+
+    NeuralNetwork::evaluation result = NeuralNetwork::evaluate_network(classifier, data);
+    if (result.rows != 20000 || result.classes != 3 || result.confusion != confusion || result.accuracy != static_cast<double>(correct) / 20000) {std::cerr << "\033[31m[ ERROR ]\033[0m network: evaluate_network: accuracy or confusion matrix doesn't match forward_pass.\n";return false;}
+    if (std::fabs(result.loss - loss_sum / 20000) > 1e-9 * std::fabs(loss_sum / 20000)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: evaluate_network: loss doesn't match.\n";return false;}
+    for (uint32_t k = 0; k < 3; k++) {
+        double recall = static_cast<double>(confusion[k * 3 + k]) / (confusion[k * 3] + confusion[k * 3 + 1] + confusion[k * 3 + 2]);
+        if (std::fabs(result.recall[k] - recall) > 1e-12 || result.f1[k] < 0.0 || result.f1[k] > 1.0) {std::cerr << "\033[31m[ ERROR ]\033[0m network: evaluate_network: class " << k << "'s metrics are wrong.\n";return false;}
+    }
+
+    uint32_t threads = NeuralNetwork::thread_count();
+    NeuralNetwork::set_thread_count(1);
+    NeuralNetwork::evaluation single = NeuralNetwork::evaluate_network(classifier, data);
+    NeuralNetwork::set_thread_count(threads);
+    if (single.loss != result.loss || single.confusion != result.confusion) {std::cerr << "\033[31m[ ERROR ]\033[0m network: evaluate_network: results depend on the thread count.\n";return false;}
+
+    {
+        std::ofstream file(evaluationfilename);
+        file << "a,b,first,second,third\n";
+        for (size_t row = 0; row < 20000; row++) file << data.inputs[row * 2] << "," << data.inputs[row * 2 + 1] << "," << data.outputs[row * 3] << "," << data.outputs[row * 3 + 1] << "," << data.outputs[row * 3 + 2] << "\n";
+    }
+    NeuralNetwork::dataset parsed = NeuralNetwork::load_dataset(evaluationfilename, 2);
+    NeuralNetwork::evaluation streamed = NeuralNetwork::evaluate_network(classifier, evaluationfilename);
+    fs::remove(evaluationfilename);
+    NeuralNetwork::evaluation loaded = NeuralNetwork::evaluate_network(classifier, parsed);
+    if (streamed.rows != 20000 || streamed.loss != loaded.loss || streamed.confusion != loaded.confusion) {std::cerr << "\033[31m[ ERROR ]\033[0m network: evaluate_network: streamed results don't match.\n";return false;}
+
+    return true;
+}
+
+bool pmr_allocation() {
+    using activation = NeuralNetwork::activation_type;
+
+    /* Expected results:
+    forward passes, gradients and optimizer steps from a memory resource match the default ones bit for bit
+    every buffer, nested gradient buffers included, comes from the given resource, and the counters balance once they're freed
+    */
+    NeuralNetwork::network heap_network = NeuralNetwork::create_network({4, 8, 3}, {activation::tanh, activation::softmax}, 17);
+    heap_network.optimizer.type = NeuralNetwork::optimizer_type::adam;
+    NeuralNetwork::network arena_network = heap_network;
+    std::vector<float> inputs = {0.5f, -1.0f, 0.25f, 2.0f}, expected = {0.0f, 1.0f, 0.0f};
+
+    std::pmr::monotonic_buffer_resource arena;
+    NeuralNetwork::counting_resource counter(&arena);
+    {
+        NeuralNetwork::output heap_output = NeuralNetwork::forward_pass(heap_network, inputs);
+        NeuralNetwork::pmr::output arena_output = NeuralNetwork::forward_pass(arena_network, inputs, &counter);
+        if (!std::equal(heap_output.activations.begin(), heap_output.activations.end(), arena_output.activations.begin(), arena_output.activations.end()) || !std::equal(heap_output.outputs.begin(), heap_output.outputs.end(), arena_output.outputs.begin(), arena_output.outputs.end())) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pmr_allocation: forward pass doesn't match.\n";return false;}
+        if (NeuralNetwork::loss(heap_network, heap_output, expected) != NeuralNetwork::loss(arena_network, arena_output, expected)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pmr_allocation: loss doesn't match.\n";return false;}
+
+        NeuralNetwork::backprop_averages heap_gradients = NeuralNetwork::backpropagate(heap_network, inputs, heap_output, expected);
+        NeuralNetwork::pmr::backprop_averages arena_gradients = NeuralNetwork::backpropagate(arena_network, inputs, arena_output, expected, &counter);
+        if (arena_gradients.weights.size() != 2 || arena_gradients.weights[1].get_allocator().resource() != &counter || arena_gradients.rows[0].get_allocator().resource() != &counter) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pmr_allocation: gradient buffers don't come from the resource.\n";return false;}
+        for (size_t l = 0; l < 2; l++) {
+            if (!std::equal(heap_gradients.weights[l].begin(), heap_gradients.weights[l].end(), arena_gradients.weights[l].begin(), arena_gradients.weights[l].end())) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pmr_allocation: layer " << l << "'s gradients don't match.\n";return false;}
+        }
+
+        NeuralNetwork::apply_gradients(heap_network, heap_gradients);
+        NeuralNetwork::apply_gradients(arena_network, arena_gradients);
+        for (size_t l = 0; l < 2; l++) {
+            if (heap_network.layers[l].weights != arena_network.layers[l].weights || heap_network.layers[l].biases != arena_network.layers[l].biases) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pmr_allocation: optimizer steps don't match.\n";return false;}
+        }
+
+        NeuralNetwork::allocation_stats stats = counter.statistics();
+        if (stats.allocations == 0 || stats.bytes_in_use == 0 || stats.peak_bytes < stats.bytes_in_use || stats.bytes_allocated < (3 + 11 * 2) * sizeof(float)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pmr_allocation: allocations weren't counted.\n";return false;}
+    }
+    NeuralNetwork::allocation_stats stats = counter.statistics();
+    if (stats.bytes_in_use != 0 || stats.allocations != stats.deallocations) {std::cerr << "\033[31m[ ERROR ]\033[0m network: pmr_allocation: " << stats.allocations << " allocations but " << stats.deallocations << " deallocations.\n";return false;}
+
+    return true;
+}
+
+bool inference_cache() {
+    using activation = NeuralNetwork::activation_type;
+    NeuralNetwork::network classifier = NeuralNetwork::create_network({4, 8, 3}, {activation::relu, activation::softmax}, 23);
+    NeuralNetwork::inference_cache cache(1 << 20, 4);
+    std::vector<float> inputs = {0.5f, -1.0f, 0.25f, 2.0f};
+    std::vector<float> expected = NeuralNetwork::forward_pass(classifier, inputs).outputs;
+
+    /* Expected results:
+    the first forward is a miss and the second a hit, both with forward_pass's outputs, and another version is a miss
+    a small budget keeps the cache within it by evicting, and threads sharing the cache all get forward_pass's outputs
+    */
+    if (cache.forward(classifier, 1, inputs) != expected || cache.forward(classifier, 1, inputs) != expected) {std::cerr << "\033[31m[ ERROR ]\033[0m network: inference_cache: outputs don't match forward_pass.\n";return false;}
+    NeuralNetwork::cache_counters counters = cache.counters();
+    if (counters.hits != 1 || counters.misses != 1 || counters.entries != 1) {std::cerr << "\033[31m[ ERROR ]\033[0m network: inference_cache: " << counters.hits << " hits and " << counters.misses << " misses instead of 1 and 1.\n";return false;}
+    std::vector<float> outputs;
+    if (cache.lookup(2, inputs, outputs)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: inference_cache: another model version hit.\n";return false;}
+
+    cache.set_budget(2048);
+    for (uint32_t i = 0; i < 100; i++) cache.forward(classifier, 1, {static_cast<float>(i), 1.0f, 2.0f, 3.0f});
+    counters = cache.counters();
+    if (counters.bytes > 2048 || counters.evictions == 0 || counters.entries == 0) {std::cerr << "\033[31m[ ERROR ]\033[0m network: inference_cache: holds " << counters.bytes << " bytes over a 2048 byte budget.\n";return false;}
+
+    cache.set_budget(1 << 20);
+    cache.clear();
+    std::vector<std::vector<float>> rows, results;
+    for (uint32_t i = 0; i < 32; i++) {
+        rows.push_back({static_cast<float>(i) / 8.0f, -1.0f, static_cast<float>(i % 3), 0.5f});
+        results.push_back(NeuralNetwork::forward_pass(classifier, rows.back()).outputs);
+    }
+    std::atomic<bool> matching{true};
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < 4; t++) {
+        threads.emplace_back([&, t]() {
+            for (uint32_t i = 0; i < 1000; i++) {
+                size_t row = (i * 7 + t) % rows.size();
+                if (cache.forward(classifier, 3, rows[row]) != results[row]) matching = false;
+            }
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+    counters = cache.counters();
+    if (!matching) {std::cerr << "\033[31m[ ERROR ]\033[0m network: inference_cache: a thread got outputs that don't match forward_pass.\n";return false;}
+    if (counters.hits + counters.misses != 1 + 1 + 1 + 100 + 4000 || counters.entries != rows.size() || counters.hits < 4000 - 4 * rows.size()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: inference_cache: counters don't add up after the threads.\n";return false;}
+
+    return true;
+}
+
+bool tune_network() {
+    using activation = NeuralNetwork::activation_type;
+    char tunedfilename[] = "network_test_file_tuned.binary";
+    NeuralNetwork::network tuned = NeuralNetwork::create_network({48, 96, 16}, {activation::tanh, activation::softmax}, 29);
+    std::vector<float> inputs(48);
+    for (size_t i = 0; i < inputs.size(); i++) inputs[i] = static_cast<float>(i % 7) / 3.0f - 1.0f;
+    std::vector<float> expected = NeuralNetwork::forward_pass(tuned, inputs).outputs;
+
+    /* Expected results:
+    every layer gets a plan that's applied to it, and the outputs stay the same up to rounding
+    splitting a layer over more threads gives the same outputs bit for bit
+    the plan is saved in the config data and applied again by load_network
+    */
+    std::vector<NeuralNetwork::layer_plan> plans = NeuralNetwork::tune_network(tuned, 0.0005);
+    if (plans.size() != 2) {std::cerr << "\033[31m[ ERROR ]\033[0m network: tune_network: " << plans.size() << " plans for 2 layers.\n";return false;}
+    for (size_t l = 0; l < 2; l++) {
+        const NeuralNetwork::layer& layer = tuned.layers[l];
+        if (plans[l].seconds <= 0.0 || plans[l].baseline <= 0.0 || plans[l].threads == 0) {std::cerr << "\033[31m[ ERROR ]\033[0m network: tune_network: layer " << l << " wasn't timed.\n";return false;}
+        if (layer.panel_width != plans[l].panel_width || layer.k_block != plans[l].k_block || layer.threads != plans[l].threads || layer.packed.empty() != (plans[l].panel_width == 0)) {std::cerr << "\033[31m[ ERROR ]\033[0m network: tune_network: layer " << l << " doesn't follow its plan.\n";return false;}
+    }
+    std::vector<float> outputs = NeuralNetwork::forward_pass(tuned, inputs).outputs;
+    for (size_t i = 0; i < expected.size(); i++) {
+        if (std::fabs(outputs[i] - expected[i]) > 1e-5f) {std::cerr << "\033[31m[ ERROR ]\033[0m network: tune_network: outputs changed after tuning.\n";return false;}
+    }
+
+    uint32_t threads = NeuralNetwork::thread_count();
+    NeuralNetwork::set_thread_count(4);
+    NeuralNetwork::network split = tuned;
+    for (NeuralNetwork::layer& layer : split.layers) layer.threads = 4;
+    std::vector<float> split_outputs = NeuralNetwork::forward_pass(split, inputs).outputs;
+    NeuralNetwork::set_thread_count(threads);
+    if (split_outputs != outputs) {std::cerr << "\033[31m[ ERROR ]\033[0m network: tune_network: outputs depend on the layers' thread counts.\n";return false;}
+
+    NeuralNetwork::save_network(tunedfilename, tuned);
+    NeuralNetwork::network loaded = NeuralNetwork::load_network(tunedfilename);
+    fs::remove(tunedfilename);
+    if (NeuralNetwork::read_config_record(loaded.config_data, NeuralNetwork::config_tuning).size() != 6) {std::cerr << "\033[31m[ ERROR ]\033[0m network: tune_network: tuning record wasn't saved.\n";return false;}
+    for (size_t l = 0; l < 2; l++) {
+        if (loaded.layers[l].panel_width != plans[l].panel_width || loaded.layers[l].threads != plans[l].threads) {std::cerr << "\033[31m[ ERROR ]\033[0m network: tune_network: load_network didn't apply layer " << l << "'s plan.\n";return false;}
+    }
+    if (NeuralNetwork::forward_pass(loaded, inputs).outputs != outputs) {std::cerr << "\033[31m[ ERROR ]\033[0m network: tune_network: loaded outputs don't match.\n";return false;}
+
+    return true;
+}
+
+bool compile_network() {
+    using activation = NeuralNetwork::activation_type;
+    char compiledfilename[] = "network_test_file_compiled.h";
+    const char* driverfilename = "network_test_file_compiled.cpp";
+    const char* resultsfilename = "network_test_file_compiled.txt";
+    NeuralNetwork::network compiled = NeuralNetwork::create_network({19, 24, 11, 6}, {activation::tanh, activation::relu, activation::softmax}, 37);
+    NeuralNetwork::network packed = compiled;
+    NeuralNetwork::pack_layer(packed.layers[0], 8, 16);
+    NeuralNetwork::pack_layer(packed.layers[1], 4, 7);
+    std::vector<float> inputs(19);
+    for (size_t i = 0; i < inputs.size(); i++) inputs[i] = static_cast<float>((i * 5) % 11) / 4.0f - 1.25f;
+
+    /* Expected results:
+    the header is written with the network's sizes, and compiles on its own
+    the compiled forward gives forward_pass's outputs bit for bit, for unpacked and packed layers
+    convolutions and non-finite weights are rejected before anything is written, an existing header stays as it was
+    */
+    for (const NeuralNetwork::network* network : {&compiled, &packed}) {
+        NeuralNetwork::compile_network(compiledfilename, *network, "compiled test");
+        std::ifstream header(compiledfilename);
+        std::string text((std::istreambuf_iterator<char>(header)), std::istreambuf_iterator<char>());
+        header.close();
+        if (text.find("namespace compiled_test {") == std::string::npos || text.find("input_size = 19;") == std::string::npos || text.find("output_size = 6;") == std::string::npos) {std::cerr << "\033[31m[ ERROR ]\033[0m network: compile_network: header is missing its namespace or sizes.\n";return false;}
+
+        // The header can only be built where a compiler is installed
+        if (std::system("g++ --version > /dev/null 2>&1") != 0) continue;
+        std::ofstream driver(driverfilename);
+        driver << "#include \"" << compiledfilename << "\"\n#include <cstdio>\n\nint main() {\n    float inputs[] = {";
+        for (float value : inputs) driver << std::hexfloat << value << "f, ";
+        driver << "};\n    float outputs[compiled_test::output_size];\n    compiled_test::forward(inputs, outputs);\n";
+        driver << "    for (float value : outputs) {\n        std::uint32_t bits;\n        std::memcpy(&bits, &value, sizeof(bits));\n        std::printf(\"%u\\n\", bits);\n    }\n}\n";
+        driver.close();
+        std::string command = std::string("g++ -std=c++17 -O2 -Wall -Wextra -Werror ") + driverfilename + " -o network_test_file_compiled && ./network_test_file_compiled > " + resultsfilename;
+        bool built = std::system(command.c_str()) == 0;
+        std::ifstream results(resultsfilename);
+        std::vector<uint32_t> bits((std::istream_iterator<uint32_t>(results)), std::istream_iterator<uint32_t>());
+        results.close();
+        fs::remove(driverfilename);
+        fs::remove(resultsfilename);
+        fs::remove("network_test_file_compiled");
+        if (!built) {std::cerr << "\033[31m[ ERROR ]\033[0m network: compile_network: generated header doesn't compile.\n";return false;}
+
+        std::vector<float> expected = NeuralNetwork::forward_pass(*network, inputs).outputs;
+        bool matching = bits.size() == expected.size();
+        for (size_t i = 0; matching && i < expected.size(); i++) {
+            uint32_t expected_bits;
+            std::memcpy(&expected_bits, &expected[i], sizeof(expected_bits));
+            matching = bits[i] == expected_bits;
+        }
+        if (!matching) {std::cerr << "\033[31m[ ERROR ]\033[0m network: compile_network: compiled outputs don't match forward_pass" << (network == &packed ? " for packed layers" : "") << ".\n";return false;}
+    }
+
+    NeuralNetwork::convolution shape;
+    shape.channels = 1; shape.height = 4; shape.width = 4;
+    shape.filters = 2; shape.kernel_height = 3; shape.kernel_width = 3;
+    NeuralNetwork::network convolutional = NeuralNetwork::create_network({shape}, {3}, {activation::relu, activation::softmax}, 37);
+    // The header from the last compile has to survive both rejections untouched, with no temporary file left beside it
+    auto contents = [&]() {
+        std::ifstream header(compiledfilename, std::ios::binary);
+        return std::string((std::istreambuf_iterator<char>(header)), std::istreambuf_iterator<char>());
+    };
+    auto leftovers = [&]() {
+        for (const fs::directory_entry& entry : fs::directory_iterator(".")) {
+            if (entry.path().filename().string().rfind(std::string(compiledfilename) + ".", 0) == 0) return true;
+        }
+        return false;
+    };
+    std::string existing = contents();
+    NeuralNetwork::compile_network(compiledfilename, convolutional, "convolution");
+    if (contents() != existing || leftovers()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: compile_network: a rejected convolution changed the existing header.\n";return false;}
+    NeuralNetwork::network broken = compiled;
+    broken.layers[1].weights[5] = std::numeric_limits<float>::quiet_NaN();
+    NeuralNetwork::compile_network(compiledfilename, broken, "broken");
+    if (contents() != existing || leftovers()) {std::cerr << "\033[31m[ ERROR ]\033[0m network: compile_network: a rejected non-finite weight changed the existing header.\n";return false;}
+    fs::remove(compiledfilename);
+
     return true;
 }
 
 bool network() {
     bool success = true;
-    // insert_bytes
+    // create_network
     if (!create_network()) {
         std::cout << "\033[31m[ FAILED ]\033[0m network: create_network()\n";
         std::cout << "\033[31m[ FATAL ]\033[0m network: create_network() was required for further tests, quitting network test.\n";
         success = false;
     } else {
         std::cout << "\033[32m[ PASSED ]\033[0m network: create_network()\n";
+
+        // seeded_network
+        if (!seeded_network()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: seeded_network()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: seeded_network()\n";
+        }
+
+        // model_handle
+        if (!model_handle()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: model_handle()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: model_handle()\n";
+        }
+
+        // load_dataset
+        if (!load_dataset()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: load_dataset()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: load_dataset()\n";
+        }
+
+        // ring_training
+        if (!ring_training()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: ring_training()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: ring_training()\n";
+        }
+
+        // pipeline_network
+        if (!pipeline_network()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: pipeline_network()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: pipeline_network()\n";
+        }
+
+        // numa_replicas
+        if (!numa_replicas()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: numa_replicas()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: numa_replicas()\n";
+        }
+
+        // convolution_network
+        if (!convolution_network()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: convolution_network()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: convolution_network()\n";
+        }
+
+        // embedding_network
+        if (!embedding_network()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: embedding_network()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: embedding_network()\n";
+        }
+
+        // evaluate_network
+        if (!evaluate_network()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: evaluate_network()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: evaluate_network()\n";
+        }
+
+        // pmr_allocation
+        if (!pmr_allocation()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: pmr_allocation()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: pmr_allocation()\n";
+        }
+
+        // inference_cache
+        if (!inference_cache()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: inference_cache()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: inference_cache()\n";
+        }
+
+        // tune_network
+        if (!tune_network()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: tune_network()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: tune_network()\n";
+        }
+
+        // compile_network
+        if (!compile_network()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: compile_network()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: compile_network()\n";
+        }
+
+        // forward_pass
+        if (!forward_pass()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: forward_pass()\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: forward_pass()\n";
+        }
+
+        // save_network
+        if (!save_network()) {
+            std::cout << "\033[31m[ FAILED ]\033[0m network: save_network()\n";
+            std::cout << "\033[31m[ FATAL ]\033[0m network: save_network() was required for further tests, quitting network test.\n";
+            success = false;
+        } else {
+            std::cout << "\033[32m[ PASSED ]\033[0m network: save_network()\n";
+
+            // load_network
+            if (!load_network()) {
+                std::cout << "\033[31m[ FAILED ]\033[0m network: load_network()\n";
+                success = false;
+            } else {
+                std::cout << "\033[32m[ PASSED ]\033[0m network: load_network()\n";
+            }
+
+            // prepack_network
+            if (!prepack_network()) {
+                std::cout << "\033[31m[ FAILED ]\033[0m network: prepack_network()\n";
+                success = false;
+            } else {
+                std::cout << "\033[32m[ PASSED ]\033[0m network: prepack_network()\n";
+            }
+
+            // prune_network
+            if (!prune_network()) {
+                std::cout << "\033[31m[ FAILED ]\033[0m network: prune_network()\n";
+                success = false;
+            } else {
+                std::cout << "\033[32m[ PASSED ]\033[0m network: prune_network()\n";
+            }
+
+            // train_network
+            if (!train_network()) {
+                std::cout << "\033[31m[ FAILED ]\033[0m network: train_network()\n";
+                success = false;
+            } else {
+                std::cout << "\033[32m[ PASSED ]\033[0m network: train_network()\n";
+            }
+
+            // append_network
+            if (!append_network()) {
+                std::cout << "\033[31m[ FAILED ]\033[0m network: append_network()\n";
+                success = false;
+            } else {
+                std::cout << "\033[32m[ PASSED ]\033[0m network: append_network()\n";
+            }
+
+            // diff_network
+            if (!diff_network()) {
+                std::cout << "\033[31m[ FAILED ]\033[0m network: diff_network()\n";
+                success = false;
+            } else {
+                std::cout << "\033[32m[ PASSED ]\033[0m network: diff_network()\n";
+            }
+
+            // model_registry
+            if (!model_registry()) {
+                std::cout << "\033[31m[ FAILED ]\033[0m network: model_registry()\n";
+                success = false;
+            } else {
+                std::cout << "\033[32m[ PASSED ]\033[0m network: model_registry()\n";
+            }
+        }
+    }
+    if (!success) {std::cout << "\033[33m[ NOTICE ]\033[0m network: \033[1msome tests failed, check the network test file \"" << networktestfilename << "\" at the working directory.\033[0m" << std::endl;}
+    else {
+        try {
+            fs::remove(networktestfilename);
+        } catch (const fs::filesystem_error& e) {
+            std::cerr << "\033[31m[ ERROR ]\033[0m network: failed to delete file, error message: \"" << e.what() << "\"" << std::endl;
+        }
     }
-    if (!success) {std::cout << "\033[33m[ NOTICE ]\033[0m network: \033[1msome tests failed, check the binary test file \"" << 404 << "\" at the working directory.\033[0m" << std::endl;}
-    else {}
 
     return success;
 }
\ No newline at end of file
@@ -0,0 +1,218 @@
+/*
+        Project:        eznet
+        File Purpose:   Binary Stress Tests
+        Author:         Nicholas Fortune
+        Created:        19-10-2026
+        First Release:  19-10-2026
+        Updated:        --
+
+        Description:    Round trips large .bin files with many blocks through the binary and network functions,
+                        checking for bit-exact results within time and peak memory budgets
+
+        Notes:          Refer to docs/BINARY.txt for more details about the binary system. Peak memory is measured with
+                        /proc/self/clear_refs and VmHWM, the memory budgets are skipped where those aren't available
+                        and under sanitizers
+
+        -------------------------------------
+
+        © Nicholas Fortune 2025, all rights reserved.
+*/
+
+#include <fstream>
+#include <filesystem>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include "../tests/stress.h"
+#include "../include/eznet.h"
+
+namespace fs = std::filesystem;
+char stresstestfilename[] = "stress_test_file.binary";
+char stressblocksfilename[] = "stress_test_file_blocks.binary";
+
+// Budgets: every pass over a file may take a fixed 5 seconds plus 1 second per 32 MiB, and may use 16 MiB plus an eighth of the file on top of what it returns
+double time_budget(uint64_t bytes) {
+    return 5.0 + static_cast<double>(bytes) / (32.0 * 1024 * 1024);
+}
+uint64_t memory_budget(uint64_t bytes) {
+    return (uint64_t(16) << 20) + bytes / 8;
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Reads a "Name:   123 kB" line of /proc/self/status in bytes, 0 when it's missing
+uint64_t status_bytes(const char* name) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, std::strlen(name), name) == 0) return std::stoull(line.substr(std::strlen(name) + 1)) * 1024;
+    }
+    return 0;
+}
+
+// Resets the peak resident set size to the current one, returns false when the kernel doesn't support it
+bool reset_peak() {
+    std::ofstream clear("/proc/self/clear_refs");
+    clear << "5";
+    clear.close();
+    return clear.good() && status_bytes("VmHWM:") != 0 && status_bytes("VmHWM:") <= status_bytes("VmRSS:") + (uint64_t(1) << 20);
+}
+
+bool same_bits(const std::vector<float>& a, const std::vector<float>& b) {
+    return a.size() == b.size() && (a.empty() || std::memcmp(a.data(), b.data(), a.size() * sizeof(float)) == 0);
+}
+
+bool stress_round_trip(uint64_t bytes, bool measure_memory) {
+    using activation = NeuralNetwork::activation_type;
+
+    /* Expected results:
+    a network of 16 square layers holding about the given amount of bytes saves and loads back bit for bit, within the time and memory budgets
+    growing the first block by one float shifts every later block intact, and shrinking it back leaves a file that loads back bit for bit
+    */
+    uint32_t width = static_cast<uint32_t>(std::sqrt(static_cast<double>(bytes) / (16 * sizeof(float))));
+    if (width < 8) width = 8;
+    std::vector<uint32_t> layers(17, width);
+    std::vector<activation> activations(16, activation::relu);
+    NeuralNetwork::network original = NeuralNetwork::create_network(layers, activations, 7);
+    uint64_t file_bytes = uint64_t(16) * width * (width + 1) * sizeof(float);
+    std::cout << "\033[33m[ NOTICE ]\033[0m stress: round trip: " << (file_bytes >> 20) << " MiB over " << original.layers.size() * 2 << " blocks\n";
+
+    // save_network
+    uint64_t resident = status_bytes("VmRSS:");
+    measure_memory = measure_memory && reset_peak();
+    auto start = std::chrono::steady_clock::now();
+    NeuralNetwork::save_network(stresstestfilename, original);
+    double taken = seconds_since(start);
+    uint64_t peak = status_bytes("VmHWM:");
+    uint64_t saved_size = fs::exists(stresstestfilename) ? fs::file_size(stresstestfilename) : 0;
+    if (saved_size < file_bytes) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: save_network: file wasn't written in full.\n";return false;}
+    if (taken > time_budget(file_bytes)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: save_network: took " << taken << "s, over the " << time_budget(file_bytes) << "s budget.\n";return false;}
+    if (measure_memory && peak > resident + memory_budget(file_bytes)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: save_network: peak memory grew by " << ((peak - resident) >> 20) << " MiB, over the " << (memory_budget(file_bytes) >> 20) << " MiB budget.\n";return false;}
+
+    // load_network, the loaded network itself is the only memory it should keep
+    resident = status_bytes("VmRSS:");
+    measure_memory = measure_memory && reset_peak();
+    start = std::chrono::steady_clock::now();
+    NeuralNetwork::network loaded = NeuralNetwork::load_network(stresstestfilename);
+    taken = seconds_since(start);
+    peak = status_bytes("VmHWM:");
+    if (taken > time_budget(file_bytes)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: load_network: took " << taken << "s, over the " << time_budget(file_bytes) << "s budget.\n";return false;}
+    if (measure_memory && peak > resident + file_bytes + memory_budget(file_bytes)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: load_network: peak memory grew by " << ((peak - resident) >> 20) << " MiB, over the " << ((file_bytes + memory_budget(file_bytes)) >> 20) << " MiB budget.\n";return false;}
+    if (loaded.layers.size() != original.layers.size() || NeuralNetwork::read_config_record(loaded.config_data, NeuralNetwork::config_activations) != NeuralNetwork::read_config_record(original.config_data, NeuralNetwork::config_activations) || NeuralNetwork::read_config_record(loaded.config_data, NeuralNetwork::config_seed) != NeuralNetwork::read_config_record(original.config_data, NeuralNetwork::config_seed)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: load_network: layers or config data don't match.\n";return false;}
+    for (size_t l = 0; l < original.layers.size(); l++) {
+        if (!same_bits(loaded.layers[l].weights, original.layers[l].weights) || !same_bits(loaded.layers[l].biases, original.layers[l].biases)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: load_network: layer " << l << " isn't bit-exact.\n";return false;}
+    }
+    loaded = NeuralNetwork::network{};
+
+    // write_block, growing and then shrinking the first block moves everything after it
+    std::vector<float> grown = original.layers[0].biases;
+    grown.push_back(1.5f);
+    resident = status_bytes("VmRSS:");
+    measure_memory = measure_memory && reset_peak();
+    start = std::chrono::steady_clock::now();
+    NeuralNetwork::write_block(stresstestfilename, 0, grown);
+    taken = seconds_since(start);
+    peak = status_bytes("VmHWM:");
+    if (taken > time_budget(file_bytes)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: write_block: growing block 0 took " << taken << "s, over the " << time_budget(file_bytes) << "s budget.\n";return false;}
+    if (measure_memory && peak > resident + memory_budget(file_bytes)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: write_block: peak memory grew by " << ((peak - resident) >> 20) << " MiB, over the " << (memory_budget(file_bytes) >> 20) << " MiB budget.\n";return false;}
+
+    // read_block
+    start = std::chrono::steady_clock::now();
+    if (!same_bits(NeuralNetwork::read_block(stresstestfilename, 0), grown)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: read_block: grown block 0 isn't bit-exact.\n";return false;}
+    for (size_t l = 0; l < original.layers.size(); l++) {
+        if (l != 0 && !same_bits(NeuralNetwork::read_block(stresstestfilename, static_cast<uint32_t>(l * 2)), original.layers[l].biases)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: read_block: block " << l * 2 << " isn't bit-exact after the shift.\n";return false;}
+        if (!same_bits(NeuralNetwork::read_block(stresstestfilename, static_cast<uint32_t>(l * 2 + 1)), original.layers[l].weights)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: read_block: block " << l * 2 + 1 << " isn't bit-exact after the shift.\n";return false;}
+    }
+    taken = seconds_since(start);
+    if (taken > time_budget(file_bytes)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: read_block: reading every block took " << taken << "s, over the " << time_budget(file_bytes) << "s budget.\n";return false;}
+
+    start = std::chrono::steady_clock::now();
+    NeuralNetwork::write_block(stresstestfilename, 0, original.layers[0].biases);
+    taken = seconds_since(start);
+    if (taken > time_budget(file_bytes)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: write_block: shrinking block 0 took " << taken << "s, over the " << time_budget(file_bytes) << "s budget.\n";return false;}
+    if (fs::file_size(stresstestfilename) != saved_size || NeuralNetwork::read_block(stresstestfilename, 0).size() != original.layers[0].biases.size()) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: write_block: block 0 wasn't shrunk back.\n";return false;}
+
+    loaded = NeuralNetwork::load_network(stresstestfilename);
+    for (size_t l = 0; l < original.layers.size(); l++) {
+        if (l >= loaded.layers.size() || !same_bits(loaded.layers[l].weights, original.layers[l].weights) || !same_bits(loaded.layers[l].biases, original.layers[l].biases)) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: write_block: layer " << l << " isn't bit-exact after shrinking block 0 back.\n";return false;}
+    }
+
+    fs::remove(stresstestfilename);
+    return true;
+}
+
+bool stress_blocks(uint32_t count) {
+    /* Expected results:
+    count blocks of varying sizes appended one by one to a new file read back bit for bit
+    after every seventh block is rewritten with a different size, every block still reads back bit for bit
+    */
+    NeuralNetwork::new_bin(stressblocksfilename);
+    std::vector<std::vector<float>> blocks(count);
+    for (uint32_t b = 0; b < count; b++) {
+        blocks[b].resize((b * 37) % 1024 + 1);
+        for (size_t i = 0; i < blocks[b].size(); i++) blocks[b][i] = static_cast<float>(b) + static_cast<float>(i) / 1024.0f;
+        NeuralNetwork::write_block(stressblocksfilename, b, blocks[b]);
+    }
+
+    std::fstream file(stressblocksfilename, std::ios::in | std::ios::binary);
+    NeuralNetwork::file_metadata metadata = NeuralNetwork::read_metadata(file);
+    file.close();
+    if (metadata.blocks != count) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: blocks: file has " << metadata.blocks << " blocks instead of " << count << ".\n";return false;}
+    for (uint32_t b = 0; b < count; b++) {
+        if (!same_bits(NeuralNetwork::read_block(stressblocksfilename, b), blocks[b])) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: blocks: block " << b << " isn't bit-exact.\n";return false;}
+    }
+
+    for (uint32_t b = 0; b < count; b += 7) {
+        blocks[b].resize((b * 53) % 2048 + 1, -static_cast<float>(b));
+        NeuralNetwork::write_block(stressblocksfilename, b, blocks[b]);
+    }
+    for (uint32_t b = 0; b < count; b++) {
+        if (!same_bits(NeuralNetwork::read_block(stressblocksfilename, b), blocks[b])) {std::cerr << "\033[31m[ ERROR ]\033[0m stress: blocks: block " << b << " isn't bit-exact after rewriting.\n";return false;}
+    }
+
+    fs::remove(stressblocksfilename);
+    return true;
+}
+
+// Sanitizers' shadow memory grows with every byte touched, so resident memory says nothing about the library under them
+#if defined(__SANITIZE_ADDRESS__) || defined(__SANITIZE_THREAD__)
+const bool sanitized = true;
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(thread_sanitizer)
+const bool sanitized = true;
+#else
+const bool sanitized = false;
+#endif
+#else
+const bool sanitized = false;
+#endif
+
+bool stress(uint64_t megabytes) {
+    bool success = true;
+    bool measure_memory = !sanitized && reset_peak();
+    if (sanitized) std::cout << "\033[33m[ NOTICE ]\033[0m stress: built with a sanitizer, memory budgets are skipped\n";
+    else if (!measure_memory) std::cout << "\033[33m[ NOTICE ]\033[0m stress: peak memory can't be reset on this system, memory budgets are skipped\n";
+
+    // stress_blocks
+    if (!stress_blocks(512)) {
+        std::cout << "\033[31m[ FAILED ]\033[0m stress: stress_blocks()\n";
+        success = false;
+    } else {
+        std::cout << "\033[32m[ PASSED ]\033[0m stress: stress_blocks()\n";
+    }
+
+    // stress_round_trip
+    if (!stress_round_trip(megabytes << 20, measure_memory)) {
+        std::cout << "\033[31m[ FAILED ]\033[0m stress: stress_round_trip()\n";
+        success = false;
+    } else {
+        std::cout << "\033[32m[ PASSED ]\033[0m stress: stress_round_trip()\n";
+    }
+
+    return success;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+#include <cstdint>
+
+// Round trips a network of about the given amount of megabytes, the test manager runs it small and "eznet test stress" at any size
+bool stress(uint64_t megabytes);
\ No newline at end of file